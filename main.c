@@ -21,323 +21,6161 @@ Execução:
 #include <math.h>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
+#include <SDL3/SDL_intrin.h>
 #include <SDL3_image/SDL_image.h>
 #include <SDL3_ttf/SDL_ttf.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define NIVEIS 256
 
+typedef struct ArquivoMapeado ArquivoMapeado;
+
+/* Imagem interna de processamento: um plano de luma de 8 bits e, opcionalmente,
+   um plano de alfa separado. Só vira SDL_Surface na hora de exibir ou salvar. */
+typedef struct
+{
+    int largura;
+    int altura;
+    int passo;   // bytes por linha: múltiplo de 64, ou o do arquivo quando mapeada
+    Uint8 *dados;
+    Uint8 *alfa; // NULL quando a imagem é opaca
+    ArquivoMapeado *mapeamento; // dados apontam para dentro de um arquivo mapeado
+} ImagemCinza;
+
+static inline Uint8 *linha_cinza(const ImagemCinza *img, int y)
+{
+    return img->dados + (size_t)y * img->passo;
+}
+
+static inline Uint8 *linha_alfa(const ImagemCinza *img, int y)
+{
+    return img->alfa + (size_t)y * img->passo;
+}
+
+/* Cinza de alta profundidade (PGM de 9 a 16 bits): amostras nativas de 16 bits,
+   de 0 a `maximo` (o maxval do arquivo). Sem alfa; para exibir, vira ImagemCinza. */
+typedef struct
+{
+    int largura;
+    int altura;
+    int passo; // bytes por linha, múltiplo de 64
+    Uint16 *dados;
+    int maximo;
+} ImagemCinza16;
+
+static inline Uint16 *linha_cinza16(const ImagemCinza16 *img, int y)
+{
+    return (Uint16 *)((Uint8 *)img->dados + (size_t)y * img->passo);
+}
+
+/* Imagem lógica em grade de ladrilhos, cada um uma ImagemCinza com alocação
+   própria: o total não precisa caber numa única alocação nem numa SDL_Surface.
+   Os ladrilhos têm largura_ladrilho x altura_ladrilho, menos os da última coluna
+   e da última linha, que podem ser menores. Contagens de pixels são de 64 bits. */
+typedef struct
+{
+    int largura; // da imagem inteira
+    int altura;
+    int largura_ladrilho;
+    int altura_ladrilho;
+    int colunas;
+    int linhas;
+    ImagemCinza **ladrilhos; // colunas * linhas, linha a linha da grade
+} ImagemLadrilhada;
+
+static inline ImagemCinza **ladrilho(const ImagemLadrilhada *img, int coluna, int linha)
+{
+    return &img->ladrilhos[(size_t)linha * img->colunas + coluna];
+}
+
+/* --------- arquivos mapeados na memória ----------
+   Leitura em cópia na escrita (o arquivo nunca é alterado) ou criação de um
+   arquivo novo de tamanho fixo, compartilhado com o disco. Depois de mapeado, o
+   descritor pode ser fechado; o mapeamento vive até desmapear_arquivo. Na
+   criação o espaço em disco é reservado antes do mapeamento: com o disco cheio,
+   escrever numa página sem bloco alocado derrubaria o processo com SIGBUS. */
+struct ArquivoMapeado
+{
+    Uint8 *base;
+    size_t tamanho;
+};
+
+#ifndef _WIN32
+// Aloca os blocos e fixa o tamanho do arquivo; devolve 0 ou o código de erro
+static int reservar_espaco(int fd, size_t tamanho)
+{
+    if (tamanho == 0)
+        return 0;
+#ifdef __APPLE__
+    fstore_t reserva = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)tamanho, 0};
+    if (fcntl(fd, F_PREALLOCATE, &reserva) == -1)
+        return errno;
+    return ftruncate(fd, (off_t)tamanho) == 0 ? 0 : errno;
+#else
+    return posix_fallocate(fd, 0, (off_t)tamanho);
+#endif
+}
+#endif
+
+ArquivoMapeado *mapear_arquivo(const char *caminho, bool criar, size_t tamanho)
+{
+    ArquivoMapeado *m = SDL_calloc(1, sizeof(ArquivoMapeado));
+    if (!m)
+        return NULL;
+#ifdef _WIN32
+    int n = MultiByteToWideChar(CP_UTF8, 0, caminho, -1, NULL, 0);
+    WCHAR *caminho_w = n > 0 ? SDL_malloc(n * sizeof(WCHAR)) : NULL;
+    HANDLE arquivo = INVALID_HANDLE_VALUE;
+    if (caminho_w && MultiByteToWideChar(CP_UTF8, 0, caminho, -1, caminho_w, n) > 0)
+        arquivo = criar ? CreateFileW(caminho_w, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)
+                        : CreateFileW(caminho_w, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    SDL_free(caminho_w);
+    LARGE_INTEGER tam = {0};
+    if (arquivo != INVALID_HANDLE_VALUE && !criar && GetFileSizeEx(arquivo, &tam))
+        tamanho = (size_t)tam.QuadPart;
+    tam.QuadPart = (LONGLONG)tamanho;
+    HANDLE mapa = arquivo == INVALID_HANDLE_VALUE || tamanho == 0 ? NULL
+                  : CreateFileMappingW(arquivo, NULL, criar ? PAGE_READWRITE : PAGE_WRITECOPY,
+                                       (DWORD)(tam.QuadPart >> 32), (DWORD)tam.QuadPart, NULL);
+    m->base = mapa ? MapViewOfFile(mapa, criar ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, tamanho) : NULL;
+    if (!m->base)
+        SDL_SetError("Erro ao mapear '%s' (código %lu)", caminho, (unsigned long)GetLastError());
+    if (mapa)
+        CloseHandle(mapa);
+    if (arquivo != INVALID_HANDLE_VALUE)
+        CloseHandle(arquivo);
+#else
+    int fd = criar ? open(caminho, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(caminho, O_RDONLY);
+    struct stat st;
+    bool ok = fd >= 0;
+    if (ok && !criar && (ok = fstat(fd, &st) == 0))
+        tamanho = (size_t)st.st_size;
+    if (ok && criar)
+    {
+        int erro = reservar_espaco(fd, tamanho);
+        if (erro)
+        {
+            SDL_SetError("Erro ao reservar espaço para '%s': %s", caminho, strerror(erro));
+            close(fd);
+            unlink(caminho);
+            SDL_free(m);
+            return NULL;
+        }
+    }
+    if (ok && tamanho > 0)
+    {
+        void *p = mmap(NULL, tamanho, PROT_READ | PROT_WRITE, criar ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            m->base = p;
+            if (!criar)
+                posix_madvise(p, tamanho, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+    if (!m->base)
+        SDL_SetError("Erro ao mapear '%s': %s", caminho, tamanho == 0 && ok ? "arquivo vazio" : strerror(errno));
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (!m->base)
+    {
+        SDL_free(m);
+        return NULL;
+    }
+    m->tamanho = tamanho;
+    return m;
+}
+
+// Espera as páginas alteradas chegarem ao arquivo; é aqui que um erro de escrita aparece
+bool sincronizar_arquivo(ArquivoMapeado *m)
+{
+#ifdef _WIN32
+    if (!FlushViewOfFile(m->base, m->tamanho))
+        return SDL_SetError("Erro ao gravar o arquivo mapeado (código %lu)", (unsigned long)GetLastError());
+#else
+    if (msync(m->base, m->tamanho, MS_SYNC) != 0)
+        return SDL_SetError("Erro ao gravar o arquivo mapeado: %s", strerror(errno));
+#endif
+    return true;
+}
+
+void desmapear_arquivo(ArquivoMapeado *m)
+{
+    if (!m)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(m->base);
+#else
+    munmap(m->base, m->tamanho);
+#endif
+    SDL_free(m);
+}
+
+void destruir_imagem_cinza(ImagemCinza *img)
+{
+    if (!img)
+        return;
+    if (img->mapeamento)
+        desmapear_arquivo(img->mapeamento);
+    else
+        SDL_aligned_free(img->dados);
+    SDL_aligned_free(img->alfa);
+    SDL_free(img);
+}
+
+ImagemCinza *criar_imagem_cinza(int largura, int altura, bool com_alfa)
+{
+    ImagemCinza *img = SDL_calloc(1, sizeof(ImagemCinza));
+    if (!img)
+        return NULL;
+    img->largura = largura;
+    img->altura = altura;
+    img->passo = (largura + 63) & ~63;
+
+    size_t tamanho = (size_t)img->passo * (size_t)altura;
+    img->dados = SDL_aligned_alloc(64, tamanho ? tamanho : 64);
+    if (com_alfa)
+        img->alfa = SDL_aligned_alloc(64, tamanho ? tamanho : 64);
+    if (!img->dados || (com_alfa && !img->alfa))
+    {
+        SDL_SetError("Sem memória para imagem %dx%d", largura, altura);
+        destruir_imagem_cinza(img);
+        return NULL;
+    }
+    return img;
+}
+
+void destruir_imagem_cinza16(ImagemCinza16 *img)
+{
+    if (!img)
+        return;
+    SDL_aligned_free(img->dados);
+    SDL_free(img);
+}
+
+ImagemCinza16 *criar_imagem_cinza16(int largura, int altura, int maximo)
+{
+    ImagemCinza16 *img = SDL_calloc(1, sizeof(ImagemCinza16));
+    if (!img)
+        return NULL;
+    img->largura = largura;
+    img->altura = altura;
+    img->maximo = maximo;
+    img->passo = (int)(((Sint64)largura * 2 + 63) & ~63);
+
+    size_t tamanho = (size_t)img->passo * (size_t)altura;
+    img->dados = SDL_aligned_alloc(64, tamanho ? tamanho : 64);
+    if (!img->dados)
+    {
+        SDL_SetError("Sem memória para imagem %dx%d de 16 bits", largura, altura);
+        destruir_imagem_cinza16(img);
+        return NULL;
+    }
+    return img;
+}
+
+void destruir_imagem_ladrilhada(ImagemLadrilhada *img)
+{
+    if (!img)
+        return;
+    for (size_t i = 0; img->ladrilhos && i < (size_t)img->colunas * img->linhas; i++)
+        destruir_imagem_cinza(img->ladrilhos[i]);
+    SDL_free(img->ladrilhos);
+    SDL_free(img);
+}
+
+// Só a grade, com todos os ladrilhos vazios; validar_imagem_ladrilhada fecha as dimensões
+ImagemLadrilhada *criar_imagem_ladrilhada(int colunas, int linhas)
+{
+    ImagemLadrilhada *img = SDL_calloc(1, sizeof(ImagemLadrilhada));
+    if (!img)
+        return NULL;
+    img->colunas = colunas;
+    img->linhas = linhas;
+    img->ladrilhos = SDL_calloc((size_t)colunas * linhas, sizeof(ImagemCinza *));
+    if (!img->ladrilhos)
+    {
+        SDL_free(img);
+        return NULL;
+    }
+    return img;
+}
+
+/* Confere se a grade está completa e se cada ladrilho tem o tamanho da sua
+   coluna e da sua linha; preenche as dimensões da imagem inteira. */
+bool validar_imagem_ladrilhada(ImagemLadrilhada *img)
+{
+    for (int l = 0; l < img->linhas; l++)
+        for (int c = 0; c < img->colunas; c++)
+            if (!*ladrilho(img, c, l))
+                return SDL_SetError("Falta o ladrilho da linha %d, coluna %d", l, c);
+
+    img->largura_ladrilho = (*ladrilho(img, 0, 0))->largura;
+    img->altura_ladrilho = (*ladrilho(img, 0, 0))->altura;
+    int ultima_largura = (*ladrilho(img, img->colunas - 1, 0))->largura;
+    int ultima_altura = (*ladrilho(img, 0, img->linhas - 1))->altura;
+    for (int l = 0; l < img->linhas; l++)
+        for (int c = 0; c < img->colunas; c++)
+        {
+            const ImagemCinza *t = *ladrilho(img, c, l);
+            int largura = c + 1 < img->colunas ? img->largura_ladrilho : ultima_largura;
+            int altura = l + 1 < img->linhas ? img->altura_ladrilho : ultima_altura;
+            if (t->largura != largura || t->altura != altura || largura > img->largura_ladrilho ||
+                altura > img->altura_ladrilho)
+                return SDL_SetError("Ladrilho da linha %d, coluna %d tem %dx%d; esperado %dx%d", l, c,
+                                    t->largura, t->altura, largura, altura);
+        }
+
+    Sint64 largura = (Sint64)img->largura_ladrilho * (img->colunas - 1) + ultima_largura;
+    Sint64 altura = (Sint64)img->altura_ladrilho * (img->linhas - 1) + ultima_altura;
+    if (largura > SDL_MAX_SINT32 || altura > SDL_MAX_SINT32)
+        return SDL_SetError("Mosaico grande demais: %" SDL_PRIs64 "x%" SDL_PRIs64, largura, altura);
+    img->largura = (int)largura;
+    img->altura = (int)altura;
+    return true;
+}
+
+/* --------- pool de trabalhadores ----------
+   Threads criadas uma vez na inicialização e compartilhadas por todos os kernels.
+   Um trabalho é uma altura dividida em faixas de `grao` linhas. As faixas são
+   repartidas em intervalos contíguos, um por trabalhador; cada um consome o seu
+   pela frente e, quando esvazia, rouba a metade final do intervalo de outro.
+   `trabalhador` identifica a thread, de 0 a n-1, para que cada uma acumule em
+   estruturas próprias. */
+typedef void (*tarefa_faixa_fn)(void *ctx, int y0, int y1, int trabalhador);
+
+#define MAX_TRABALHADORES 64
+
+/* Intervalo [inicio, fim) de faixas de um trabalhador, numa linha de cache própria:
+   o alinhamento vale também para o vetor dentro do pool, que é estático */
+typedef struct
+{
+    _Alignas(64) SDL_SpinLock trava;
+    int inicio;
+    int fim;
+    char preenchimento[64 - sizeof(SDL_SpinLock) - 2 * sizeof(int)];
+} FilaFaixas;
+SDL_COMPILE_TIME_ASSERT(fila_faixas_linha_de_cache, sizeof(FilaFaixas) == 64);
+
+static struct
+{
+    SDL_Thread *threads[MAX_TRABALHADORES];
+    int num_trabalhadores; // inclui a thread que submete o trabalho
+    SDL_Mutex *mutex;
+    SDL_Mutex *em_uso; // um trabalho por vez; chamadas concorrentes rodam na própria thread
+    SDL_Condition *cond_inicio;
+    SDL_Condition *cond_fim;
+    Uint32 geracao;
+    int pendentes;
+    bool encerrar;
+
+    tarefa_faixa_fn fn;
+    void *ctx;
+    int altura;
+    int grao;
+    FilaFaixas filas[MAX_TRABALHADORES];
+} pool = {.num_trabalhadores = 1};
+
+static int threads_configuradas = 0; // --threads; 0 = um por núcleo lógico
+static int grao_configurado = 0;     // --grao, linhas por faixa; 0 = automático
+
+static bool pegar_faixa(FilaFaixas *f, int *faixa)
+{
+    bool ok = false;
+    SDL_LockSpinlock(&f->trava);
+    if (f->inicio < f->fim)
+    {
+        *faixa = f->inicio++;
+        ok = true;
+    }
+    SDL_UnlockSpinlock(&f->trava);
+    return ok;
+}
+
+// Rouba a metade final (arredondada para cima) do intervalo da vítima
+static bool roubar_faixas(FilaFaixas *vitima, int *inicio, int *fim)
+{
+    bool ok = false;
+    SDL_LockSpinlock(&vitima->trava);
+    int restantes = vitima->fim - vitima->inicio;
+    if (restantes > 0)
+    {
+        *fim = vitima->fim;
+        *inicio = vitima->fim - (restantes + 1) / 2;
+        vitima->fim = *inicio;
+        ok = true;
+    }
+    SDL_UnlockSpinlock(&vitima->trava);
+    return ok;
+}
+
+static void executar_faixa(int faixa, int trabalhador)
+{
+    int y0 = faixa * pool.grao;
+    int y1 = y0 + pool.grao < pool.altura ? y0 + pool.grao : pool.altura;
+    pool.fn(pool.ctx, y0, y1, trabalhador);
+}
+
+/* Como nenhuma faixa nova surge durante o trabalho, quem não encontra nada em
+   nenhuma fila pode parar: o que ainda falta já está com outro trabalhador. */
+static void processar_faixas(int trabalhador)
+{
+    FilaFaixas *propria = &pool.filas[trabalhador];
+    const int n = pool.num_trabalhadores;
+    for (;;)
+    {
+        int faixa;
+        while (pegar_faixa(propria, &faixa))
+            executar_faixa(faixa, trabalhador);
+
+        int inicio = 0, fim = 0;
+        bool roubou = false;
+        for (int k = 1; k < n && !roubou; k++)
+            roubou = roubar_faixas(&pool.filas[(trabalhador + k) % n], &inicio, &fim);
+        if (!roubou)
+            break;
+
+        // A primeira faixa roubada roda já; o resto fica visível para outros ladrões
+        SDL_LockSpinlock(&propria->trava);
+        propria->inicio = inicio + 1;
+        propria->fim = fim;
+        SDL_UnlockSpinlock(&propria->trava);
+        executar_faixa(inicio, trabalhador);
+    }
+}
+
+static int SDLCALL laco_trabalhador(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    Uint32 geracao_vista = 0;
+
+    SDL_LockMutex(pool.mutex);
+    for (;;)
+    {
+        while (!pool.encerrar && pool.geracao == geracao_vista)
+            SDL_WaitCondition(pool.cond_inicio, pool.mutex);
+        if (pool.encerrar)
+            break;
+        geracao_vista = pool.geracao;
+        SDL_UnlockMutex(pool.mutex);
+
+        processar_faixas(id);
+
+        SDL_LockMutex(pool.mutex);
+        if (--pool.pendentes == 0)
+            SDL_SignalCondition(pool.cond_fim);
+    }
+    SDL_UnlockMutex(pool.mutex);
+    return 0;
+}
+
+// n <= 0 usa um trabalhador por núcleo lógico
+void iniciar_pool(int n)
+{
+    if (n <= 0)
+        n = SDL_GetNumLogicalCPUCores();
+    if (n > MAX_TRABALHADORES)
+        n = MAX_TRABALHADORES;
+    if (n <= 1)
+        return;
+
+    pool.encerrar = false;
+    pool.geracao = 0;
+    pool.mutex = SDL_CreateMutex();
+    pool.em_uso = SDL_CreateMutex();
+    pool.cond_inicio = SDL_CreateCondition();
+    pool.cond_fim = SDL_CreateCondition();
+    if (!pool.mutex || !pool.em_uso || !pool.cond_inicio || !pool.cond_fim)
+    {
+        fprintf(stderr, "Erro ao criar pool de threads: %s\n", SDL_GetError());
+        return;
+    }
+
+    for (int i = 1; i < n; i++)
+    {
+        pool.threads[i] = SDL_CreateThread(laco_trabalhador, "trabalhador", (void *)(intptr_t)i);
+        if (!pool.threads[i])
+        {
+            fprintf(stderr, "Erro ao criar thread: %s\n", SDL_GetError());
+            break;
+        }
+        pool.num_trabalhadores = i + 1;
+    }
+    printf("Pool de threads: %d trabalhadores\n", pool.num_trabalhadores);
+}
+
+void encerrar_pool(void)
+{
+    if (pool.mutex)
+    {
+        SDL_LockMutex(pool.mutex);
+        pool.encerrar = true;
+        SDL_BroadcastCondition(pool.cond_inicio);
+        SDL_UnlockMutex(pool.mutex);
+    }
+    for (int i = 1; i < pool.num_trabalhadores; i++)
+        SDL_WaitThread(pool.threads[i], NULL);
+    SDL_DestroyCondition(pool.cond_fim);
+    SDL_DestroyCondition(pool.cond_inicio);
+    SDL_DestroyMutex(pool.em_uso);
+    SDL_DestroyMutex(pool.mutex);
+    pool.num_trabalhadores = 1;
+    pool.mutex = pool.em_uso = NULL;
+    pool.cond_inicio = pool.cond_fim = NULL;
+}
+
+int num_trabalhadores(void)
+{
+    return pool.num_trabalhadores;
+}
+
+// Linhas por faixa: o valor de --grao ou, no automático, ~256 KiB de pixels por tarefa
+static int grao_para_largura(int largura)
+{
+    if (grao_configurado > 0)
+        return grao_configurado;
+    int grao = (256 * 1024) / (largura > 0 ? largura : 1);
+    return grao > 0 ? grao : 1;
+}
+
+// Roda fn sobre [0, altura) em faixas e só retorna quando todas terminaram
+void executar_em_faixas(int altura, int grao, tarefa_faixa_fn fn, void *ctx)
+{
+    if (altura <= 0)
+        return;
+    if (grao < 1)
+        grao = 1;
+    if (pool.num_trabalhadores <= 1 || altura <= grao || !SDL_TryLockMutex(pool.em_uso))
+    {
+        fn(ctx, 0, altura, 0);
+        return;
+    }
+
+    SDL_LockMutex(pool.mutex);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.altura = altura;
+    pool.grao = grao;
+    int n = pool.num_trabalhadores;
+    int num_faixas = (altura + grao - 1) / grao;
+    for (int t = 0; t < n; t++)
+    {
+        pool.filas[t].inicio = (int)((Sint64)num_faixas * t / n);
+        pool.filas[t].fim = (int)((Sint64)num_faixas * (t + 1) / n);
+    }
+    pool.pendentes = n - 1;
+    pool.geracao++;
+    SDL_BroadcastCondition(pool.cond_inicio);
+    SDL_UnlockMutex(pool.mutex);
+
+    processar_faixas(0);
+
+    SDL_LockMutex(pool.mutex);
+    while (pool.pendentes > 0)
+        SDL_WaitCondition(pool.cond_fim, pool.mutex);
+    SDL_UnlockMutex(pool.mutex);
+    SDL_UnlockMutex(pool.em_uso);
+}
+
+typedef struct
+{
+    const ImagemCinza *img;
+    SDL_AtomicInt transparente;
+} ContextoAlfa;
+
+static void alfa_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoAlfa *ctx = p;
+    for (int y = y0; y < y1 && !SDL_GetAtomicInt(&ctx->transparente); y++)
+    {
+        const Uint8 *a = linha_alfa(ctx->img, y);
+        for (int x = 0; x < ctx->img->largura; x++)
+            if (a[x] != 255)
+            {
+                SDL_SetAtomicInt(&ctx->transparente, 1);
+                return;
+            }
+    }
+}
+
+// Libera o plano de alfa quando todos os pixels são opacos
+static void descartar_alfa_opaco(ImagemCinza *img)
+{
+    if (!img->alfa)
+        return;
+    ContextoAlfa ctx = {.img = img};
+    executar_em_faixas(img->altura, grao_para_largura(img->largura), alfa_faixa, &ctx);
+    if (SDL_GetAtomicInt(&ctx.transparente))
+        return;
+    SDL_aligned_free(img->alfa);
+    img->alfa = NULL;
+}
+
 static int eh_cinza(Uint8 r, Uint8 g, Uint8 b)
 {
-    return (r == g && g == b);
+    return (r == g && g == b);
+}
+
+/* --------- motor de conversão para cinza ----------
+   Cada formato comum tem um kernel próprio que percorre as linhas de pixels/pitch
+   diretamente; o kernel é escolhido uma única vez por imagem. Formatos fora da
+   lista caem no caminho genérico com SDL_ReadSurfacePixel. */
+
+// Luma BT.709 com o arredondamento em double usado desde a primeira versão
+static Uint8 luma_referencia(Uint8 r, Uint8 g, Uint8 b)
+{
+    if (eh_cinza(r, g, b))
+        return r;
+    double y_val = 0.2125 * r + 0.7154 * g + 0.0721 * b;
+    if (y_val < 0)
+        y_val = 0;
+    if (y_val > 255)
+        y_val = 255;
+    return (Uint8)(y_val + 0.5);
+}
+
+// Mesma luma em inteiros (pesos x 10000). Nos empates exatos em .5 o double pode
+// arredondar para baixo, então só esses casos recorrem à referência.
+static inline Uint8 luma_bt709(Uint8 r, Uint8 g, Uint8 b)
+{
+    Uint32 n = 2125u * r + 7154u * g + 721u * b + 5000u;
+    Uint32 q = n / 10000u;
+    if (q * 10000u == n)
+        return luma_referencia(r, g, b);
+    return (Uint8)q;
+}
+
+/* Os kernels de luma leem uma linha do formato de origem e produzem uma linha de
+   luma de 8 bits. Todas as variantes vetoriais calculam n = 2125r + 7154g + 721b + 5000
+   em inteiros de 32 bits e dividem por 10000 em float (exato para n < 2^23); blocos
+   que contêm um empate em .5 são refeitos pelo kernel escalar. */
+
+// Posição de cada canal dentro do pixel, em bytes na ordem da memória
+typedef struct
+{
+    int bpp; // 3 ou 4
+    int oR, oG, oB;
+    int oA; // -1 quando não há alfa (RGB24 ou byte de preenchimento)
+} LayoutPixel;
+
+typedef void (*kernel_luma_fn)(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay);
+
+// Kernel de referência, mantido para verificar os demais
+static void luma_linha_referencia(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay)
+{
+    for (int x = 0; x < largura; x++, src += lay->bpp)
+        luma[x] = luma_referencia(src[lay->oR], src[lay->oG], src[lay->oB]);
+}
+
+static void luma_linha_escalar(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay)
+{
+    const int bpp = lay->bpp, oR = lay->oR, oG = lay->oG, oB = lay->oB;
+    for (int x = 0; x < largura; x++, src += bpp)
+        luma[x] = luma_bt709(src[oR], src[oG], src[oB]);
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+// 4 lumas em lanes de 32 bits; rg = r | g << 16 e b = b | 1 << 16
+SDL_TARGETING("sse2") static inline __m128i luma_sse2_4(__m128i rg, __m128i b, int *empate)
+{
+    const __m128i n = _mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(2125 | (7154 << 16))),
+                                    _mm_madd_epi16(b, _mm_set1_epi32(721 | (5000 << 16))));
+    const __m128 f = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(n), _mm_set1_ps(0.5f)), _mm_set1_ps(1e-4f));
+    const __m128i q = _mm_cvttps_epi32(f);
+    *empate |= _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_madd_epi16(q, _mm_set1_epi32(10000)), n));
+    return q;
+}
+
+SDL_TARGETING("sse2") static void luma_linha_sse2(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay)
+{
+    const __m128i mascara = _mm_set1_epi32(0xFF);
+    const __m128i um_alto = _mm_set1_epi32(1 << 16);
+    const int sR = 8 * lay->oR, sG = 8 * lay->oG, sB = 8 * lay->oB;
+    const int bpp = lay->bpp;
+    // No RGB24 cada pixel é lido com 4 bytes, então o último bloco precisa de folga
+    const int limite = bpp == 3 ? largura - 1 : largura;
+
+    int x = 0;
+    for (; x + 16 <= limite; x += 16)
+    {
+        __m128i q[4];
+        int empate = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            const Uint8 *p = src + (size_t)(x + 4 * k) * bpp;
+            __m128i v;
+            if (bpp == 4)
+            {
+                v = _mm_loadu_si128((const __m128i *)p);
+            }
+            else
+            {
+                Uint32 w0, w1, w2, w3;
+                SDL_memcpy(&w0, p, 4);
+                SDL_memcpy(&w1, p + 3, 4);
+                SDL_memcpy(&w2, p + 6, 4);
+                SDL_memcpy(&w3, p + 9, 4);
+                v = _mm_setr_epi32((int)w0, (int)w1, (int)w2, (int)w3);
+            }
+            __m128i r = _mm_and_si128(_mm_srli_epi32(v, sR), mascara);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(v, sG), mascara);
+            __m128i b = _mm_and_si128(_mm_srli_epi32(v, sB), mascara);
+            q[k] = luma_sse2_4(_mm_or_si128(r, _mm_slli_epi32(g, 16)), _mm_or_si128(b, um_alto), &empate);
+        }
+        __m128i q16a = _mm_packs_epi32(q[0], q[1]);
+        __m128i q16b = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i *)(luma + x), _mm_packus_epi16(q16a, q16b));
+        if (empate)
+            luma_linha_escalar(src + (size_t)x * bpp, luma + x, 16, lay);
+    }
+    luma_linha_escalar(src + (size_t)x * bpp, luma + x, largura - x, lay);
+}
+#endif
+
+#ifdef SDL_AVX2_INTRINSICS
+SDL_TARGETING("avx2") static void luma_linha_avx2(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay)
+{
+    // pshufb monta r | g << 16 e b em cada lane de 32 bits, para RGB24 e 32 bits
+    Sint8 m_rg[16], m_b[16];
+    for (int i = 0; i < 4; i++)
+    {
+        int base = i * lay->bpp;
+        m_rg[4 * i + 0] = (Sint8)(base + lay->oR);
+        m_rg[4 * i + 1] = -1;
+        m_rg[4 * i + 2] = (Sint8)(base + lay->oG);
+        m_rg[4 * i + 3] = -1;
+        m_b[4 * i + 0] = (Sint8)(base + lay->oB);
+        m_b[4 * i + 1] = -1;
+        m_b[4 * i + 2] = -1;
+        m_b[4 * i + 3] = -1;
+    }
+    const __m256i mascara_rg = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m_rg));
+    const __m256i mascara_b = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m_b));
+    const __m256i pesos_rg = _mm256_set1_epi32(2125 | (7154 << 16));
+    const __m256i pesos_b = _mm256_set1_epi32(721 | (5000 << 16));
+    const __m256i um_alto = _mm256_set1_epi32(1 << 16);
+    const __m256i dez_mil = _mm256_set1_epi32(10000);
+    const __m256 meio = _mm256_set1_ps(0.5f);
+    const __m256 escala = _mm256_set1_ps(1e-4f);
+    const int bpp = lay->bpp;
+    // Cada metade de 128 bits lê 16 bytes; no RGB24 isso passa 4 bytes do último pixel
+    const int limite = bpp == 3 ? largura - 2 : largura;
+
+    int x = 0;
+    for (; x + 16 <= limite; x += 16)
+    {
+        __m256i q[2];
+        __m256i empates = _mm256_setzero_si256();
+        for (int k = 0; k < 2; k++)
+        {
+            const Uint8 *p = src + (size_t)(x + 8 * k) * bpp;
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                                _mm_loadu_si128((const __m128i *)(p + 4 * bpp)), 1);
+            __m256i rg = _mm256_shuffle_epi8(v, mascara_rg);
+            __m256i b = _mm256_or_si256(_mm256_shuffle_epi8(v, mascara_b), um_alto);
+            __m256i n = _mm256_add_epi32(_mm256_madd_epi16(rg, pesos_rg), _mm256_madd_epi16(b, pesos_b));
+            __m256 f = _mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(n), meio), escala);
+            q[k] = _mm256_cvttps_epi32(f);
+            empates = _mm256_or_si256(empates, _mm256_cmpeq_epi32(_mm256_mullo_epi32(q[k], dez_mil), n));
+        }
+        // packus trabalha por metade de 128 bits; o permute devolve a ordem dos pixels
+        __m256i q16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(q[0], q[1]), 0xD8);
+        __m128i q8 = _mm_packus_epi16(_mm256_castsi256_si128(q16), _mm256_extracti128_si256(q16, 1));
+        _mm_storeu_si128((__m128i *)(luma + x), q8);
+        if (!_mm256_testz_si256(empates, empates))
+            luma_linha_escalar(src + (size_t)x * bpp, luma + x, 16, lay);
+    }
+    luma_linha_escalar(src + (size_t)x * bpp, luma + x, largura - x, lay);
+}
+#endif
+
+#ifdef SDL_NEON_INTRINSICS
+static inline uint32x4_t luma_neon_4(uint16x4_t r, uint16x4_t g, uint16x4_t b, uint32x4_t *empates)
+{
+    uint32x4_t n = vmlal_n_u16(vmlal_n_u16(vmull_n_u16(r, 2125), g, 7154), b, 721);
+    n = vaddq_u32(n, vdupq_n_u32(5000));
+    float32x4_t f = vmulq_n_f32(vaddq_f32(vcvtq_f32_u32(n), vdupq_n_f32(0.5f)), 1e-4f);
+    uint32x4_t q = vcvtq_u32_f32(f);
+    *empates = vorrq_u32(*empates, vceqq_u32(vmulq_n_u32(q, 10000), n));
+    return q;
+}
+
+static void luma_linha_neon(const Uint8 *src, Uint8 *luma, int largura, const LayoutPixel *lay)
+{
+    const int bpp = lay->bpp;
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        const Uint8 *p = src + (size_t)x * bpp;
+        uint8x16_t c[4];
+        if (bpp == 4)
+        {
+            uint8x16x4_t px = vld4q_u8(p);
+            c[0] = px.val[0], c[1] = px.val[1], c[2] = px.val[2], c[3] = px.val[3];
+        }
+        else
+        {
+            uint8x16x3_t px = vld3q_u8(p);
+            c[0] = px.val[0], c[1] = px.val[1], c[2] = px.val[2], c[3] = px.val[2];
+        }
+        uint16x8_t r_lo = vmovl_u8(vget_low_u8(c[lay->oR])), r_hi = vmovl_u8(vget_high_u8(c[lay->oR]));
+        uint16x8_t g_lo = vmovl_u8(vget_low_u8(c[lay->oG])), g_hi = vmovl_u8(vget_high_u8(c[lay->oG]));
+        uint16x8_t b_lo = vmovl_u8(vget_low_u8(c[lay->oB])), b_hi = vmovl_u8(vget_high_u8(c[lay->oB]));
+
+        uint32x4_t empates = vdupq_n_u32(0);
+        uint32x4_t q0 = luma_neon_4(vget_low_u16(r_lo), vget_low_u16(g_lo), vget_low_u16(b_lo), &empates);
+        uint32x4_t q1 = luma_neon_4(vget_high_u16(r_lo), vget_high_u16(g_lo), vget_high_u16(b_lo), &empates);
+        uint32x4_t q2 = luma_neon_4(vget_low_u16(r_hi), vget_low_u16(g_hi), vget_low_u16(b_hi), &empates);
+        uint32x4_t q3 = luma_neon_4(vget_high_u16(r_hi), vget_high_u16(g_hi), vget_high_u16(b_hi), &empates);
+
+        uint16x8_t q16a = vcombine_u16(vmovn_u32(q0), vmovn_u32(q1));
+        uint16x8_t q16b = vcombine_u16(vmovn_u32(q2), vmovn_u32(q3));
+        vst1q_u8(luma + x, vcombine_u8(vmovn_u16(q16a), vmovn_u16(q16b)));
+
+        uint32x2_t e = vorr_u32(vget_low_u32(empates), vget_high_u32(empates));
+        if (vget_lane_u32(e, 0) | vget_lane_u32(e, 1))
+            luma_linha_escalar(p, luma + x, 16, lay);
+    }
+    luma_linha_escalar(src + (size_t)x * bpp, luma + x, largura - x, lay);
+}
+#endif
+
+static bool sempre_disponivel(void)
+{
+    return true;
+}
+
+// Em ordem de preferência; o último é o de referência
+static const struct
+{
+    const char *nome;
+    kernel_luma_fn fn;
+    bool (*disponivel)(void);
+} kernels_luma[] = {
+#ifdef SDL_AVX2_INTRINSICS
+    {"AVX2", luma_linha_avx2, SDL_HasAVX2},
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    {"SSE2", luma_linha_sse2, SDL_HasSSE2},
+#endif
+#ifdef SDL_NEON_INTRINSICS
+    {"NEON", luma_linha_neon, SDL_HasNEON},
+#endif
+    {"escalar", luma_linha_escalar, sempre_disponivel},
+    {"referencia", luma_linha_referencia, sempre_disponivel},
+};
+#define NUM_KERNELS_LUMA ((int)SDL_arraysize(kernels_luma))
+
+/* Kernels de LUT: dst[x] = lut[src[x]] sobre linhas contíguas de 8 bits. A variante
+   AVX2 divide a tabela de 256 entradas em 16 tabelas de 16 bytes, uma por nibble alto,
+   e usa pshufb: a cada tabela o valor é decrementado de 16 e a soma saturada com
+   0x70 deixa o bit 7 ligado (zerando a saída do pshufb) em todo byte de outro nibble. */
+typedef void (*kernel_lut_fn)(const Uint8 *src, Uint8 *dst, int largura, const Uint8 lut[NIVEIS]);
+
+static void lut_linha_escalar(const Uint8 *src, Uint8 *dst, int largura, const Uint8 lut[NIVEIS])
+{
+    int x = 0;
+    for (; x + 4 <= largura; x += 4)
+    {
+        Uint8 a = lut[src[x]], b = lut[src[x + 1]], c = lut[src[x + 2]], d = lut[src[x + 3]];
+        dst[x] = a;
+        dst[x + 1] = b;
+        dst[x + 2] = c;
+        dst[x + 3] = d;
+    }
+    for (; x < largura; x++)
+        dst[x] = lut[src[x]];
+}
+
+#ifdef SDL_AVX2_INTRINSICS
+SDL_TARGETING("avx2") static void lut_linha_avx2(const Uint8 *src, Uint8 *dst, int largura, const Uint8 lut[NIVEIS])
+{
+    __m256i tabelas[16];
+    for (int i = 0; i < 16; i++)
+        tabelas[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + 16 * i)));
+    const __m256i desloc = _mm256_set1_epi8(0x70);
+    const __m256i dezesseis = _mm256_set1_epi8(16);
+
+    int x = 0;
+    // Dois vetores por iteração para esconder a cadeia de dependência dos "or"
+    for (; x + 64 <= largura; x += 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + x + 32));
+        __m256i ra = _mm256_shuffle_epi8(tabelas[0], _mm256_adds_epu8(a, desloc));
+        __m256i rb = _mm256_shuffle_epi8(tabelas[0], _mm256_adds_epu8(b, desloc));
+        for (int i = 1; i < 16; i++)
+        {
+            a = _mm256_sub_epi8(a, dezesseis);
+            b = _mm256_sub_epi8(b, dezesseis);
+            ra = _mm256_or_si256(ra, _mm256_shuffle_epi8(tabelas[i], _mm256_adds_epu8(a, desloc)));
+            rb = _mm256_or_si256(rb, _mm256_shuffle_epi8(tabelas[i], _mm256_adds_epu8(b, desloc)));
+        }
+        _mm256_storeu_si256((__m256i *)(dst + x), ra);
+        _mm256_storeu_si256((__m256i *)(dst + x + 32), rb);
+    }
+    lut_linha_escalar(src + x, dst + x, largura - x, lut);
+}
+#endif
+
+#if defined(SDL_NEON_INTRINSICS) && (defined(__aarch64__) || defined(_M_ARM64))
+// No AArch64 o tbl/tbx consulta 64 bytes por instrução; índices fora da faixa
+// preservam o destino no tbx
+static void lut_linha_neon(const Uint8 *src, Uint8 *dst, int largura, const Uint8 lut[NIVEIS])
+{
+    uint8x16x4_t t0 = vld1q_u8_x4(lut), t1 = vld1q_u8_x4(lut + 64);
+    uint8x16x4_t t2 = vld1q_u8_x4(lut + 128), t3 = vld1q_u8_x4(lut + 192);
+    const uint8x16_t k64 = vdupq_n_u8(64);
+
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        uint8x16_t v = vld1q_u8(src + x);
+        uint8x16_t r = vqtbl4q_u8(t0, v);
+        v = vsubq_u8(v, k64);
+        r = vqtbx4q_u8(r, t1, v);
+        v = vsubq_u8(v, k64);
+        r = vqtbx4q_u8(r, t2, v);
+        v = vsubq_u8(v, k64);
+        r = vqtbx4q_u8(r, t3, v);
+        vst1q_u8(dst + x, r);
+    }
+    lut_linha_escalar(src + x, dst + x, largura - x, lut);
+}
+#endif
+
+static const struct
+{
+    const char *nome;
+    kernel_lut_fn fn;
+    bool (*disponivel)(void);
+} kernels_lut[] = {
+#ifdef SDL_AVX2_INTRINSICS
+    {"AVX2", lut_linha_avx2, SDL_HasAVX2},
+#endif
+#if defined(SDL_NEON_INTRINSICS) && (defined(__aarch64__) || defined(_M_ARM64))
+    {"NEON", lut_linha_neon, SDL_HasNEON},
+#endif
+    {"escalar", lut_linha_escalar, sempre_disponivel},
+};
+#define NUM_KERNELS_LUT ((int)SDL_arraysize(kernels_lut))
+
+/* Kernels de cor: a volta da equalização só da luma. Em cada pixel RGBA32 somam
+   d = luma_nova - luma aos três canais, com saturação, e copiam o alfa. d vai em
+   dois vetores sem sinal, o que sobe e o que desce (um deles é zero), e cada byte
+   é espalhado para R, G e B do seu pixel, com zero no byte do alfa. */
+typedef void (*kernel_cor_fn)(const Uint8 *src, Uint8 *dst, const Uint8 *luma, const Uint8 *luma_nova, int largura);
+
+static void cor_linha_escalar(const Uint8 *src, Uint8 *dst, const Uint8 *luma, const Uint8 *luma_nova, int largura)
+{
+    for (int x = 0; x < largura; x++, src += 4, dst += 4)
+    {
+        int d = luma_nova[x] - luma[x];
+        dst[0] = (Uint8)SDL_clamp(src[0] + d, 0, 255);
+        dst[1] = (Uint8)SDL_clamp(src[1] + d, 0, 255);
+        dst[2] = (Uint8)SDL_clamp(src[2] + d, 0, 255);
+        dst[3] = src[3];
+    }
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+// Cada lane de 32 bits tem o valor no byte 0 (R); copia para os bytes 1 (G) e 2 (B)
+SDL_TARGETING("sse2") static inline __m128i espalhar_rgb_sse2(__m128i v)
+{
+    return _mm_or_si128(v, _mm_or_si128(_mm_slli_epi32(v, 8), _mm_slli_epi32(v, 16)));
+}
+
+SDL_TARGETING("sse2") static void cor_linha_sse2(const Uint8 *src, Uint8 *dst, const Uint8 *luma, const Uint8 *luma_nova, int largura)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        __m128i y = _mm_loadu_si128((const __m128i *)(luma + x));
+        __m128i yn = _mm_loadu_si128((const __m128i *)(luma_nova + x));
+        __m128i sobe = _mm_subs_epu8(yn, y), desce = _mm_subs_epu8(y, yn);
+        __m128i sobe16[2] = {_mm_unpacklo_epi8(sobe, zero), _mm_unpackhi_epi8(sobe, zero)};
+        __m128i desce16[2] = {_mm_unpacklo_epi8(desce, zero), _mm_unpackhi_epi8(desce, zero)};
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i s = k & 1 ? _mm_unpackhi_epi16(sobe16[k >> 1], zero) : _mm_unpacklo_epi16(sobe16[k >> 1], zero);
+            __m128i d = k & 1 ? _mm_unpackhi_epi16(desce16[k >> 1], zero) : _mm_unpacklo_epi16(desce16[k >> 1], zero);
+            const Uint8 *p = src + (size_t)(x + 4 * k) * 4;
+            __m128i px = _mm_loadu_si128((const __m128i *)p);
+            px = _mm_subs_epu8(_mm_adds_epu8(px, espalhar_rgb_sse2(s)), espalhar_rgb_sse2(d));
+            _mm_storeu_si128((__m128i *)(dst + (size_t)(x + 4 * k) * 4), px);
+        }
+    }
+    cor_linha_escalar(src + (size_t)x * 4, dst + (size_t)x * 4, luma + x, luma_nova + x, largura - x);
+}
+#endif
+
+#ifdef SDL_AVX2_INTRINSICS
+SDL_TARGETING("avx2") static inline __m256i espalhar_rgb_avx2(__m256i v)
+{
+    return _mm256_or_si256(v, _mm256_or_si256(_mm256_slli_epi32(v, 8), _mm256_slli_epi32(v, 16)));
+}
+
+SDL_TARGETING("avx2") static void cor_linha_avx2(const Uint8 *src, Uint8 *dst, const Uint8 *luma, const Uint8 *luma_nova, int largura)
+{
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        __m128i y = _mm_loadu_si128((const __m128i *)(luma + x));
+        __m128i yn = _mm_loadu_si128((const __m128i *)(luma_nova + x));
+        __m128i sobe = _mm_subs_epu8(yn, y), desce = _mm_subs_epu8(y, yn);
+        for (int k = 0; k < 2; k++)
+        {
+            __m256i s = espalhar_rgb_avx2(_mm256_cvtepu8_epi32(k ? _mm_srli_si128(sobe, 8) : sobe));
+            __m256i d = espalhar_rgb_avx2(_mm256_cvtepu8_epi32(k ? _mm_srli_si128(desce, 8) : desce));
+            __m256i px = _mm256_loadu_si256((const __m256i *)(src + (size_t)(x + 8 * k) * 4));
+            px = _mm256_subs_epu8(_mm256_adds_epu8(px, s), d);
+            _mm256_storeu_si256((__m256i *)(dst + (size_t)(x + 8 * k) * 4), px);
+        }
+    }
+    cor_linha_escalar(src + (size_t)x * 4, dst + (size_t)x * 4, luma + x, luma_nova + x, largura - x);
+}
+#endif
+
+#ifdef SDL_NEON_INTRINSICS
+// vld4 já separa os canais, então o mesmo vetor de luma serve para R, G e B
+static void cor_linha_neon(const Uint8 *src, Uint8 *dst, const Uint8 *luma, const Uint8 *luma_nova, int largura)
+{
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        uint8x16_t y = vld1q_u8(luma + x), yn = vld1q_u8(luma_nova + x);
+        uint8x16_t sobe = vqsubq_u8(yn, y), desce = vqsubq_u8(y, yn);
+        uint8x16x4_t px = vld4q_u8(src + (size_t)x * 4);
+        for (int c = 0; c < 3; c++)
+            px.val[c] = vqsubq_u8(vqaddq_u8(px.val[c], sobe), desce);
+        vst4q_u8(dst + (size_t)x * 4, px);
+    }
+    cor_linha_escalar(src + (size_t)x * 4, dst + (size_t)x * 4, luma + x, luma_nova + x, largura - x);
+}
+#endif
+
+static const struct
+{
+    const char *nome;
+    kernel_cor_fn fn;
+    bool (*disponivel)(void);
+} kernels_cor[] = {
+#ifdef SDL_AVX2_INTRINSICS
+    {"AVX2", cor_linha_avx2, SDL_HasAVX2},
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    {"SSE2", cor_linha_sse2, SDL_HasSSE2},
+#endif
+#ifdef SDL_NEON_INTRINSICS
+    {"NEON", cor_linha_neon, SDL_HasNEON},
+#endif
+    {"escalar", cor_linha_escalar, sempre_disponivel},
+};
+#define NUM_KERNELS_COR ((int)SDL_arraysize(kernels_cor))
+
+/* Kernels de redução 2x2 para a pirâmide de mipmaps: dst[x] é a média arredondada
+   de a[2x], a[2x+1], b[2x] e b[2x+1], com a e b duas linhas vizinhas. Os vetores
+   somam os pares em 16 bits (byte baixo + byte alto de cada palavra), então o
+   resultado é exato, sem o duplo arredondamento de encadear duas médias de 8 bits. */
+typedef void (*kernel_reducao_fn)(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura);
+
+static void reducao_linha_escalar(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura)
+{
+    for (int x = 0; x < largura; x++)
+        dst[x] = (Uint8)((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+SDL_TARGETING("sse2") static void reducao_linha_sse2(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura)
+{
+    const __m128i baixo = _mm_set1_epi16(0x00FF), dois = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        __m128i s[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + 2 * x + 16 * k));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + 2 * x + 16 * k));
+            __m128i pa = _mm_add_epi16(_mm_and_si128(va, baixo), _mm_srli_epi16(va, 8));
+            __m128i pb = _mm_add_epi16(_mm_and_si128(vb, baixo), _mm_srli_epi16(vb, 8));
+            s[k] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pa, pb), dois), 2);
+        }
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(s[0], s[1]));
+    }
+    reducao_linha_escalar(a + 2 * x, b + 2 * x, dst + x, largura - x);
+}
+#endif
+
+#ifdef SDL_AVX2_INTRINSICS
+SDL_TARGETING("avx2") static void reducao_linha_avx2(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura)
+{
+    const __m256i baixo = _mm256_set1_epi16(0x00FF), dois = _mm256_set1_epi16(2);
+    int x = 0;
+    for (; x + 32 <= largura; x += 32)
+    {
+        __m256i s[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + 2 * x + 32 * k));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + 2 * x + 32 * k));
+            __m256i pa = _mm256_add_epi16(_mm256_and_si256(va, baixo), _mm256_srli_epi16(va, 8));
+            __m256i pb = _mm256_add_epi16(_mm256_and_si256(vb, baixo), _mm256_srli_epi16(vb, 8));
+            s[k] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(pa, pb), dois), 2);
+        }
+        // O pack trabalha por metade de 128 bits; o permute põe as quatro partes em ordem
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(s[0], s[1]), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + x), r);
+    }
+    reducao_linha_escalar(a + 2 * x, b + 2 * x, dst + x, largura - x);
+}
+#endif
+
+#ifdef SDL_NEON_INTRINSICS
+// vpaddl/vpadal somam os pares vizinhos já alargando; vrshrn divide por 4 arredondando
+static void reducao_linha_neon(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura)
+{
+    int x = 0;
+    for (; x + 16 <= largura; x += 16)
+    {
+        uint16x8_t s0 = vpadalq_u8(vpaddlq_u8(vld1q_u8(a + 2 * x)), vld1q_u8(b + 2 * x));
+        uint16x8_t s1 = vpadalq_u8(vpaddlq_u8(vld1q_u8(a + 2 * x + 16)), vld1q_u8(b + 2 * x + 16));
+        vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+    }
+    reducao_linha_escalar(a + 2 * x, b + 2 * x, dst + x, largura - x);
+}
+#endif
+
+static const struct
+{
+    const char *nome;
+    kernel_reducao_fn fn;
+    bool (*disponivel)(void);
+} kernels_reducao[] = {
+#ifdef SDL_AVX2_INTRINSICS
+    {"AVX2", reducao_linha_avx2, SDL_HasAVX2},
+#endif
+#ifdef SDL_SSE2_INTRINSICS
+    {"SSE2", reducao_linha_sse2, SDL_HasSSE2},
+#endif
+#ifdef SDL_NEON_INTRINSICS
+    {"NEON", reducao_linha_neon, SDL_HasNEON},
+#endif
+    {"escalar", reducao_linha_escalar, sempre_disponivel},
+};
+#define NUM_KERNELS_REDUCAO ((int)SDL_arraysize(kernels_reducao))
+
+static kernel_luma_fn kernel_luma = luma_linha_escalar;
+static kernel_lut_fn kernel_lut = lut_linha_escalar;
+static kernel_cor_fn kernel_cor = cor_linha_escalar;
+static kernel_reducao_fn kernel_reducao = reducao_linha_escalar;
+
+// Escolhe os melhores kernels suportados pela CPU; chamada uma vez na inicialização
+void iniciar_kernels(void)
+{
+    for (int i = 0; i < NUM_KERNELS_LUMA; i++)
+    {
+        if (kernels_luma[i].disponivel())
+        {
+            kernel_luma = kernels_luma[i].fn;
+            printf("Kernel de luma: %s\n", kernels_luma[i].nome);
+            break;
+        }
+    }
+    for (int i = 0; i < NUM_KERNELS_LUT; i++)
+    {
+        if (kernels_lut[i].disponivel())
+        {
+            kernel_lut = kernels_lut[i].fn;
+            printf("Kernel de LUT: %s\n", kernels_lut[i].nome);
+            break;
+        }
+    }
+    for (int i = 0; i < NUM_KERNELS_COR; i++)
+    {
+        if (kernels_cor[i].disponivel())
+        {
+            kernel_cor = kernels_cor[i].fn;
+            printf("Kernel de cor: %s\n", kernels_cor[i].nome);
+            break;
+        }
+    }
+    for (int i = 0; i < NUM_KERNELS_REDUCAO; i++)
+    {
+        if (kernels_reducao[i].disponivel())
+        {
+            kernel_reducao = kernels_reducao[i].fn;
+            printf("Kernel de redução: %s\n", kernels_reducao[i].nome);
+            break;
+        }
+    }
+}
+
+// Compara todos os kernels disponíveis com a referência nas 2^24 cores, em alguns layouts
+bool verificar_kernels_luma(void)
+{
+    static const LayoutPixel layouts[] = {
+        {4, 0, 1, 2, 3}, {4, 1, 2, 3, 0}, {4, 2, 1, 0, 3}, {3, 0, 1, 2, -1}, {3, 2, 1, 0, -1}};
+    const int largura = 4096;
+    Uint8 *linha = SDL_malloc((size_t)largura * 4 + 16);
+    Uint8 *esperado = SDL_malloc(largura);
+    Uint8 *obtido = SDL_malloc(largura);
+    if (!linha || !esperado || !obtido)
+    {
+        SDL_free(linha);
+        SDL_free(esperado);
+        SDL_free(obtido);
+        return false;
+    }
+
+    bool ok = true;
+    for (int k = 0; k < NUM_KERNELS_LUMA - 1; k++)
+    {
+        if (!kernels_luma[k].disponivel())
+            continue;
+        long divergencias = 0;
+        for (int l = 0; l < (int)SDL_arraysize(layouts); l++)
+        {
+            const LayoutPixel *lay = &layouts[l];
+            for (int y = 0; y < 4096; y++)
+            {
+                // Cada linha cobre 4096 cores consecutivas de 0xRRGGBB
+                for (int x = 0; x < largura; x++)
+                {
+                    Uint32 cor = (Uint32)y * 4096 + (Uint32)x;
+                    Uint8 *p = linha + (size_t)x * lay->bpp;
+                    p[lay->oR] = (Uint8)(cor >> 16);
+                    p[lay->oG] = (Uint8)(cor >> 8);
+                    p[lay->oB] = (Uint8)cor;
+                    if (lay->oA >= 0)
+                        p[lay->oA] = 255;
+                }
+                luma_linha_referencia(linha, esperado, largura, lay);
+                kernels_luma[k].fn(linha, obtido, largura, lay);
+                for (int x = 0; x < largura; x++)
+                    divergencias += esperado[x] != obtido[x];
+            }
+        }
+        printf("Kernel %-10s: %s (%ld divergências)\n", kernels_luma[k].nome,
+               divergencias ? "FALHOU" : "ok", divergencias);
+        if (divergencias)
+            ok = false;
+    }
+
+    SDL_free(linha);
+    SDL_free(esperado);
+    SDL_free(obtido);
+    return ok;
+}
+
+// Compara os kernels de LUT com o escalar em tabelas aleatórias e larguras variadas
+bool verificar_kernels_lut(void)
+{
+    Uint8 src[300], esperado[300], obtido[300], lut[NIVEIS];
+    bool ok = true;
+    for (int k = 0; k < NUM_KERNELS_LUT - 1; k++)
+    {
+        if (!kernels_lut[k].disponivel())
+            continue;
+        long divergencias = 0;
+        for (int rodada = 0; rodada < 1000; rodada++)
+        {
+            for (int i = 0; i < NIVEIS; i++)
+                lut[i] = (Uint8)SDL_rand(NIVEIS);
+            int largura = 1 + rodada % 300;
+            for (int x = 0; x < largura; x++)
+                src[x] = (Uint8)(rodada < NIVEIS ? rodada + x : SDL_rand(NIVEIS));
+            lut_linha_escalar(src, esperado, largura, lut);
+            kernels_lut[k].fn(src, obtido, largura, lut);
+            for (int x = 0; x < largura; x++)
+                divergencias += esperado[x] != obtido[x];
+        }
+        printf("LUT %-10s: %s (%ld divergências)\n", kernels_lut[k].nome,
+               divergencias ? "FALHOU" : "ok", divergencias);
+        if (divergencias)
+            ok = false;
+    }
+    return ok;
+}
+
+// Compara os kernels de cor com o escalar em pixels e lumas aleatórios, incluindo as saturações
+bool verificar_kernels_cor(void)
+{
+    Uint8 src[4 * 300], esperado[4 * 300], obtido[4 * 300], luma[300], luma_nova[300];
+    bool ok = true;
+    for (int k = 0; k < NUM_KERNELS_COR - 1; k++)
+    {
+        if (!kernels_cor[k].disponivel())
+            continue;
+        long divergencias = 0;
+        for (int rodada = 0; rodada < 1000; rodada++)
+        {
+            int largura = 1 + rodada % 300;
+            for (int x = 0; x < largura; x++)
+            {
+                luma[x] = (Uint8)SDL_rand(NIVEIS);
+                luma_nova[x] = (Uint8)SDL_rand(NIVEIS);
+            }
+            for (int i = 0; i < 4 * largura; i++)
+                src[i] = (Uint8)SDL_rand(NIVEIS);
+            cor_linha_escalar(src, esperado, luma, luma_nova, largura);
+            kernels_cor[k].fn(src, obtido, luma, luma_nova, largura);
+            divergencias += SDL_memcmp(esperado, obtido, 4 * (size_t)largura) != 0;
+        }
+        printf("Cor %-10s: %s (%ld linhas divergentes)\n", kernels_cor[k].nome,
+               divergencias ? "FALHOU" : "ok", divergencias);
+        if (divergencias)
+            ok = false;
+    }
+    return ok;
+}
+
+// Compara os kernels de redução com o escalar em linhas aleatórias de larguras variadas
+bool verificar_kernels_reducao(void)
+{
+    Uint8 a[600], b[600], esperado[300], obtido[300];
+    bool ok = true;
+    for (int k = 0; k < NUM_KERNELS_REDUCAO - 1; k++)
+    {
+        if (!kernels_reducao[k].disponivel())
+            continue;
+        long divergencias = 0;
+        for (int rodada = 0; rodada < 1000; rodada++)
+        {
+            int largura = 1 + rodada % 300;
+            for (int x = 0; x < 2 * largura; x++)
+            {
+                // As primeiras rodadas usam 255 para testar a soma máxima dos quatro
+                a[x] = rodada < 10 ? 255 : (Uint8)SDL_rand(NIVEIS);
+                b[x] = rodada < 10 ? 255 : (Uint8)SDL_rand(NIVEIS);
+            }
+            reducao_linha_escalar(a, b, esperado, largura);
+            kernels_reducao[k].fn(a, b, obtido, largura);
+            for (int x = 0; x < largura; x++)
+                divergencias += esperado[x] != obtido[x];
+        }
+        printf("Redução %-10s: %s (%ld divergências)\n", kernels_reducao[k].nome,
+               divergencias ? "FALHOU" : "ok", divergencias);
+        if (divergencias)
+            ok = false;
+    }
+    return ok;
+}
+
+// Devolve false para formatos sem kernel dedicado. Os aliases *32 descrevem a ordem
+// dos bytes na memória em qualquer endianness.
+static bool layout_do_formato(SDL_PixelFormat formato, LayoutPixel *lay)
+{
+    switch (formato)
+    {
+    case SDL_PIXELFORMAT_RGBA32:
+        *lay = (LayoutPixel){4, 0, 1, 2, 3};
+        return true;
+    case SDL_PIXELFORMAT_ARGB32:
+        *lay = (LayoutPixel){4, 1, 2, 3, 0};
+        return true;
+    case SDL_PIXELFORMAT_BGRA32:
+        *lay = (LayoutPixel){4, 2, 1, 0, 3};
+        return true;
+    case SDL_PIXELFORMAT_ABGR32:
+        *lay = (LayoutPixel){4, 3, 2, 1, 0};
+        return true;
+    case SDL_PIXELFORMAT_RGBX32:
+        *lay = (LayoutPixel){4, 0, 1, 2, -1};
+        return true;
+    case SDL_PIXELFORMAT_XRGB32:
+        *lay = (LayoutPixel){4, 1, 2, 3, -1};
+        return true;
+    case SDL_PIXELFORMAT_BGRX32:
+        *lay = (LayoutPixel){4, 2, 1, 0, -1};
+        return true;
+    case SDL_PIXELFORMAT_XBGR32:
+        *lay = (LayoutPixel){4, 3, 2, 1, -1};
+        return true;
+    case SDL_PIXELFORMAT_RGB24:
+        *lay = (LayoutPixel){3, 0, 1, 2, -1};
+        return true;
+    case SDL_PIXELFORMAT_BGR24:
+        *lay = (LayoutPixel){3, 2, 1, 0, -1};
+        return true;
+    default:
+        return false;
+    }
+}
+
+typedef struct
+{
+    const SDL_Surface *orig;
+    ImagemCinza *cinza;
+    SDL_AtomicInt *colorida;
+    Uint8 luma_pal[NIVEIS];
+    Uint8 alfa_pal[NIVEIS];
+    Uint8 cor_pal[NIVEIS];
+} ContextoIndexada;
+
+static void indexada_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoIndexada *ctx = p;
+    const SDL_Surface *orig = ctx->orig;
+    int usou_cor = 0;
+    for (int y = y0; y < y1; y++)
+    {
+        const Uint8 *src = (const Uint8 *)orig->pixels + (size_t)y * orig->pitch;
+        Uint8 *dst = linha_cinza(ctx->cinza, y);
+        for (int x = 0; x < orig->w; x++)
+        {
+            dst[x] = ctx->luma_pal[src[x]];
+            usou_cor |= ctx->cor_pal[src[x]];
+        }
+        if (ctx->cinza->alfa)
+        {
+            Uint8 *a = linha_alfa(ctx->cinza, y);
+            for (int x = 0; x < orig->w; x++)
+                a[x] = ctx->alfa_pal[src[x]];
+        }
+    }
+    if (usou_cor)
+        SDL_SetAtomicInt(ctx->colorida, 1);
+}
+
+// INDEX8: a luma de cada cor da paleta é calculada uma vez e os índices viram tabela
+static bool converte_indexada(SDL_Surface *orig, ImagemCinza *cinza, SDL_AtomicInt *colorida)
+{
+    SDL_Palette *pal = SDL_GetSurfacePalette(orig);
+    if (orig->format != SDL_PIXELFORMAT_INDEX8 || !pal)
+        return false;
+
+    ContextoIndexada ctx = {.orig = orig, .cinza = cinza, .colorida = colorida};
+    SDL_memset(ctx.alfa_pal, 255, sizeof(ctx.alfa_pal));
+    for (int i = 0; i < pal->ncolors && i < NIVEIS; i++)
+    {
+        SDL_Color c = pal->colors[i];
+        ctx.luma_pal[i] = luma_bt709(c.r, c.g, c.b);
+        ctx.alfa_pal[i] = c.a;
+        ctx.cor_pal[i] = !eh_cinza(c.r, c.g, c.b);
+    }
+
+    executar_em_faixas(orig->h, grao_para_largura(orig->w), indexada_faixa, &ctx);
+    return true;
+}
+
+// Caminho genérico para formatos exóticos (16 bits, 10 bits, float, indexados < 8 bits...)
+static void converte_generica(SDL_Surface *orig, ImagemCinza *cinza, SDL_AtomicInt *colorida)
+{
+    bool usou_cor = false;
+    for (int y = 0; y < orig->h; y++)
+    {
+        Uint8 *dst = linha_cinza(cinza, y);
+        Uint8 *dst_alfa = cinza->alfa ? linha_alfa(cinza, y) : NULL;
+        for (int x = 0; x < orig->w; x++)
+        {
+            Uint8 r, g, b, a;
+            if (!SDL_ReadSurfacePixel(orig, x, y, &r, &g, &b, &a))
+            {
+                fprintf(stderr, "Erro ao ler pixel (%d,%d): %s\n", x, y, SDL_GetError());
+            }
+            dst[x] = luma_bt709(r, g, b);
+            usou_cor |= !eh_cinza(r, g, b);
+            if (dst_alfa)
+                dst_alfa[x] = a;
+        }
+    }
+    if (usou_cor)
+        SDL_SetAtomicInt(colorida, 1);
+}
+
+// Intercala uma linha de cinza (e alfa; NULL = opaca) em pixels RGBA32
+static void cinza_para_rgba_linha(const Uint8 *v, const Uint8 *a, Uint8 *dst, int largura)
+{
+    for (int x = 0; x < largura; x++, dst += 4)
+    {
+        dst[0] = dst[1] = dst[2] = v[x];
+        dst[3] = a ? a[x] : 255;
+    }
+}
+
+/* Surface para exibir ou salvar. Imagens opacas viram INDEX8 com paleta de cinza
+   apontando direto para o plano (sem cópia), então a surface deve ser destruída
+   antes da imagem. Com alfa, os planos são intercalados em RGBA32. */
+SDL_Surface *surface_de_imagem_cinza(const ImagemCinza *img)
+{
+    SDL_Surface *s;
+    if (!img->alfa)
+    {
+        s = SDL_CreateSurfaceFrom(img->largura, img->altura, SDL_PIXELFORMAT_INDEX8, img->dados, img->passo);
+        if (!s)
+            return NULL;
+        SDL_Palette *pal = SDL_CreateSurfacePalette(s);
+        SDL_Color cores[NIVEIS];
+        for (int i = 0; i < NIVEIS; i++)
+            cores[i] = (SDL_Color){(Uint8)i, (Uint8)i, (Uint8)i, 255};
+        if (!pal || !SDL_SetPaletteColors(pal, cores, 0, NIVEIS))
+        {
+            SDL_DestroySurface(s);
+            return NULL;
+        }
+        return s;
+    }
+
+    s = SDL_CreateSurface(img->largura, img->altura, SDL_PIXELFORMAT_RGBA32);
+    if (!s)
+        return NULL;
+    for (int y = 0; y < img->altura; y++)
+        cinza_para_rgba_linha(linha_cinza(img, y), linha_alfa(img, y), (Uint8 *)s->pixels + (size_t)y * s->pitch,
+                              img->largura);
+    return s;
+}
+
+/* --------- codificador PNG ----------
+   PNG de cinza de 8 bits (tipo 0), ou cinza + alfa (tipo 4) quando a imagem tem
+   alfa; também cinza de 16 bits e RGB/RGBA (tipos 2 e 6) da equalização em
+   cor. Nível de compressão (0 = sem compressão, 1 = mais rápido, 9 = menor
+   arquivo) e filtro por linha escolhidos pelo chamador. A imagem é dividida em
+   blocos de ~1 MiB de linhas filtradas, comprimidos em paralelo no pool como
+   pedaços independentes de deflate; cada pedaço termina alinhado em byte (bloco
+   armazenado vazio), então a concatenação forma um único fluxo zlib. O Adler-32
+   de cada pedaço é combinado na ordem e cada pedaço vira um chunk IDAT. */
+
+typedef enum
+{
+    FILTRO_PNG_NENHUM,
+    FILTRO_PNG_SUB,
+    FILTRO_PNG_CIMA,
+    FILTRO_PNG_MEDIA,
+    FILTRO_PNG_PAETH,
+    FILTRO_PNG_ADAPTATIVO // escolhe por linha o de menor soma absoluta
+} FiltroPng;
+
+typedef struct
+{
+    int nivel; // 0 a 9
+    FiltroPng filtro;
+} OpcoesPng;
+
+static OpcoesPng opcoes_png = {6, FILTRO_PNG_ADAPTATIVO}; // --png-nivel, --png-filtro
+
+static const char *const nomes_filtro_png[] = {"nenhum", "sub", "cima", "media", "paeth", "adaptativo"};
+
+static Uint32 tabela_crc[256];
+static Uint8 codigo_comprimento[259]; // comprimento 3..258 -> código 0..28
+static Uint8 codigo_distancia[512];   // distância - 1 < 256 direto; acima, (d - 1) >> 7 a partir de 256
+static SDL_InitState tabelas_png;
+
+static const Uint16 base_comprimento[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                            31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const Uint8 extra_comprimento[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const Uint16 base_distancia[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                          513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const Uint8 extra_distancia[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const Uint8 ordem_comprimentos[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static void iniciar_tabelas_png(void)
+{
+    if (!SDL_ShouldInit(&tabelas_png))
+        return;
+    for (Uint32 i = 0; i < 256; i++)
+    {
+        Uint32 c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        tabela_crc[i] = c;
+    }
+    for (int c = 0; c < 29; c++)
+        for (int l = base_comprimento[c]; l < base_comprimento[c] + (1 << extra_comprimento[c]) && l <= 258; l++)
+            codigo_comprimento[l] = (Uint8)c;
+    codigo_comprimento[258] = 28;
+    for (int c = 0; c < 30; c++)
+        for (int d = base_distancia[c]; d < base_distancia[c] + (1 << extra_distancia[c]); d++)
+            codigo_distancia[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = (Uint8)c;
+    SDL_SetInitialized(&tabelas_png, true);
+}
+
+static Uint32 crc32_atualizar(Uint32 crc, const Uint8 *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        crc = tabela_crc[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#define BASE_ADLER 65521u
+
+static Uint32 adler32_atualizar(Uint32 adler, const Uint8 *p, size_t n)
+{
+    Uint32 a = adler & 0xFFFF, b = adler >> 16;
+    while (n > 0)
+    {
+        size_t bloco = n < 5552 ? n : 5552; // maior bloco sem estourar 32 bits antes do módulo
+        n -= bloco;
+        while (bloco--)
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= BASE_ADLER;
+        b %= BASE_ADLER;
+    }
+    return (b << 16) | a;
+}
+
+// Adler-32 da concatenação, a partir dos valores de cada parte (como o adler32_combine da zlib)
+static Uint32 adler32_combinar(Uint32 adler1, Uint32 adler2, size_t tamanho2)
+{
+    Uint32 resto = (Uint32)(tamanho2 % BASE_ADLER);
+    Uint32 soma1 = adler1 & 0xFFFF;
+    Uint32 soma2 = (resto * soma1) % BASE_ADLER;
+    soma1 += (adler2 & 0xFFFF) + BASE_ADLER - 1;
+    soma2 += (adler1 >> 16) + (adler2 >> 16) + BASE_ADLER - resto;
+    if (soma1 >= BASE_ADLER)
+        soma1 -= BASE_ADLER;
+    if (soma1 >= BASE_ADLER)
+        soma1 -= BASE_ADLER;
+    if (soma2 >= (BASE_ADLER << 1))
+        soma2 -= (BASE_ADLER << 1);
+    if (soma2 >= BASE_ADLER)
+        soma2 -= BASE_ADLER;
+    return (soma2 << 16) | soma1;
+}
+
+/* Saída de bits do deflate, do bit menos significativo para o mais. Quem escreve
+   garante a capacidade antes de cada bloco, então escrever não verifica nada. */
+typedef struct
+{
+    Uint8 *dados;
+    size_t tamanho;
+    size_t capacidade;
+    Uint64 acumulador;
+    int nbits;
+} EscritorBits;
+
+static bool bits_reservar(EscritorBits *e, size_t extra)
+{
+    if (e->tamanho + extra + 8 <= e->capacidade)
+        return true;
+    size_t nova = SDL_max(e->capacidade * 2, e->tamanho + extra + 8);
+    Uint8 *p = SDL_realloc(e->dados, nova);
+    if (!p)
+        return false;
+    e->dados = p;
+    e->capacidade = nova;
+    return true;
+}
+
+static inline void bits_escrever(EscritorBits *e, Uint32 valor, int n)
+{
+    e->acumulador |= (Uint64)valor << e->nbits;
+    e->nbits += n;
+    while (e->nbits >= 8)
+    {
+        e->dados[e->tamanho++] = (Uint8)e->acumulador;
+        e->acumulador >>= 8;
+        e->nbits -= 8;
+    }
+}
+
+static void bits_alinhar(EscritorBits *e)
+{
+    if (e->nbits > 0)
+        bits_escrever(e, 0, 8 - e->nbits);
+}
+
+/* Comprimentos de Huffman limitados a `limite` bits. Se a árvore passar do limite,
+   as frequências são reduzidas à metade (sem zerar nenhuma) e a árvore é refeita.
+   Sempre há ao menos dois símbolos com código, como o deflate exige. */
+static void construir_comprimentos(const Uint32 *freq_orig, int n, int limite, Uint8 *comp)
+{
+    Uint32 freq[286];
+    int folhas[286], nf = 0;
+    for (int i = 0; i < n; i++)
+    {
+        freq[i] = freq_orig[i];
+        comp[i] = 0;
+    }
+    for (int i = 0; i < n && nf < 2; i++)
+        if (freq[i])
+            nf++;
+    for (int i = 0; nf < 2 && i < n; i++)
+        if (!freq[i])
+        {
+            freq[i] = 1;
+            nf++;
+        }
+
+    for (;;)
+    {
+        nf = 0;
+        for (int i = 0; i < n; i++)
+            if (freq[i])
+                folhas[nf++] = i;
+        // Ordena as folhas por frequência (inserção: no máximo 286 itens)
+        for (int i = 1; i < nf; i++)
+        {
+            int s = folhas[i], j = i;
+            for (; j > 0 && freq[folhas[j - 1]] > freq[s]; j--)
+                folhas[j] = folhas[j - 1];
+            folhas[j] = s;
+        }
+
+        // Duas filas: folhas ordenadas e nós internos, que já nascem em ordem
+        Uint32 peso[2 * 286];
+        int pai[2 * 286];
+        for (int i = 0; i < nf; i++)
+            peso[i] = freq[folhas[i]];
+        int prox_folha = 0, prox_interno = nf, fim_interno = nf;
+        for (int k = 0; k < nf - 1; k++)
+        {
+            int filhos[2];
+            for (int f = 0; f < 2; f++)
+            {
+                if (prox_folha < nf && (prox_interno >= fim_interno || peso[prox_folha] <= peso[prox_interno]))
+                    filhos[f] = prox_folha++;
+                else
+                    filhos[f] = prox_interno++;
+            }
+            peso[fim_interno] = peso[filhos[0]] + peso[filhos[1]];
+            pai[filhos[0]] = pai[filhos[1]] = fim_interno;
+            fim_interno++;
+        }
+
+        int raiz = fim_interno - 1, maior = 0;
+        if (raiz < 1)
+            return; // não acontece: há sempre ao menos duas folhas
+        Uint8 prof[2 * 286];
+        prof[raiz] = 0;
+        for (int i = raiz - 1; i >= 0; i--)
+            prof[i] = (Uint8)SDL_min(prof[pai[i]] + 1, 255);
+        for (int i = 0; i < nf; i++)
+            maior = SDL_max(maior, prof[i]);
+        if (maior <= limite)
+        {
+            for (int i = 0; i < nf; i++)
+                comp[folhas[i]] = prof[i];
+            return;
+        }
+        for (int i = 0; i < n; i++)
+            if (freq[i])
+                freq[i] = (freq[i] >> 1) | 1;
+    }
+}
+
+// Códigos canônicos (RFC 1951, 3.2.2), já invertidos para a escrita LSB primeiro
+static void gerar_codigos(const Uint8 *comp, int n, Uint16 *codigos)
+{
+    int contagem[16] = {0}, proximo[16];
+    for (int i = 0; i < n; i++)
+        contagem[comp[i]]++;
+    contagem[0] = 0;
+    int codigo = 0;
+    for (int b = 1; b < 16; b++)
+    {
+        codigo = (codigo + contagem[b - 1]) << 1;
+        proximo[b] = codigo;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (!comp[i])
+            continue;
+        int c = proximo[comp[i]]++, invertido = 0;
+        for (int b = 0; b < comp[i]; b++)
+            invertido |= ((c >> b) & 1) << (comp[i] - 1 - b);
+        codigos[i] = (Uint16)invertido;
+    }
+}
+
+#define SIMBOLOS_BLOCO 32768
+
+/* Símbolos de um bloco: valor < 256 é literal, 256 + comprimento é uma
+   referência, com a distância ao lado */
+typedef struct
+{
+    Uint16 lit[SIMBOLOS_BLOCO];
+    Uint16 dist[SIMBOLOS_BLOCO];
+    int n;
+} BlocoDeflate;
+
+// Cada símbolo ocupa no máximo 15 + 5 + 15 + 13 bits, e o cabeçalho bem menos de 1 KiB
+static bool emitir_bloco(EscritorBits *e, const BlocoDeflate *b, bool final)
+{
+    if (!bits_reservar(e, (size_t)b->n * 6 + 1024))
+        return false;
+    Uint32 freq_lit[286] = {0}, freq_dist[30] = {0};
+    for (int i = 0; i < b->n; i++)
+    {
+        if (b->lit[i] < 256)
+            freq_lit[b->lit[i]]++;
+        else
+        {
+            freq_lit[257 + codigo_comprimento[b->lit[i] - 256]]++;
+            int d = b->dist[i] - 1;
+            freq_dist[codigo_distancia[d < 256 ? d : 256 + (d >> 7)]]++;
+        }
+    }
+    freq_lit[256] = 1;
+
+    Uint8 comp_lit[286], comp_dist[30];
+    construir_comprimentos(freq_lit, 286, 15, comp_lit);
+    construir_comprimentos(freq_dist, 30, 15, comp_dist);
+    int hlit = 286, hdist = 30;
+    while (hlit > 257 && !comp_lit[hlit - 1])
+        hlit--;
+    while (hdist > 1 && !comp_dist[hdist - 1])
+        hdist--;
+
+    // Comprimentos das duas tabelas em sequência, com as repetições 16/17/18
+    Uint8 todos[286 + 30], rle[286 + 30], rle_extra[286 + 30];
+    int nt = 0, nr = 0;
+    for (int i = 0; i < hlit; i++)
+        todos[nt++] = comp_lit[i];
+    for (int i = 0; i < hdist; i++)
+        todos[nt++] = comp_dist[i];
+    for (int i = 0; i < nt;)
+    {
+        int v = todos[i], run = 1;
+        while (i + run < nt && todos[i + run] == v)
+            run++;
+        if (v == 0 && run >= 3)
+        {
+            run = SDL_min(run, 138);
+            rle[nr] = run >= 11 ? 18 : 17;
+            rle_extra[nr++] = (Uint8)(run >= 11 ? run - 11 : run - 3);
+        }
+        else if (v != 0 && run >= 4)
+        {
+            rle[nr] = (Uint8)v;
+            rle_extra[nr++] = 0;
+            run = SDL_min(run - 1, 6) + 1;
+            rle[nr] = 16;
+            rle_extra[nr++] = (Uint8)(run - 1 - 3);
+        }
+        else
+        {
+            run = 1;
+            rle[nr] = (Uint8)v;
+            rle_extra[nr++] = 0;
+        }
+        i += run;
+    }
+    Uint32 freq_cl[19] = {0};
+    for (int i = 0; i < nr; i++)
+        freq_cl[rle[i]]++;
+    Uint8 comp_cl[19];
+    construir_comprimentos(freq_cl, 19, 7, comp_cl);
+    int hclen = 19;
+    while (hclen > 4 && !comp_cl[ordem_comprimentos[hclen - 1]])
+        hclen--;
+
+    // Custo em bits do bloco dinâmico e do fixo; os bits extras são iguais nos dois
+    Uint64 dinamico = 14 + 3 * (Uint64)hclen, fixo = 0;
+    for (int i = 0; i < nr; i++)
+        dinamico += comp_cl[rle[i]] + (rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : rle[i] == 18 ? 7 : 0);
+    Uint8 comp_fixo_lit[288], comp_fixo_dist[30];
+    for (int i = 0; i < 288; i++)
+        comp_fixo_lit[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    SDL_memset(comp_fixo_dist, 5, sizeof(comp_fixo_dist));
+    for (int i = 0; i < 286; i++)
+    {
+        dinamico += (Uint64)freq_lit[i] * comp_lit[i];
+        fixo += (Uint64)freq_lit[i] * comp_fixo_lit[i];
+    }
+    for (int i = 0; i < 30; i++)
+    {
+        dinamico += (Uint64)freq_dist[i] * comp_dist[i];
+        fixo += (Uint64)freq_dist[i] * 5;
+    }
+
+    const Uint8 *cl = comp_lit, *cd = comp_dist;
+    bits_escrever(e, final ? 1 : 0, 1);
+    if (fixo <= dinamico)
+    {
+        bits_escrever(e, 1, 2);
+        cl = comp_fixo_lit;
+        cd = comp_fixo_dist;
+    }
+    else
+    {
+        bits_escrever(e, 2, 2);
+        bits_escrever(e, hlit - 257, 5);
+        bits_escrever(e, hdist - 1, 5);
+        bits_escrever(e, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++)
+            bits_escrever(e, comp_cl[ordem_comprimentos[i]], 3);
+        Uint16 cod_cl[19];
+        gerar_codigos(comp_cl, 19, cod_cl);
+        for (int i = 0; i < nr; i++)
+        {
+            bits_escrever(e, cod_cl[rle[i]], comp_cl[rle[i]]);
+            if (rle[i] >= 16)
+                bits_escrever(e, rle_extra[i], rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+        }
+    }
+
+    Uint16 cod_lit[288], cod_dist[30];
+    gerar_codigos(cl, cl == comp_lit ? 286 : 288, cod_lit);
+    gerar_codigos(cd, 30, cod_dist);
+    for (int i = 0; i < b->n; i++)
+    {
+        int v = b->lit[i];
+        if (v < 256)
+        {
+            bits_escrever(e, cod_lit[v], cl[v]);
+            continue;
+        }
+        int comprimento = v - 256, c = codigo_comprimento[comprimento];
+        bits_escrever(e, cod_lit[257 + c], cl[257 + c]);
+        bits_escrever(e, comprimento - base_comprimento[c], extra_comprimento[c]);
+        int d = b->dist[i] - 1, cdist = codigo_distancia[d < 256 ? d : 256 + (d >> 7)];
+        bits_escrever(e, cod_dist[cdist], cd[cdist]);
+        bits_escrever(e, b->dist[i] - base_distancia[cdist], extra_distancia[cdist]);
+    }
+    bits_escrever(e, cod_lit[256], cl[256]);
+    return true;
+}
+
+// Parâmetros de busca por nível, na linha dos da zlib
+static const struct
+{
+    Uint16 cadeia;   // candidatos examinados por posição
+    Uint16 suficiente; // para de procurar ao achar uma igual ou maior
+    bool preguicoso; // testa se começar na próxima posição rende mais
+} niveis_deflate[10] = {
+    {0, 0, false}, {4, 16, false}, {8, 32, false}, {16, 64, false}, {16, 64, true},
+    {32, 128, true}, {64, 128, true}, {128, 258, true}, {512, 258, true}, {2048, 258, true}};
+
+#define JANELA_DEFLATE 32768
+#define BITS_HASH 15
+
+typedef struct
+{
+    Sint32 cabeca[1 << BITS_HASH];
+    Sint32 anterior[JANELA_DEFLATE];
+    BlocoDeflate bloco;
+} EstadoDeflate;
+
+static inline Uint32 hash3(const Uint8 *p)
+{
+    return ((Uint32)p[0] | (Uint32)p[1] << 8 | (Uint32)p[2] << 16) * 2654435761u >> (32 - BITS_HASH);
+}
+
+static inline void inserir_hash(EstadoDeflate *s, const Uint8 *d, size_t n, size_t pos)
+{
+    if (pos + 3 > n)
+        return;
+    Uint32 h = hash3(d + pos);
+    s->anterior[pos & (JANELA_DEFLATE - 1)] = s->cabeca[h];
+    s->cabeca[h] = (Sint32)pos;
+}
+
+static int achar_referencia(const EstadoDeflate *s, const Uint8 *d, size_t n, size_t pos, int nivel, int *dist)
+{
+    if (pos + 3 > n)
+        return 0;
+    int maximo = (int)SDL_min((size_t)258, n - pos), melhor = 2;
+    int cadeia = niveis_deflate[nivel].cadeia;
+    for (Sint32 c = s->cabeca[hash3(d + pos)]; c >= 0 && pos - (size_t)c <= JANELA_DEFLATE && cadeia-- > 0;
+         c = s->anterior[c & (JANELA_DEFLATE - 1)])
+    {
+        const Uint8 *a = d + c, *b = d + pos;
+        if (a[melhor] != b[melhor] || a[0] != b[0] || a[1] != b[1])
+            continue;
+        int l = 2;
+        while (l < maximo && a[l] == b[l])
+            l++;
+        if (l > melhor)
+        {
+            melhor = l;
+            *dist = (int)(pos - (size_t)c);
+            if (l >= niveis_deflate[nivel].suficiente || l == maximo)
+                break;
+        }
+    }
+    return melhor >= 3 ? melhor : 0;
+}
+
+static bool bloco_adicionar(EscritorBits *e, BlocoDeflate *b, int lit, int dist)
+{
+    b->lit[b->n] = (Uint16)lit;
+    b->dist[b->n] = (Uint16)dist;
+    if (++b->n < SIMBOLOS_BLOCO)
+        return true;
+    bool ok = emitir_bloco(e, b, false);
+    b->n = 0;
+    return ok;
+}
+
+/* Comprime d[0..n) como um pedaço de deflate. O último pedaço leva o bloco final;
+   os outros terminam com um bloco armazenado vazio, que alinha a saída em byte. */
+static bool deflate_pedaco(EstadoDeflate *s, const Uint8 *d, size_t n, int nivel, bool ultimo, EscritorBits *e)
+{
+    if (nivel == 0)
+    {
+        if (!bits_reservar(e, n + (n / 65535 + 1) * 5 + 8))
+            return false;
+        size_t pos = 0;
+        do
+        {
+            size_t tam = SDL_min(n - pos, (size_t)65535);
+            bool final = ultimo && pos + tam == n;
+            bits_escrever(e, final ? 1 : 0, 1);
+            bits_escrever(e, 0, 2);
+            bits_alinhar(e);
+            bits_escrever(e, (Uint32)tam, 16);
+            bits_escrever(e, (Uint32)tam ^ 0xFFFF, 16);
+            SDL_memcpy(e->dados + e->tamanho, d + pos, tam);
+            e->tamanho += tam;
+            pos += tam;
+        } while (pos < n);
+        return true;
+    }
+
+    for (int i = 0; i < (1 << BITS_HASH); i++)
+        s->cabeca[i] = -1;
+    BlocoDeflate *b = &s->bloco;
+    b->n = 0;
+    bool preguicoso = niveis_deflate[nivel].preguicoso;
+    int prox_len = -1, prox_dist = 0; // busca já feita em pos, vinda da espiada preguiçosa
+    bool ok = true;
+
+    for (size_t pos = 0; ok && pos < n;)
+    {
+        int dist = 0, len = prox_len >= 0 ? prox_len : achar_referencia(s, d, n, pos, nivel, &dist);
+        if (prox_len >= 0)
+            dist = prox_dist;
+        prox_len = -1;
+        inserir_hash(s, d, n, pos);
+
+        if (len && preguicoso && len < niveis_deflate[nivel].suficiente)
+        {
+            int dist2 = 0, len2 = achar_referencia(s, d, n, pos + 1, nivel, &dist2);
+            if (len2 > len)
+            {
+                ok = bloco_adicionar(e, b, d[pos], 0);
+                prox_len = len2;
+                prox_dist = dist2;
+                pos++;
+                continue;
+            }
+        }
+        if (!len)
+        {
+            ok = bloco_adicionar(e, b, d[pos], 0);
+            pos++;
+            continue;
+        }
+        ok = bloco_adicionar(e, b, 256 + len, dist);
+        for (size_t p = pos + 1; p < pos + len; p++)
+            inserir_hash(s, d, n, p);
+        pos += len;
+    }
+
+    if (!ok || !emitir_bloco(e, b, ultimo))
+        return false;
+    if (!ultimo)
+    {
+        bits_escrever(e, 0, 3);
+        bits_alinhar(e);
+        bits_escrever(e, 0x0000, 16);
+        bits_escrever(e, 0xFFFF, 16);
+    }
+    else
+        bits_alinhar(e);
+    return true;
+}
+
+static inline Uint8 preditor_paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = SDL_abs(p - a), pb = SDL_abs(p - b), pc = SDL_abs(p - c);
+    return (Uint8)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Aplica o filtro `tipo` à linha; bpp vai de 1 (cinza) a 4 (RGBA)
+static void filtrar_linha(int tipo, const Uint8 *linha, const Uint8 *acima, int n, int bpp, Uint8 *saida)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int a = i >= bpp ? linha[i - bpp] : 0, b = acima ? acima[i] : 0, c = acima && i >= bpp ? acima[i - bpp] : 0;
+        int pred = tipo == FILTRO_PNG_SUB ? a : tipo == FILTRO_PNG_CIMA ? b : tipo == FILTRO_PNG_MEDIA ? (a + b) >> 1
+                 : tipo == FILTRO_PNG_PAETH ? preditor_paeth(a, b, c) : 0;
+        saida[i] = (Uint8)(linha[i] - pred);
+    }
+}
+
+typedef struct
+{
+    Uint8 *dados;
+    size_t tamanho;
+    Uint32 adler;      // das linhas filtradas do pedaço
+    size_t bytes_brutos;
+    bool ok;
+} PedacoPng;
+
+typedef struct
+{
+    const ImagemCinza *img;     // 8 bits, com ou sem alfa...
+    const ImagemCinza16 *img16; // ...ou 16 bits...
+    const SDL_Surface *cor;     // ...ou RGBA32, gravada como RGB ou RGBA; só um dos três
+    int largura;
+    int altura;
+    int bpp; // bytes por pixel na linha do PNG
+    const OpcoesPng *op;
+    int linhas_por_pedaco;
+    int primeiro;      // índice do primeiro pedaço do grupo em andamento
+    int num_pedacos;
+    PedacoPng *pedacos; // do grupo em andamento
+    SDL_AtomicInt *progresso; // linhas já comprimidas, ou NULL
+} ContextoPng;
+
+/* Linha y como o PNG a espera: cinza, pares cinza/alfa, amostras de 16 bits
+   big-endian esticadas de 0..maximo para 0..65535, ou RGB/RGBA */
+static const Uint8 *linha_png(const ContextoPng *ctx, int y, Uint8 *buf)
+{
+    if (ctx->cor)
+    {
+        const Uint8 *src = (const Uint8 *)ctx->cor->pixels + (size_t)y * ctx->cor->pitch;
+        if (ctx->bpp == 4)
+            return src;
+        for (int x = 0; x < ctx->largura; x++)
+        {
+            buf[3 * x] = src[4 * x];
+            buf[3 * x + 1] = src[4 * x + 1];
+            buf[3 * x + 2] = src[4 * x + 2];
+        }
+        return buf;
+    }
+    if (ctx->img16)
+    {
+        const Uint16 *src = linha_cinza16(ctx->img16, y);
+        const Uint32 maximo = (Uint32)ctx->img16->maximo;
+        for (int x = 0; x < ctx->largura; x++)
+        {
+            Uint32 v = SDL_min((Uint32)src[x], maximo);
+            if (maximo != 65535)
+                v = (v * 65535u + maximo / 2) / maximo;
+            buf[2 * x] = (Uint8)(v >> 8);
+            buf[2 * x + 1] = (Uint8)v;
+        }
+        return buf;
+    }
+    const ImagemCinza *img = ctx->img;
+    if (!img->alfa)
+        return linha_cinza(img, y);
+    const Uint8 *g = linha_cinza(img, y), *a = linha_alfa(img, y);
+    for (int x = 0; x < img->largura; x++)
+    {
+        buf[2 * x] = g[x];
+        buf[2 * x + 1] = a[x];
+    }
+    return buf;
+}
+
+static void png_pedacos(void *p, int i0, int i1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoPng *ctx = p;
+    const int bpp = ctx->bpp, n = ctx->largura * bpp;
+
+    for (int i = i0; i < i1; i++)
+    {
+        PedacoPng *pedaco = &ctx->pedacos[i];
+        int indice = ctx->primeiro + i;
+        int y0 = indice * ctx->linhas_por_pedaco, y1 = SDL_min(y0 + ctx->linhas_por_pedaco, ctx->altura);
+        size_t bytes = (size_t)(y1 - y0) * (n + 1);
+        Uint8 *filtrado = SDL_malloc(bytes);
+        Uint8 *linhas = SDL_malloc(2 * (size_t)n + 5 * (size_t)n);
+        EstadoDeflate *estado = ctx->op->nivel > 0 ? SDL_malloc(sizeof(EstadoDeflate)) : NULL;
+        pedaco->ok = filtrado && linhas && (estado || ctx->op->nivel == 0);
+        if (pedaco->ok)
+        {
+            Uint8 *buf_atual = linhas, *buf_acima = linhas + n, *candidatos = linhas + 2 * n;
+            const Uint8 *acima = y0 > 0 ? linha_png(ctx, y0 - 1, buf_acima) : NULL;
+            for (int y = y0; y < y1; y++)
+            {
+                const Uint8 *linha = linha_png(ctx, y, buf_atual);
+                Uint8 *saida = filtrado + (size_t)(y - y0) * (n + 1);
+                int tipo = ctx->op->filtro;
+                if (tipo == FILTRO_PNG_ADAPTATIVO)
+                {
+                    Uint64 menor = ~(Uint64)0;
+                    for (int t = FILTRO_PNG_NENHUM; t <= FILTRO_PNG_PAETH; t++)
+                    {
+                        Uint8 *c = candidatos + (size_t)t * n;
+                        filtrar_linha(t, linha, acima, n, bpp, c);
+                        Uint64 soma = 0;
+                        for (int x = 0; x < n; x++)
+                            soma += (Uint64)SDL_abs((Sint8)c[x]);
+                        if (soma < menor)
+                        {
+                            menor = soma;
+                            tipo = t;
+                        }
+                    }
+                    SDL_memcpy(saida + 1, candidatos + (size_t)tipo * n, n);
+                }
+                else
+                    filtrar_linha(tipo, linha, acima, n, bpp, saida + 1);
+                saida[0] = (Uint8)tipo;
+                // A linha atual vira a de cima; se foi montada no buffer, os buffers trocam
+                if (linha == buf_atual)
+                {
+                    Uint8 *t = buf_acima;
+                    buf_acima = buf_atual;
+                    buf_atual = t;
+                }
+                acima = linha;
+            }
+            pedaco->bytes_brutos = bytes;
+            pedaco->adler = adler32_atualizar(1, filtrado, bytes);
+            EscritorBits e = {0};
+            pedaco->ok = deflate_pedaco(estado, filtrado, bytes, ctx->op->nivel, y1 == ctx->altura, &e);
+            pedaco->dados = e.dados;
+            pedaco->tamanho = e.tamanho;
+        }
+        SDL_free(estado);
+        SDL_free(linhas);
+        SDL_free(filtrado);
+        if (ctx->progresso)
+            SDL_AddAtomicInt(ctx->progresso, y1 - y0);
+    }
+}
+
+static bool escrever_chunk_png(SDL_IOStream *io, const char *tipo, const Uint8 *dados, size_t tamanho)
+{
+    Uint32 crc = crc32_atualizar(0xFFFFFFFFu, (const Uint8 *)tipo, 4);
+    crc = crc32_atualizar(crc, dados, tamanho) ^ 0xFFFFFFFFu;
+    return SDL_WriteU32BE(io, (Uint32)tamanho) && SDL_WriteIO(io, tipo, 4) == 4 &&
+           (tamanho == 0 || SDL_WriteIO(io, dados, tamanho) == tamanho) && SDL_WriteU32BE(io, crc);
+}
+
+/* Escreve origem->img, origem->img16 ou origem->cor como PNG em io. progresso, se não for NULL,
+   recebe as linhas já comprimidas (de 0 à altura), para quem acompanha de outra thread. */
+static bool escrever_png(const ContextoPng *origem, SDL_IOStream *io, const OpcoesPng *op, SDL_AtomicInt *progresso)
+{
+    iniciar_tabelas_png();
+    static const Uint8 assinatura[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    Uint8 ihdr[13];
+    SDL_memset(ihdr, 0, sizeof(ihdr));
+    for (int i = 0; i < 4; i++)
+    {
+        ihdr[i] = (Uint8)((Uint32)origem->largura >> (24 - 8 * i));
+        ihdr[4 + i] = (Uint8)((Uint32)origem->altura >> (24 - 8 * i));
+    }
+    ihdr[8] = origem->img16 ? 16 : 8;                     // bits por amostra
+    // Tipo de cor: RGBA, RGB, cinza + alfa ou só cinza
+    ihdr[9] = origem->cor ? (origem->bpp == 4 ? 6 : 2) : origem->img && origem->img->alfa ? 4 : 0;
+    // Cabeçalho zlib (deflate, janela de 32 KiB) com o nível informativo
+    Uint8 zlib[2] = {0x78, op->nivel <= 1 ? 0x01 : op->nivel <= 5 ? 0x5E : op->nivel == 6 ? 0x9C : 0xDA};
+
+    bool ok = SDL_WriteIO(io, assinatura, 8) == 8 && escrever_chunk_png(io, "IHDR", ihdr, 13);
+    // sBIT guarda a profundidade original (12 bits esticados para 16, por exemplo)
+    if (ok && origem->img16 && origem->img16->maximo < 65535)
+    {
+        Uint8 bits = 1;
+        while (bits < 16 && (1 << bits) - 1 < origem->img16->maximo)
+            bits++;
+        ok = escrever_chunk_png(io, "sBIT", &bits, 1);
+    }
+    ok = ok && escrever_chunk_png(io, "IDAT", zlib, 2);
+
+    // Pedaços de ~1 MiB filtrado, em grupos que limitam quanto fica na memória
+    ContextoPng ctx = *origem;
+    ctx.op = op;
+    ctx.progresso = progresso;
+    size_t bytes_linha = (size_t)ctx.largura * ctx.bpp + 1;
+    ctx.linhas_por_pedaco = (int)SDL_max((size_t)1, ((size_t)1 << 20) / bytes_linha);
+    int total = (ctx.altura + ctx.linhas_por_pedaco - 1) / ctx.linhas_por_pedaco;
+    int por_grupo = 4 * num_trabalhadores();
+    ctx.pedacos = SDL_calloc(por_grupo, sizeof(PedacoPng));
+    ok = ok && ctx.pedacos;
+    Uint32 adler = 1;
+    for (ctx.primeiro = 0; ok && ctx.primeiro < total; ctx.primeiro += por_grupo)
+    {
+        ctx.num_pedacos = SDL_min(por_grupo, total - ctx.primeiro);
+        executar_em_faixas(ctx.num_pedacos, 1, png_pedacos, &ctx);
+        for (int i = 0; i < ctx.num_pedacos; i++)
+        {
+            PedacoPng *pedaco = &ctx.pedacos[i];
+            if (!pedaco->ok)
+                ok = SDL_OutOfMemory();
+            ok = ok && escrever_chunk_png(io, "IDAT", pedaco->dados, pedaco->tamanho);
+            adler = adler32_combinar(adler, pedaco->adler, pedaco->bytes_brutos);
+            SDL_free(pedaco->dados);
+            SDL_zerop(pedaco);
+        }
+    }
+    SDL_free(ctx.pedacos);
+
+    Uint8 fim[4] = {(Uint8)(adler >> 24), (Uint8)(adler >> 16), (Uint8)(adler >> 8), (Uint8)adler};
+    return ok && escrever_chunk_png(io, "IDAT", fim, 4) && escrever_chunk_png(io, "IEND", NULL, 0);
+}
+
+static bool salvar_png(const ContextoPng *origem, const char *caminho, const OpcoesPng *op, SDL_AtomicInt *progresso)
+{
+    SDL_IOStream *io = SDL_IOFromFile(caminho, "wb");
+    if (!io)
+        return false;
+    bool ok = escrever_png(origem, io, op, progresso);
+    if (!SDL_CloseIO(io))
+        ok = false;
+    return ok;
+}
+
+bool salvar_png_cinza(const ImagemCinza *img, const char *caminho, const OpcoesPng *op, SDL_AtomicInt *progresso)
+{
+    ContextoPng ctx = {.img = img, .largura = img->largura, .altura = img->altura, .bpp = img->alfa ? 2 : 1};
+    return salvar_png(&ctx, caminho, op, progresso);
+}
+
+// PNG em cinza de 16 bits
+bool salvar_png_cinza16(const ImagemCinza16 *img, const char *caminho, const OpcoesPng *op, SDL_AtomicInt *progresso)
+{
+    ContextoPng ctx = {.img16 = img, .largura = img->largura, .altura = img->altura, .bpp = 2};
+    return salvar_png(&ctx, caminho, op, progresso);
+}
+
+// PNG colorido de 8 bits por canal a partir de uma surface RGBA32; sem alfa, grava só RGB
+bool salvar_png_cor(const SDL_Surface *img, bool com_alfa, const char *caminho, const OpcoesPng *op, SDL_AtomicInt *progresso)
+{
+    ContextoPng ctx = {.cor = img, .largura = img->w, .altura = img->h, .bpp = com_alfa ? 4 : 3};
+    return salvar_png(&ctx, caminho, op, progresso);
+}
+
+// PNG com as opções globais (--png-nivel, --png-filtro)
+bool salvar_imagem_cinza(const ImagemCinza *img, const char *caminho)
+{
+    return salvar_png_cinza(img, caminho, &opcoes_png, NULL);
+}
+
+/* Ida e volta do codificador: grava em memória, decodifica com o SDL_image e compara
+   os pixels. Os casos cobrem planos degenerados (constante, rampa, largura ou altura 1),
+   cinza com alfa, cor e uma imagem com vários pedaços de ~1 MiB, que passa por mais de
+   um grupo quando há poucos trabalhadores. */
+typedef struct
+{
+    const char *nome;
+    int largura;
+    int altura;
+    int canais; // 1 cinza, 2 cinza + alfa, 3 RGB, 4 RGBA
+    int conteudo; // 0 aleatório, 1 constante, 2 rampa, 3 rampa com ruído
+} CasoPng;
+
+static Uint8 amostra_teste_png(int conteudo, int x, int y)
+{
+    switch (conteudo)
+    {
+    case 1:
+        return 173;
+    case 2:
+        return (Uint8)(x + y);
+    case 3:
+        return (Uint8)(x / 4 + y + SDL_rand(3));
+    default:
+        return (Uint8)SDL_rand(NIVEIS);
+    }
+}
+
+// Compara a surface decodificada com a origem do PNG; devolve os pixels divergentes
+static long comparar_png(const ContextoPng *origem, SDL_Surface *decodificada)
+{
+    if (!decodificada)
+        return (long)origem->largura * origem->altura;
+    SDL_Surface *rgba = SDL_ConvertSurface(decodificada, SDL_PIXELFORMAT_RGBA32);
+    SDL_DestroySurface(decodificada);
+    if (!rgba || rgba->w != origem->largura || rgba->h != origem->altura)
+    {
+        SDL_DestroySurface(rgba);
+        return (long)origem->largura * origem->altura;
+    }
+    long divergencias = 0;
+    for (int y = 0; y < origem->altura; y++)
+    {
+        const Uint8 *d = (const Uint8 *)rgba->pixels + (size_t)y * rgba->pitch;
+        for (int x = 0; x < origem->largura; x++, d += 4)
+        {
+            Uint8 esperado[4];
+            if (origem->cor)
+            {
+                SDL_memcpy(esperado, (const Uint8 *)origem->cor->pixels + (size_t)y * origem->cor->pitch + 4 * x, 4);
+                if (origem->bpp == 3)
+                    esperado[3] = 255;
+            }
+            else
+            {
+                esperado[0] = esperado[1] = esperado[2] = linha_cinza(origem->img, y)[x];
+                esperado[3] = origem->img->alfa ? linha_alfa(origem->img, y)[x] : 255;
+            }
+            divergencias += SDL_memcmp(esperado, d, 4) != 0;
+        }
+    }
+    SDL_DestroySurface(rgba);
+    return divergencias;
+}
+
+bool verificar_png(void)
+{
+    static const CasoPng casos[] = {
+        {"aleatória", 97, 61, 1, 0},
+        {"constante", 200, 150, 1, 1},
+        {"rampa", 256, 64, 1, 2},
+        {"cinza+alfa", 123, 77, 2, 0},
+        {"largura 1", 1, 300, 1, 0},
+        {"altura 1", 333, 1, 2, 0},
+        {"RGB", 64, 40, 3, 0},
+        {"RGBA", 50, 33, 4, 3},
+        {"pedaços", 1024, 5000, 1, 3}, // 1023 linhas por pedaço
+    };
+    static const OpcoesPng grandes[] = {
+        {0, FILTRO_PNG_NENHUM}, {1, FILTRO_PNG_SUB}, {3, FILTRO_PNG_PAETH}, {6, FILTRO_PNG_ADAPTATIVO}};
+    static const int niveis[] = {0, 1, 3, 6, 9};
+    bool ok = true;
+    for (int c = 0; c < (int)SDL_arraysize(casos); c++)
+    {
+        const CasoPng *caso = &casos[c];
+        ImagemCinza *img = NULL;
+        SDL_Surface *cor = NULL;
+        ContextoPng origem = {.largura = caso->largura, .altura = caso->altura, .bpp = caso->canais};
+        if (caso->canais <= 2)
+            img = criar_imagem_cinza(caso->largura, caso->altura, caso->canais == 2);
+        else
+            cor = SDL_CreateSurface(caso->largura, caso->altura, SDL_PIXELFORMAT_RGBA32);
+        if (!img && !cor)
+        {
+            fprintf(stderr, "Erro ao criar imagem de teste: %s\n", SDL_GetError());
+            return false;
+        }
+        origem.img = img;
+        origem.cor = cor;
+        for (int y = 0; y < caso->altura; y++)
+        {
+            Uint8 *p = img ? linha_cinza(img, y) : (Uint8 *)cor->pixels + (size_t)y * cor->pitch;
+            for (int x = 0; x < caso->largura * (img ? 1 : 4); x++)
+                p[x] = amostra_teste_png(caso->conteudo, img ? x : x / 4, y);
+            if (img && img->alfa)
+                for (int x = 0; x < caso->largura; x++)
+                    linha_alfa(img, y)[x] = (Uint8)SDL_rand(NIVEIS);
+        }
+
+        // A imagem grande só passa por algumas combinações; as pequenas, por todas
+        bool grande = caso->altura > 1000;
+        int combinacoes = grande ? (int)SDL_arraysize(grandes)
+                                 : (int)SDL_arraysize(niveis) * (int)SDL_arraysize(nomes_filtro_png);
+        long divergencias = 0;
+        for (int i = 0; i < combinacoes; i++)
+        {
+            OpcoesPng op = grande ? grandes[i]
+                                  : (OpcoesPng){niveis[i / SDL_arraysize(nomes_filtro_png)],
+                                                (FiltroPng)(i % SDL_arraysize(nomes_filtro_png))};
+            SDL_IOStream *io = SDL_IOFromDynamicMem();
+            bool gravado = io && escrever_png(&origem, io, &op, NULL) && SDL_SeekIO(io, 0, SDL_IO_SEEK_SET) == 0;
+            if (!gravado)
+            {
+                fprintf(stderr, "Erro ao gravar PNG de teste: %s\n", SDL_GetError());
+                SDL_CloseIO(io);
+                divergencias += (long)caso->largura * caso->altura;
+                continue;
+            }
+            long d = comparar_png(&origem, IMG_Load_IO(io, true));
+            if (d)
+                fprintf(stderr, "PNG %s, nível %d, filtro %s: %ld pixels divergentes\n", caso->nome, op.nivel,
+                        nomes_filtro_png[op.filtro], d);
+            divergencias += d;
+        }
+        printf("PNG (%s): %s (%ld divergências)\n", caso->nome, divergencias ? "FALHOU" : "ok", divergencias);
+        if (divergencias)
+            ok = false;
+        destruir_imagem_cinza(img);
+        SDL_DestroySurface(cor);
+    }
+    return ok;
+}
+
+/* --------- gravação em segundo plano ----------
+   Uma thread gravadora tira os PNG da thread da interface. Cada pedido leva uma
+   cópia da imagem (a exibida pode ser trocada ou destruída no meio) e a fila tem
+   um lugar só: um pedido novo que chega enquanto outro ainda espera substitui o
+   antigo, então apertar S várias vezes grava só a última versão. O resultado
+   volta como um evento do tipo `evento`, tratado por relatar_gravacao. */
+typedef struct
+{
+    ImagemCinza *copia;
+    ImagemCinza16 *copia16; // no lugar de copia, para gravar em 16 bits
+    char *caminho;
+    OpcoesPng op;
+} PedidoGravacao;
+
+typedef struct
+{
+    SDL_Thread *thread;
+    SDL_Mutex *mutex;
+    SDL_Condition *cond;
+    PedidoGravacao *pendente; // ainda não iniciado; protegido por mutex
+    bool encerrar;
+    SDL_AtomicInt progresso;     // linhas comprimidas do pedido em gravação
+    SDL_AtomicInt altura_atual;  // 0 quando parada
+    Uint32 evento;
+} GravadorPng;
+
+static void liberar_pedido(PedidoGravacao *p)
+{
+    if (!p)
+        return;
+    destruir_imagem_cinza(p->copia);
+    destruir_imagem_cinza16(p->copia16);
+    SDL_free(p->caminho);
+    SDL_free(p);
+}
+
+/* Evento de conclusão: code 1 = sucesso; data1 = caminho, data2 = mensagem de
+   erro ou NULL, ambos liberados por relatar_gravacao */
+static void avisar_gravacao(GravadorPng *g, PedidoGravacao *p, bool ok)
+{
+    SDL_Event ev;
+    SDL_zero(ev);
+    ev.type = g->evento;
+    ev.user.code = ok;
+    ev.user.data1 = p->caminho;
+    ev.user.data2 = ok ? NULL : SDL_strdup(SDL_GetError());
+    p->caminho = NULL;
+    if (!SDL_PushEvent(&ev))
+    {
+        SDL_free(ev.user.data1);
+        SDL_free(ev.user.data2);
+    }
+}
+
+static int SDLCALL thread_gravadora(void *arg)
+{
+    GravadorPng *g = arg;
+    SDL_LockMutex(g->mutex);
+    for (;;)
+    {
+        while (!g->pendente && !g->encerrar)
+            SDL_WaitCondition(g->cond, g->mutex);
+        if (!g->pendente)
+            break; // encerrar só depois de esvaziar a fila
+        PedidoGravacao *p = g->pendente;
+        g->pendente = NULL;
+        SDL_SetAtomicInt(&g->progresso, 0);
+        SDL_SetAtomicInt(&g->altura_atual, SDL_max(p->copia16 ? p->copia16->altura : p->copia->altura, 1));
+        SDL_UnlockMutex(g->mutex);
+
+        bool ok = p->copia16 ? salvar_png_cinza16(p->copia16, p->caminho, &p->op, &g->progresso)
+                             : salvar_png_cinza(p->copia, p->caminho, &p->op, &g->progresso);
+        avisar_gravacao(g, p, ok);
+        liberar_pedido(p);
+
+        SDL_LockMutex(g->mutex);
+        SDL_SetAtomicInt(&g->altura_atual, 0);
+    }
+    SDL_UnlockMutex(g->mutex);
+    return 0;
+}
+
+bool iniciar_gravador(GravadorPng *g)
+{
+    SDL_zerop(g);
+    g->evento = SDL_RegisterEvents(1);
+    if (g->evento == 0)
+        return false;
+    g->mutex = SDL_CreateMutex();
+    g->cond = SDL_CreateCondition();
+    if (g->mutex && g->cond)
+        g->thread = SDL_CreateThread(thread_gravadora, "gravador", g);
+    if (!g->thread)
+    {
+        SDL_DestroyCondition(g->cond);
+        SDL_DestroyMutex(g->mutex);
+        g->mutex = NULL;
+        g->cond = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Grava o que ainda estiver na fila e para a thread
+void encerrar_gravador(GravadorPng *g)
+{
+    if (!g->thread)
+        return;
+    SDL_LockMutex(g->mutex);
+    g->encerrar = true;
+    SDL_SignalCondition(g->cond);
+    SDL_UnlockMutex(g->mutex);
+    SDL_WaitThread(g->thread, NULL);
+    SDL_DestroyCondition(g->cond);
+    SDL_DestroyMutex(g->mutex);
+    g->thread = NULL;
+}
+
+/* Enfileira uma cópia de img, ou de img16 (em 16 bits) quando não for NULL.
+   *substituido diz se um pedido que ainda esperava foi descartado no lugar deste. */
+bool pedir_gravacao(GravadorPng *g, const ImagemCinza *img, const ImagemCinza16 *img16, const char *caminho,
+                    const OpcoesPng *op, bool *substituido)
+{
+    PedidoGravacao *p = SDL_calloc(1, sizeof(PedidoGravacao));
+    if (!p)
+        return false;
+    if (img16)
+        p->copia16 = criar_imagem_cinza16(img16->largura, img16->altura, img16->maximo);
+    else
+        p->copia = criar_imagem_cinza(img->largura, img->altura, img->alfa != NULL);
+    p->caminho = SDL_strdup(caminho);
+    p->op = *op;
+    if ((!p->copia && !p->copia16) || !p->caminho)
+    {
+        liberar_pedido(p);
+        return false;
+    }
+    if (img16)
+        for (int y = 0; y < img16->altura; y++)
+            SDL_memcpy(linha_cinza16(p->copia16, y), linha_cinza16(img16, y), (size_t)img16->largura * 2);
+    else
+        for (int y = 0; y < img->altura; y++)
+        {
+            SDL_memcpy(linha_cinza(p->copia, y), linha_cinza(img, y), img->largura);
+            if (img->alfa)
+                SDL_memcpy(linha_alfa(p->copia, y), linha_alfa(img, y), img->largura);
+        }
+
+    SDL_LockMutex(g->mutex);
+    PedidoGravacao *antigo = g->pendente;
+    g->pendente = p;
+    SDL_SignalCondition(g->cond);
+    SDL_UnlockMutex(g->mutex);
+    *substituido = antigo != NULL;
+    liberar_pedido(antigo);
+    return true;
+}
+
+// Porcentagem do PNG em gravação, ou -1 com a thread parada
+int porcentagem_gravacao(GravadorPng *g)
+{
+    int altura = SDL_GetAtomicInt(&g->altura_atual);
+    if (altura == 0)
+        return -1;
+    return (int)SDL_min((Sint64)SDL_GetAtomicInt(&g->progresso) * 100 / altura, 100);
+}
+
+bool gravador_ocupado(GravadorPng *g)
+{
+    if (!g->thread)
+        return false;
+    SDL_LockMutex(g->mutex);
+    bool ocupado = g->pendente || SDL_GetAtomicInt(&g->altura_atual) != 0;
+    SDL_UnlockMutex(g->mutex);
+    return ocupado;
+}
+
+// Mostra o resultado de um evento do gravador e libera o que ele carrega
+void relatar_gravacao(const SDL_Event *ev)
+{
+    if (ev->user.code)
+        printf("Imagem salva como '%s'\n", (const char *)ev->user.data1);
+    else
+        fprintf(stderr, "Erro ao salvar PNG %s: %s\n", (const char *)ev->user.data1,
+                ev->user.data2 ? (const char *)ev->user.data2 : "sem memória");
+    SDL_free(ev->user.data1);
+    SDL_free(ev->user.data2);
+}
+
+/* --------- histograma paralelo ----------
+   Cada trabalhador conta em LANES_HIST sub-histogramas, alternando por pixel,
+   para que valores repetidos não encadeiem incrementos no mesmo contador. As
+   lanes são de 32 bits e descarregam no total de 64 bits antes de estourar, então
+   nem imagens de vários gigapixels nem faixas enormes (--grao) perdem contagens. */
+#define LANES_HIST 4
+
+typedef struct
+{
+    Uint32 lanes[LANES_HIST][NIVEIS];
+    Sint64 total[NIVEIS];
+    Uint32 pendentes; // pixels contados nas lanes e ainda fora de total
+    char preenchimento[64 - sizeof(Uint32)];
+} HistogramaParcial;
+
+typedef struct
+{
+    const ImagemCinza *img;
+    HistogramaParcial *parciais; // um por trabalhador
+} ContextoHistograma;
+
+static void descarregar_parcial(HistogramaParcial *p)
+{
+    for (int l = 0; l < LANES_HIST; l++)
+        for (int i = 0; i < NIVEIS; i++)
+            p->total[i] += p->lanes[l][i];
+    SDL_memset(p->lanes, 0, sizeof(p->lanes));
+    p->pendentes = 0;
+}
+
+static inline void acumular_histograma_linha(HistogramaParcial *p, const Uint8 *linha, int largura)
+{
+    if (p->pendentes > SDL_MAX_UINT32 - (Uint32)largura)
+        descarregar_parcial(p);
+    p->pendentes += (Uint32)largura;
+
+    Uint32 (*h)[NIVEIS] = p->lanes;
+    int x = 0;
+    for (; x + 4 <= largura; x += 4)
+    {
+        h[0][linha[x]]++;
+        h[1][linha[x + 1]]++;
+        h[2][linha[x + 2]]++;
+        h[3][linha[x + 3]]++;
+    }
+    for (; x < largura; x++)
+        h[0][linha[x]]++;
+}
+
+static void reduzir_histogramas(HistogramaParcial *parciais, int n, Sint64 hist[NIVEIS])
+{
+    for (int i = 0; i < NIVEIS; i++)
+        hist[i] = 0;
+    for (int t = 0; t < n; t++)
+    {
+        descarregar_parcial(&parciais[t]);
+        for (int i = 0; i < NIVEIS; i++)
+            hist[i] += parciais[t].total[i];
+    }
+}
+
+static void histograma_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    ContextoHistograma *ctx = p;
+    for (int y = y0; y < y1; y++)
+        acumular_histograma_linha(&ctx->parciais[trabalhador], linha_cinza(ctx->img, y), ctx->img->largura);
+}
+
+void calcular_histograma(const ImagemCinza *img, Sint64 hist[NIVEIS])
+{
+    for (int i = 0; i < NIVEIS; i++)
+        hist[i] = 0;
+
+    int n = num_trabalhadores();
+    ContextoHistograma ctx = {img, SDL_aligned_alloc(64, n * sizeof(HistogramaParcial))};
+    if (!ctx.parciais)
+    {
+        // Sem memória para os parciais: conta direto, numa thread só
+        for (int y = 0; y < img->altura; y++)
+        {
+            const Uint8 *linha = linha_cinza(img, y);
+            for (int x = 0; x < img->largura; x++)
+                hist[linha[x]]++;
+        }
+        return;
+    }
+    SDL_memset(ctx.parciais, 0, n * sizeof(HistogramaParcial));
+
+    executar_em_faixas(img->altura, grao_para_largura(img->largura), histograma_faixa, &ctx);
+
+    reduzir_histogramas(ctx.parciais, n, hist);
+    SDL_aligned_free(ctx.parciais);
+}
+
+/* --------- conversão fundida ----------
+   Numa única passada pelas linhas da origem: detecta se a imagem já é cinza, gera
+   o plano de luma e acumula o histograma, enquanto cada linha ainda está no cache. */
+typedef struct
+{
+    SDL_Surface *orig;
+    ImagemCinza *cinza;
+    LayoutPixel lay;
+    HistogramaParcial *parciais; // NULL quando o histograma não foi pedido
+    SDL_AtomicInt colorida;      // vira 1 no primeiro pixel que não é cinza
+} ContextoConversao;
+
+static bool linha_eh_cinza(const Uint8 *src, int largura, const LayoutPixel *lay)
+{
+    for (int x = 0; x < largura; x++, src += lay->bpp)
+        if (!eh_cinza(src[lay->oR], src[lay->oG], src[lay->oB]))
+            return false;
+    return true;
+}
+
+static void conversao_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    ContextoConversao *ctx = p;
+    const SDL_Surface *orig = ctx->orig;
+    const LayoutPixel *lay = &ctx->lay;
+
+    for (int y = y0; y < y1; y++)
+    {
+        const Uint8 *src = (const Uint8 *)orig->pixels + (size_t)y * orig->pitch;
+        Uint8 *dst = linha_cinza(ctx->cinza, y);
+        kernel_luma(src, dst, orig->w, lay);
+        if (ctx->cinza->alfa)
+        {
+            Uint8 *a = linha_alfa(ctx->cinza, y);
+            for (int x = 0; x < orig->w; x++)
+                a[x] = src[x * 4 + lay->oA];
+        }
+        if (!SDL_GetAtomicInt(&ctx->colorida) && !linha_eh_cinza(src, orig->w, lay))
+            SDL_SetAtomicInt(&ctx->colorida, 1);
+        if (ctx->parciais)
+            acumular_histograma_linha(&ctx->parciais[trabalhador], dst, orig->w);
+    }
+}
+
+/* Converte a superfície para o plano de cinza de 8 bits. hist e ja_era_cinza são
+   opcionais; quando pedidos, saem da mesma passada da conversão. */
+ImagemCinza *converte_para_cinza_com_histograma(SDL_Surface *orig, Sint64 hist[NIVEIS], bool *ja_era_cinza)
+{
+    if (!orig)
+        return NULL;
+
+    bool pode_ter_alfa = SDL_ISPIXELFORMAT_ALPHA(orig->format) || SDL_ISPIXELFORMAT_INDEXED(orig->format);
+    ImagemCinza *cinza = criar_imagem_cinza(orig->w, orig->h, pode_ter_alfa);
+    if (!cinza)
+    {
+        fprintf(stderr, "Erro ao criar imagem cinza: %s\n", SDL_GetError());
+        return NULL;
+    }
+
+    if (SDL_MUSTLOCK(orig))
+    {
+        if (!SDL_LockSurface(orig))
+        {
+            fprintf(stderr, "Erro ao realizar lock na surface original: %s\n", SDL_GetError());
+            destruir_imagem_cinza(cinza);
+            return NULL;
+        }
+    }
+
+    ContextoConversao ctx = {.orig = orig, .cinza = cinza};
+    bool histograma_pronto = false;
+    if (layout_do_formato(orig->format, &ctx.lay))
+    {
+        int n = num_trabalhadores();
+        if (hist && (ctx.parciais = SDL_aligned_alloc(64, n * sizeof(HistogramaParcial))) != NULL)
+            SDL_memset(ctx.parciais, 0, n * sizeof(HistogramaParcial));
+        executar_em_faixas(orig->h, grao_para_largura(orig->w), conversao_faixa, &ctx);
+        if (ctx.parciais)
+        {
+            reduzir_histogramas(ctx.parciais, n, hist);
+            SDL_aligned_free(ctx.parciais);
+            histograma_pronto = true;
+        }
+    }
+    else if (!converte_indexada(orig, cinza, &ctx.colorida))
+    {
+        converte_generica(orig, cinza, &ctx.colorida);
+    }
+
+    if (SDL_MUSTLOCK(orig))
+        SDL_UnlockSurface(orig);
+    descartar_alfa_opaco(cinza);
+
+    // Formatos fora do caminho rápido contam o histograma numa passada separada
+    if (hist && !histograma_pronto)
+        calcular_histograma(cinza, hist);
+    if (ja_era_cinza)
+        *ja_era_cinza = !SDL_GetAtomicInt(&ctx.colorida);
+    return cinza;
+}
+
+ImagemCinza *converte_para_cinza(SDL_Surface *orig)
+{
+    return converte_para_cinza_com_histograma(orig, NULL, NULL);
+}
+
+// --------- gera LUT de equalização pela CDF ----------
+// Contagens de 64 bits: imagens e mosaicos podem passar de 2^31 pixels
+void gerar_lut_equalizacao(const Sint64 hist[NIVEIS], Sint64 total_pixels, Uint8 lut[NIVEIS])
+{
+    Sint64 cdf[NIVEIS];
+    Sint64 soma = 0;
+    for (int i = 0; i < NIVEIS; i++)
+    {
+        soma += hist[i];
+        cdf[i] = soma;
+    }
+    Sint64 cdf_min = 0;
+    for (int i = 0; i < NIVEIS; i++)
+    {
+        if (cdf[i] > 0)
+        {
+            cdf_min = cdf[i];
+            break;
+        }
+    }
+    if (total_pixels <= cdf_min)
+    {
+        for (int i = 0; i < NIVEIS; i++)
+            lut[i] = (Uint8)i;
+        return;
+    }
+    for (int i = 0; i < NIVEIS; i++)
+    {
+        double v = (double)(cdf[i] - cdf_min) / (double)(total_pixels - cdf_min);
+        if (v < 0.0)
+            v = 0.0;
+        if (v > 1.0)
+            v = 1.0;
+        lut[i] = (Uint8)lrint(v * 255.0);
+    }
+}
+
+// --------- aplica LUT e retorna nova imagem ----------
+typedef struct
+{
+    const ImagemCinza *src;
+    ImagemCinza *dst;
+    const Uint8 *lut;
+} ContextoLut;
+
+static void lut_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoLut *ctx = p;
+    for (int y = y0; y < y1; y++)
+    {
+        kernel_lut(linha_cinza(ctx->src, y), linha_cinza(ctx->dst, y), ctx->src->largura, ctx->lut);
+        if (ctx->src->alfa && ctx->dst != ctx->src)
+            SDL_memcpy(linha_alfa(ctx->dst, y), linha_alfa(ctx->src, y), ctx->src->largura);
+    }
+}
+
+ImagemCinza *aplicar_lut(const ImagemCinza *src, const Uint8 lut[NIVEIS])
+{
+    if (!src)
+        return NULL;
+    ImagemCinza *dst = criar_imagem_cinza(src->largura, src->altura, src->alfa != NULL);
+    if (!dst)
+    {
+        fprintf(stderr, "Erro ao criar imagem equalizada: %s\n", SDL_GetError());
+        return NULL;
+    }
+
+    ContextoLut ctx = {src, dst, lut};
+    executar_em_faixas(src->altura, grao_para_largura(src->largura), lut_faixa, &ctx);
+    return dst;
+}
+
+// Equalização global: LUT da CDF do histograma aplicada sobre a imagem
+ImagemCinza *equalizar_imagem(const ImagemCinza *img, const Sint64 hist[NIVEIS])
+{
+    Uint8 lut[NIVEIS];
+    gerar_lut_equalizacao(hist, (Sint64)img->largura * img->altura, lut);
+    return aplicar_lut(img, lut);
+}
+
+/* --------- equalização preservando a cor ----------
+   Só a luma é equalizada: Y do YCbCr, com os mesmos pesos BT.709 da conversão
+   para cinza, então histograma e LUT são exatamente os da equalização global. Na
+   volta, Cb e Cr originais são mantidos. Como eles só dependem de B - Y e R - Y
+   (e os pesos somam 1), somar a mesma diferença Y' - Y aos três canais é a
+   inversa do YCbCr com a crominância intacta, sem guardar os planos de Cb e Cr
+   nem fazer contas em ponto flutuante por pixel. Só as cores que saem de 0..255
+   são saturadas, canal a canal. A ida é o kernel de luma, a volta o de cor. */
+typedef struct
+{
+    const SDL_Surface *src; // RGBA32
+    SDL_Surface *dst;       // RGBA32; pode ser a própria src
+    const ImagemCinza *luma;
+    const ImagemCinza *luma_nova;
+} ContextoCor;
+
+static void cor_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoCor *ctx = p;
+    for (int y = y0; y < y1; y++)
+        kernel_cor((const Uint8 *)ctx->src->pixels + (size_t)y * ctx->src->pitch,
+                   (Uint8 *)ctx->dst->pixels + (size_t)y * ctx->dst->pitch, linha_cinza(ctx->luma, y),
+                   linha_cinza(ctx->luma_nova, y), ctx->dst->w);
+}
+
+/* Monta a imagem colorida equalizada, em RGBA32: luma é orig convertida para
+   cinza e luma_nova, essa luma depois da LUT. Formatos que não são RGBA32 passam
+   antes por uma conversão da SDL, e o kernel trabalha no lugar. */
+SDL_Surface *voltar_para_cor(SDL_Surface *orig, const ImagemCinza *luma, const ImagemCinza *luma_nova)
+{
+    bool direto = orig->format == SDL_PIXELFORMAT_RGBA32;
+    SDL_Surface *dst = direto ? SDL_CreateSurface(orig->w, orig->h, SDL_PIXELFORMAT_RGBA32)
+                              : SDL_ConvertSurface(orig, SDL_PIXELFORMAT_RGBA32);
+    if (!dst)
+        return NULL;
+    if (direto && SDL_MUSTLOCK(orig) && !SDL_LockSurface(orig))
+    {
+        SDL_DestroySurface(dst);
+        return NULL;
+    }
+
+    ContextoCor ctx = {direto ? orig : dst, dst, luma, luma_nova};
+    executar_em_faixas(dst->h, grao_para_largura(dst->w), cor_faixa, &ctx);
+
+    if (direto && SDL_MUSTLOCK(orig))
+        SDL_UnlockSurface(orig);
+    return dst;
+}
+
+// Equalização só da luma; *transparente diz se o resultado precisa do canal alfa
+SDL_Surface *equalizar_cor(SDL_Surface *orig, bool *transparente)
+{
+    Sint64 hist[NIVEIS];
+    ImagemCinza *luma = converte_para_cinza_com_histograma(orig, hist, NULL);
+    ImagemCinza *luma_nova = luma ? equalizar_imagem(luma, hist) : NULL;
+    SDL_Surface *dst = luma_nova ? voltar_para_cor(orig, luma, luma_nova) : NULL;
+    if (transparente)
+        *transparente = luma && luma->alfa;
+    destruir_imagem_cinza(luma_nova);
+    destruir_imagem_cinza(luma);
+    return dst;
+}
+
+/* --------- CLAHE ----------
+   Equalização adaptativa com limite de contraste: a imagem é dividida numa grade
+   de blocos, cada bloco tem seu histograma cortado em limite_corte vezes a média
+   por nível (o excesso é redistribuído entre todos os níveis) e vira uma LUT pela
+   mesma CDF da equalização global. Cada pixel interpola bilinearmente as LUTs dos
+   quatro blocos cujos centros o cercam. Os histogramas rodam no pool um bloco por
+   tarefa; a interpolação, em faixas de linhas. */
+#define MAX_GRADE_CLAHE 64
+
+typedef struct
+{
+    int grade_x;         // blocos na horizontal
+    int grade_y;         // blocos na vertical
+    double limite_corte; // múltiplo da média por nível; <= 0 desliga o corte
+} ParametrosClahe;
+
+typedef struct
+{
+    const ImagemCinza *src;
+    ImagemCinza *dst;
+    const ParametrosClahe *p;
+    int gx, gy;
+    Uint8 (*luts)[NIVEIS]; // gx * gy, por linha de blocos
+    // Por coluna: blocos vizinhos à esquerda/direita e peso do da direita (0..256)
+    Uint16 *bloco_x0;
+    Uint16 *bloco_x1;
+    Uint16 *peso_x;
+} ContextoClahe;
+
+// Corta cada nível em `limite` e espalha o excesso por igual, como no CLAHE clássico
+static void cortar_histograma(Sint64 hist[NIVEIS], Sint64 limite)
+{
+    Sint64 excesso = 0;
+    for (int i = 0; i < NIVEIS; i++)
+        if (hist[i] > limite)
+        {
+            excesso += hist[i] - limite;
+            hist[i] = limite;
+        }
+    Sint64 por_nivel = excesso / NIVEIS;
+    int resto = (int)(excesso % NIVEIS);
+    for (int i = 0; i < NIVEIS; i++)
+        hist[i] += por_nivel;
+    if (resto > 0)
+    {
+        int passo = NIVEIS / resto;
+        for (int i = 0; i < NIVEIS && resto > 0; i += passo, resto--)
+            hist[i]++;
+    }
+}
+
+static void clahe_blocos(void *p, int b0, int b1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoClahe *ctx = p;
+    const ImagemCinza *img = ctx->src;
+    HistogramaParcial parcial;
+
+    for (int b = b0; b < b1; b++)
+    {
+        int bx = b % ctx->gx, by = b / ctx->gx;
+        int x0 = (int)((Sint64)img->largura * bx / ctx->gx);
+        int x1 = (int)((Sint64)img->largura * (bx + 1) / ctx->gx);
+        int y0 = (int)((Sint64)img->altura * by / ctx->gy);
+        int y1 = (int)((Sint64)img->altura * (by + 1) / ctx->gy);
+
+        SDL_memset(&parcial, 0, sizeof(parcial));
+        for (int y = y0; y < y1; y++)
+            acumular_histograma_linha(&parcial, linha_cinza(img, y) + x0, x1 - x0);
+        Sint64 hist[NIVEIS];
+        reduzir_histogramas(&parcial, 1, hist);
+
+        Sint64 area = (Sint64)(x1 - x0) * (y1 - y0);
+        if (ctx->p->limite_corte > 0)
+        {
+            double limite = ctx->p->limite_corte * area / NIVEIS;
+            cortar_histograma(hist, limite < 1.0 ? 1 : (Sint64)limite);
+        }
+        gerar_lut_equalizacao(hist, area, ctx->luts[b]);
+    }
+}
+
+static void clahe_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoClahe *ctx = p;
+    const ImagemCinza *src = ctx->src;
+
+    for (int y = y0; y < y1; y++)
+    {
+        // Mesma conta das colunas: posição do pixel em unidades de bloco, a partir do centro do primeiro
+        float fy = ((float)y + 0.5f) * ctx->gy / src->altura - 0.5f;
+        int by0 = fy < 0 ? 0 : (int)fy;
+        int by1 = by0 + 1 < ctx->gy ? by0 + 1 : by0;
+        int wy = fy < 0 ? 0 : (int)((fy - by0) * 256.0f + 0.5f);
+        if (by1 == by0)
+            wy = 0;
+
+        const Uint8 (*cima)[NIVEIS] = ctx->luts + by0 * ctx->gx;
+        const Uint8 (*baixo)[NIVEIS] = ctx->luts + by1 * ctx->gx;
+        const Uint8 *s = linha_cinza(src, y);
+        Uint8 *d = linha_cinza(ctx->dst, y);
+        for (int x = 0; x < src->largura; x++)
+        {
+            int v = s[x], bx0 = ctx->bloco_x0[x], bx1 = ctx->bloco_x1[x], wx = ctx->peso_x[x];
+            int c = cima[bx0][v] * (256 - wx) + cima[bx1][v] * wx;
+            int b = baixo[bx0][v] * (256 - wx) + baixo[bx1][v] * wx;
+            d[x] = (Uint8)((c * (256 - wy) + b * wy + (1 << 15)) >> 16);
+        }
+        if (src->alfa)
+            SDL_memcpy(linha_alfa(ctx->dst, y), linha_alfa(src, y), src->largura);
+    }
+}
+
+ImagemCinza *equalizar_clahe(const ImagemCinza *img, const ParametrosClahe *p)
+{
+    if (!img)
+        return NULL;
+
+    ContextoClahe ctx = {.src = img, .p = p};
+    ctx.gx = SDL_clamp(p->grade_x, 1, SDL_min(MAX_GRADE_CLAHE, img->largura));
+    ctx.gy = SDL_clamp(p->grade_y, 1, SDL_min(MAX_GRADE_CLAHE, img->altura));
+    ctx.dst = criar_imagem_cinza(img->largura, img->altura, img->alfa != NULL);
+    ctx.luts = SDL_malloc((size_t)ctx.gx * ctx.gy * NIVEIS);
+    ctx.bloco_x0 = SDL_malloc(3 * (size_t)img->largura * sizeof(Uint16));
+    if (!ctx.dst || !ctx.luts || !ctx.bloco_x0)
+    {
+        fprintf(stderr, "Erro ao criar imagem CLAHE: %s\n", SDL_GetError());
+        destruir_imagem_cinza(ctx.dst);
+        SDL_free(ctx.luts);
+        SDL_free(ctx.bloco_x0);
+        return NULL;
+    }
+    ctx.bloco_x1 = ctx.bloco_x0 + img->largura;
+    ctx.peso_x = ctx.bloco_x1 + img->largura;
+
+    for (int x = 0; x < img->largura; x++)
+    {
+        float fx = ((float)x + 0.5f) * ctx.gx / img->largura - 0.5f;
+        int bx0 = fx < 0 ? 0 : (int)fx;
+        int bx1 = bx0 + 1 < ctx.gx ? bx0 + 1 : bx0;
+        ctx.bloco_x0[x] = (Uint16)bx0;
+        ctx.bloco_x1[x] = (Uint16)bx1;
+        ctx.peso_x[x] = (Uint16)(fx < 0 || bx1 == bx0 ? 0 : (int)((fx - bx0) * 256.0f + 0.5f));
+    }
+
+    executar_em_faixas(ctx.gx * ctx.gy, 1, clahe_blocos, &ctx);
+    executar_em_faixas(img->altura, grao_para_largura(img->largura), clahe_faixa, &ctx);
+
+    SDL_free(ctx.bloco_x0);
+    SDL_free(ctx.luts);
+    return ctx.dst;
+}
+
+/* --------- equalização local (janela deslizante) ----------
+   Cada pixel é equalizado pelo histograma da janela (2r+1)x(2r+1) ao seu redor,
+   cortada nas bordas: saída = 255 * (pixels da janela <= v) / pixels da janela.
+   Algoritmo de Perreault e Hébert (2007): um histograma por coluna, cobrindo as
+   2r+1 linhas da janela, é atualizado ao descer uma linha com uma soma e uma
+   subtração; o da janela anda para a direita somando a coluna que entra e
+   subtraindo a que sai. Os histogramas têm dois níveis, 16 grupos de 16 níveis:
+   os grupos andam a cada pixel e os 16 níveis de um grupo só são atualizados
+   quando esse grupo é consultado, a partir da posição em que ficou. O custo por
+   pixel não depende de r. Cada faixa de linhas do pool monta as colunas uma vez
+   e desce por elas; as colunas ficam num buffer por trabalhador. */
+#define GRUPOS_HIST 16
+#define MAX_RAIO_LOCAL 32767 // 2r+1 cabe nas contagens de 16 bits das colunas
+
+typedef struct
+{
+    Uint16 (*fino)[NIVEIS];       // largura colunas
+    Uint16 (*grosso)[GRUPOS_HIST]; // largura colunas
+} ColunasLocal;
+
+typedef struct
+{
+    const ImagemCinza *src;
+    ImagemCinza *dst;
+    int raio;
+    ColunasLocal *colunas; // uma por trabalhador, alocada na primeira faixa que ele pega
+    SDL_AtomicInt sem_memoria;
+} ContextoLocal;
+
+static void coluna_local_somar(ColunasLocal *c, const Uint8 *linha, int largura, int sinal)
+{
+    for (int x = 0; x < largura; x++)
+    {
+        c->fino[x][linha[x]] += (Uint16)sinal;
+        c->grosso[x][linha[x] >> 4] += (Uint16)sinal;
+    }
+}
+
+static void local_linha(const ContextoLocal *ctx, const ColunasLocal *c, int y)
+{
+    const ImagemCinza *src = ctx->src;
+    const int w = src->largura, r = ctx->raio;
+    const Uint8 *s = linha_cinza(src, y);
+    Uint8 *d = linha_cinza(ctx->dst, y);
+    int linhas = SDL_min(src->altura - 1, y + r) - SDL_max(0, y - r) + 1;
+
+    Uint32 grosso[GRUPOS_HIST] = {0};
+    Uint32 fino[NIVEIS];
+    int atualizado[GRUPOS_HIST]; // x em que cada grupo do fino está em dia; -1 = nunca
+    for (int g = 0; g < GRUPOS_HIST; g++)
+        atualizado[g] = -1;
+
+    for (int x = 0; x <= SDL_min(w - 1, r); x++)
+        for (int g = 0; g < GRUPOS_HIST; g++)
+            grosso[g] += c->grosso[x][g];
+
+    for (int x = 0; x < w; x++)
+    {
+        if (x > 0)
+        {
+            if (x + r < w)
+                for (int g = 0; g < GRUPOS_HIST; g++)
+                    grosso[g] += c->grosso[x + r][g];
+            if (x - r - 1 >= 0)
+                for (int g = 0; g < GRUPOS_HIST; g++)
+                    grosso[g] -= c->grosso[x - r - 1][g];
+        }
+
+        int v = s[x], grupo = v >> 4;
+        Uint32 *f = fino + grupo * 16;
+        int de = atualizado[grupo];
+        if (de < 0 || x - de > 2 * r + 1)
+        {
+            // Grupo ainda não usado nesta linha, ou janela antiga sem sobreposição: remonta do zero
+            SDL_memset(f, 0, 16 * sizeof(Uint32));
+            for (int xx = SDL_max(0, x - r); xx <= SDL_min(w - 1, x + r); xx++)
+                for (int i = 0; i < 16; i++)
+                    f[i] += c->fino[xx][grupo * 16 + i];
+        }
+        else
+        {
+            for (int xx = de + 1; xx <= x; xx++)
+            {
+                if (xx + r < w)
+                    for (int i = 0; i < 16; i++)
+                        f[i] += c->fino[xx + r][grupo * 16 + i];
+                if (xx - r - 1 >= 0)
+                    for (int i = 0; i < 16; i++)
+                        f[i] -= c->fino[xx - r - 1][grupo * 16 + i];
+            }
+        }
+        atualizado[grupo] = x;
+
+        Uint32 posicao = 0;
+        for (int g = 0; g < grupo; g++)
+            posicao += grosso[g];
+        for (int i = 0; i <= (v & 15); i++)
+            posicao += f[i];
+        int colunas = SDL_min(w - 1, x + r) - SDL_max(0, x - r) + 1;
+        d[x] = (Uint8)((Uint64)posicao * 255 / ((Uint64)linhas * colunas));
+    }
+    if (src->alfa)
+        SDL_memcpy(linha_alfa(ctx->dst, y), linha_alfa(src, y), w);
+}
+
+static void local_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    ContextoLocal *ctx = p;
+    const ImagemCinza *src = ctx->src;
+    ColunasLocal *c = &ctx->colunas[trabalhador];
+    const int r = ctx->raio;
+
+    // Com poucas faixas, boa parte dos trabalhadores nunca chega aqui e não gasta nada
+    if (!c->fino)
+    {
+        c->fino = SDL_malloc((size_t)src->largura * sizeof(*c->fino));
+        c->grosso = SDL_malloc((size_t)src->largura * sizeof(*c->grosso));
+        if (!c->fino || !c->grosso)
+        {
+            SDL_free(c->fino);
+            SDL_free(c->grosso);
+            c->fino = NULL;
+            c->grosso = NULL;
+            SDL_SetAtomicInt(&ctx->sem_memoria, 1);
+            return;
+        }
+    }
+    SDL_memset(c->fino, 0, (size_t)src->largura * sizeof(*c->fino));
+    SDL_memset(c->grosso, 0, (size_t)src->largura * sizeof(*c->grosso));
+    for (int y = SDL_max(0, y0 - r); y <= SDL_min(src->altura - 1, y0 + r); y++)
+        coluna_local_somar(c, linha_cinza(src, y), src->largura, 1);
+
+    for (int y = y0; y < y1; y++)
+    {
+        if (y > y0)
+        {
+            if (y + r < src->altura)
+                coluna_local_somar(c, linha_cinza(src, y + r), src->largura, 1);
+            if (y - r - 1 >= 0)
+                coluna_local_somar(c, linha_cinza(src, y - r - 1), src->largura, -1);
+        }
+        local_linha(ctx, c, y);
+    }
+}
+
+ImagemCinza *equalizar_local(const ImagemCinza *img, int raio)
+{
+    if (!img)
+        return NULL;
+
+    int n = num_trabalhadores();
+    ContextoLocal ctx = {.src = img, .raio = SDL_clamp(raio, 1, MAX_RAIO_LOCAL)};
+    ctx.dst = criar_imagem_cinza(img->largura, img->altura, img->alfa != NULL);
+    ctx.colunas = SDL_calloc(n, sizeof(ColunasLocal));
+    if (ctx.dst && ctx.colunas)
+    {
+        // Cada faixa remonta 2r+1 linhas de colunas; faixas bem maiores que isso diluem o custo
+        int grao = SDL_max(grao_para_largura(img->largura), 4 * ctx.raio);
+        executar_em_faixas(img->altura, grao, local_faixa, &ctx);
+    }
+    // O erro das threads do pool não chega a esta; a falta de memória é registrada aqui
+    if (!ctx.dst || !ctx.colunas || SDL_GetAtomicInt(&ctx.sem_memoria))
+    {
+        if (ctx.dst)
+            SDL_OutOfMemory();
+        destruir_imagem_cinza(ctx.dst);
+        ctx.dst = NULL;
+    }
+
+    for (int t = 0; ctx.colunas && t < n; t++)
+    {
+        SDL_free(ctx.colunas[t].fino);
+        SDL_free(ctx.colunas[t].grosso);
+    }
+    SDL_free(ctx.colunas);
+    return ctx.dst;
+}
+
+// Referência direta da equalização local: conta os pixels da janela cortada, um a um
+static Uint8 equalizar_local_pixel(const ImagemCinza *img, int raio, int x, int y)
+{
+    int y0 = SDL_max(0, y - raio), y1 = SDL_min(img->altura - 1, y + raio);
+    int x0 = SDL_max(0, x - raio), x1 = SDL_min(img->largura - 1, x + raio);
+    Uint8 v = linha_cinza(img, y)[x];
+    Uint64 posicao = 0;
+    for (int yy = y0; yy <= y1; yy++)
+        for (int xx = x0; xx <= x1; xx++)
+            posicao += linha_cinza(img, yy)[xx] <= v;
+    return (Uint8)(posicao * 255 / ((Uint64)(y1 - y0 + 1) * (x1 - x0 + 1)));
+}
+
+/* Compara equalizar_local com a referência em imagens aleatórias, variando raio,
+   tamanho e --grao (faixas de tamanhos diferentes remontam as colunas em pontos
+   diferentes). Metade das imagens usa poucos níveis, o que faz os grupos do
+   histograma fino ficarem muitos pixels sem consulta. */
+bool verificar_equalizacao_local(void)
+{
+    static const int graos[] = {0, 1, 2, 5, 16};
+    const int grao_salvo = grao_configurado;
+    long divergencias = 0;
+    bool ok = true;
+    for (int rodada = 0; ok && rodada < 60; rodada++)
+    {
+        int largura = 1 + SDL_rand(90), altura = 1 + SDL_rand(70);
+        int raio = 1 + SDL_rand(rodada % 3 ? 8 : 40);
+        ImagemCinza *img = criar_imagem_cinza(largura, altura, rodada % 4 == 0);
+        if (!img)
+        {
+            fprintf(stderr, "Erro ao criar imagem de teste: %s\n", SDL_GetError());
+            ok = false;
+            break;
+        }
+        int niveis = rodada % 2 ? NIVEIS : 1 + SDL_rand(4);
+        for (int y = 0; y < altura; y++)
+        {
+            Uint8 *p = linha_cinza(img, y);
+            for (int x = 0; x < largura; x++)
+                p[x] = (Uint8)(niveis == NIVEIS ? SDL_rand(NIVEIS) : SDL_rand(niveis) * 85);
+            if (img->alfa)
+                for (int x = 0; x < largura; x++)
+                    linha_alfa(img, y)[x] = (Uint8)SDL_rand(NIVEIS);
+        }
+
+        grao_configurado = graos[rodada % SDL_arraysize(graos)];
+        ImagemCinza *eq = equalizar_local(img, raio);
+        if (!eq)
+        {
+            fprintf(stderr, "Erro na equalização local: %s\n", SDL_GetError());
+            ok = false;
+        }
+        for (int y = 0; eq && y < altura; y++)
+            for (int x = 0; x < largura; x++)
+            {
+                divergencias += linha_cinza(eq, y)[x] != equalizar_local_pixel(img, raio, x, y);
+                if (img->alfa)
+                    divergencias += linha_alfa(eq, y)[x] != linha_alfa(img, y)[x];
+            }
+        destruir_imagem_cinza(eq);
+        destruir_imagem_cinza(img);
+    }
+    grao_configurado = grao_salvo;
+
+    printf("Equalização local : %s (%ld divergências)\n", ok && !divergencias ? "ok" : "FALHOU", divergencias);
+    return ok && !divergencias;
+}
+
+bool verificar_kernels(void)
+{
+    bool luma_ok = verificar_kernels_luma();
+    bool lut_ok = verificar_kernels_lut();
+    bool cor_ok = verificar_kernels_cor();
+    bool reducao_ok = verificar_kernels_reducao();
+    bool local_ok = verificar_equalizacao_local();
+    bool png_ok = verificar_png();
+    return luma_ok && lut_ok && cor_ok && reducao_ok && local_ok && png_ok;
+}
+
+typedef enum
+{
+    EQ_GLOBAL,
+    EQ_CLAHE,
+    EQ_LOCAL
+} ModoEqualizacao;
+
+/* --------- pipeline de 16 bits ----------
+   Equalização em precisão total para PGM de 9 a 16 bits: histograma de 65536
+   níveis, CDF e LUT de 16 bits; só a exibição passa para 8 bits. Cada trabalhador
+   conta numa tabela própria do tamanho de 0..maximo, que é de 16 KiB para 12 bits
+   (cabe no L1) e de 256 KiB no pior caso (cabe no L2). Separar antes pelo byte
+   alto (radix) para manter as contagens no L1 saiu de 2,5 a 3 vezes mais lento do
+   que contar direto: as duas passadas extras custam mais do que as faltas evitadas.
+   As tabelas são de 32 bits; quando um trabalhador chega perto de estourar, ele
+   soma a sua no histograma final, sob uma trava, e recomeça do zero. */
+#define NIVEIS16 65536
+
+typedef struct
+{
+    const ImagemCinza16 *img;
+    Uint32 *tabelas[MAX_TRABALHADORES]; // `niveis` entradas, criadas na primeira faixa de cada trabalhador
+    Uint32 pendentes[MAX_TRABALHADORES]; // amostras na tabela desde a última descarga
+    int niveis;
+    Sint64 *hist;
+    SDL_SpinLock trava; // protege hist durante as descargas
+    SDL_AtomicInt sem_memoria;
+} ContextoHistograma16;
+
+static void descarregar_tabela16(ContextoHistograma16 *ctx, int trabalhador)
+{
+    Uint32 *h = ctx->tabelas[trabalhador];
+    SDL_LockSpinlock(&ctx->trava);
+    for (int i = 0; i < ctx->niveis; i++)
+        ctx->hist[i] += h[i];
+    SDL_UnlockSpinlock(&ctx->trava);
+    SDL_memset(h, 0, ctx->niveis * sizeof(Uint32));
+    ctx->pendentes[trabalhador] = 0;
+}
+
+static void histograma16_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    ContextoHistograma16 *ctx = p;
+    Uint32 *h = ctx->tabelas[trabalhador];
+    if (!h && !(h = ctx->tabelas[trabalhador] = SDL_calloc(ctx->niveis, sizeof(Uint32))))
+    {
+        SDL_SetAtomicInt(&ctx->sem_memoria, 1);
+        return;
+    }
+    const Uint16 maximo = (Uint16)(ctx->niveis - 1);
+    for (int y = y0; y < y1; y++)
+    {
+        if (ctx->pendentes[trabalhador] > SDL_MAX_UINT32 - (Uint32)ctx->img->largura)
+            descarregar_tabela16(ctx, trabalhador);
+        ctx->pendentes[trabalhador] += (Uint32)ctx->img->largura;
+        const Uint16 *linha = linha_cinza16(ctx->img, y);
+        // Amostras acima do maxval (arquivo malformado) contam como o maxval
+        for (int x = 0; x < ctx->img->largura; x++)
+            h[SDL_min(linha[x], maximo)]++;
+    }
+}
+
+// Trabalhadores que não pegaram nenhuma faixa não alocam nem entram na soma
+bool calcular_histograma16(const ImagemCinza16 *img, Sint64 hist[NIVEIS16])
+{
+    ContextoHistograma16 ctx;
+    SDL_zero(ctx);
+    ctx.img = img;
+    ctx.niveis = img->maximo + 1;
+    ctx.hist = hist;
+    SDL_memset(hist, 0, sizeof(Sint64) * NIVEIS16);
+    executar_em_faixas(img->altura, grao_para_largura(img->largura * 2), histograma16_faixa, &ctx);
+
+    for (int t = 0; t < MAX_TRABALHADORES; t++)
+    {
+        if (ctx.tabelas[t])
+            descarregar_tabela16(&ctx, t);
+        SDL_free(ctx.tabelas[t]);
+    }
+    return SDL_GetAtomicInt(&ctx.sem_memoria) ? SDL_OutOfMemory() : true;
+}
+
+// Mesma CDF da versão de 8 bits, com a saída em 0..maximo
+void gerar_lut_equalizacao16(const Sint64 hist[NIVEIS16], Sint64 total_pixels, int maximo, Uint16 lut[NIVEIS16])
+{
+    Sint64 cdf_min = 0;
+    for (int i = 0; i < NIVEIS16 && cdf_min == 0; i++)
+        cdf_min = hist[i];
+    if (total_pixels <= cdf_min)
+    {
+        for (int i = 0; i < NIVEIS16; i++)
+            lut[i] = (Uint16)SDL_min(i, maximo);
+        return;
+    }
+    Sint64 cdf = 0;
+    for (int i = 0; i < NIVEIS16; i++)
+    {
+        cdf += hist[i];
+        double v = (double)(cdf - cdf_min) / (double)(total_pixels - cdf_min);
+        if (v < 0.0)
+            v = 0.0;
+        if (v > 1.0)
+            v = 1.0;
+        lut[i] = (Uint16)lrint(v * maximo);
+    }
+}
+
+typedef struct
+{
+    const ImagemCinza16 *src;
+    void *dst; // ImagemCinza16 ou ImagemCinza, conforme a tarefa
+    const void *lut;
+} ContextoLut16;
+
+static void lut16_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoLut16 *ctx = p;
+    const Uint16 *lut = ctx->lut;
+    for (int y = y0; y < y1; y++)
+    {
+        const Uint16 *src = linha_cinza16(ctx->src, y);
+        Uint16 *dst = linha_cinza16(ctx->dst, y);
+        for (int x = 0; x < ctx->src->largura; x++)
+            dst[x] = lut[src[x]];
+    }
+}
+
+// lut tem NIVEIS16 entradas; a saída herda o maximo da entrada
+ImagemCinza16 *aplicar_lut16(const ImagemCinza16 *src, const Uint16 lut[NIVEIS16])
+{
+    ImagemCinza16 *dst = criar_imagem_cinza16(src->largura, src->altura, src->maximo);
+    if (!dst)
+        return NULL;
+    ContextoLut16 ctx = {src, dst, lut};
+    executar_em_faixas(src->altura, grao_para_largura(src->largura * 2), lut16_faixa, &ctx);
+    return dst;
+}
+
+ImagemCinza16 *equalizar_imagem16(const ImagemCinza16 *img)
+{
+    Sint64 *hist = SDL_malloc(sizeof(Sint64) * NIVEIS16);
+    Uint16 *lut = SDL_malloc(sizeof(Uint16) * NIVEIS16);
+    ImagemCinza16 *dst = NULL;
+    if (hist && lut && calcular_histograma16(img, hist))
+    {
+        gerar_lut_equalizacao16(hist, (Sint64)img->largura * img->altura, img->maximo, lut);
+        dst = aplicar_lut16(img, lut);
+    }
+    SDL_free(lut);
+    SDL_free(hist);
+    return dst;
+}
+
+static void reduzir_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoLut16 *ctx = p;
+    const Uint8 *lut = ctx->lut;
+    for (int y = y0; y < y1; y++)
+    {
+        const Uint16 *src = linha_cinza16(ctx->src, y);
+        Uint8 *dst = linha_cinza(ctx->dst, y);
+        for (int x = 0; x < ctx->src->largura; x++)
+            dst[x] = lut[src[x]];
+    }
+}
+
+// Versão de 8 bits para exibir: 0..maximo vira 0..255
+ImagemCinza *reduzir_para_8bits(const ImagemCinza16 *img)
+{
+    Uint8 *lut = SDL_malloc(NIVEIS16);
+    ImagemCinza *dst = lut ? criar_imagem_cinza(img->largura, img->altura, false) : NULL;
+    if (dst)
+    {
+        for (int i = 0; i < NIVEIS16; i++)
+            lut[i] = (Uint8)lrint(SDL_min(i, img->maximo) * 255.0 / img->maximo);
+        ContextoLut16 ctx = {img, dst, lut};
+        executar_em_faixas(img->altura, grao_para_largura(img->largura * 2), reduzir_faixa, &ctx);
+    }
+    SDL_free(lut);
+    return dst;
+}
+
+/* --------- pirâmide de mipmaps e visualizador ----------
+   A janela não recebe a imagem inteira numa textura só, que pode passar do
+   limite da GPU. Cada nível da pirâmide tem metade da largura e da altura do
+   anterior (média 2x2) e é cortado em ladrilhos de LADO_LADRILHO_GPU pixels.
+   A cada quadro só os ladrilhos do nível adequado ao zoom que cruzam a janela
+   vão para a GPU, num cache que reaproveita o ladrilho usado há mais tempo.
+   As texturas do cache são de streaming e nunca são recriadas: trocar o
+   ladrilho de uma entrada ou mudar a imagem só reenvia os pixels alterados. */
+#define LADO_LADRILHO_GPU 256
+#define MAX_NIVEIS_MIP 24
+#define MAX_LADRILHOS_GPU 384
+#define ENVIOS_POR_QUADRO 32 // envios de ladrilho por quadro; o resto espera o próximo
+#define ZOOM_MAXIMO 32.0
+
+typedef struct
+{
+    int niveis;
+    ImagemCinza *nivel[MAX_NIVEIS_MIP]; // nivel[0] é a própria imagem, emprestada
+} PiramideMip;
+
+typedef struct
+{
+    const ImagemCinza *src;
+    ImagemCinza *dst;
+    int x0; // colunas [x0, x1) e linhas a partir de y0 do nível reduzido
+    int x1;
+    int y0;
+} ContextoMip;
+
+// Com largura ímpar, a última coluna não tem par e faz a média só na vertical
+static void reduzir_linha_mip(const Uint8 *a, const Uint8 *b, Uint8 *dst, int largura_src)
+{
+    kernel_reducao(a, b, dst, largura_src / 2);
+    if (largura_src & 1)
+        dst[largura_src / 2] = (Uint8)((a[largura_src - 1] + b[largura_src - 1] + 1) >> 1);
+}
+
+static void mip_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    const ContextoMip *ctx = p;
+    const ImagemCinza *src = ctx->src;
+    int xa = 2 * ctx->x0, n = SDL_min(2 * ctx->x1, src->largura) - xa;
+    (void)trabalhador;
+    for (int y = ctx->y0 + y0; y < ctx->y0 + y1; y++)
+    {
+        // Com altura ímpar, a última linha faz par com ela mesma
+        int ya = 2 * y, yb = SDL_min(2 * y + 1, src->altura - 1);
+        reduzir_linha_mip(linha_cinza(src, ya) + xa, linha_cinza(src, yb) + xa, linha_cinza(ctx->dst, y) + ctx->x0, n);
+        if (src->alfa)
+            reduzir_linha_mip(linha_alfa(src, ya) + xa, linha_alfa(src, yb) + xa, linha_alfa(ctx->dst, y) + ctx->x0, n);
+    }
+}
+
+// Recalcula no pool o retângulo r do nível dst a partir do nível src
+static void reduzir_regiao(const ImagemCinza *src, ImagemCinza *dst, const SDL_Rect *r)
+{
+    ContextoMip ctx = {src, dst, r->x, r->x + r->w, r->y};
+    // Cada linha de saída lê duas da entrada
+    executar_em_faixas(r->h, grao_para_largura(2 * r->w), mip_faixa, &ctx);
+}
+
+// Pixels do nível seguinte que dependem de algum pixel de r
+static SDL_Rect regiao_reduzida(SDL_Rect r)
+{
+    return (SDL_Rect){r.x / 2, r.y / 2, (r.x + r.w + 1) / 2 - r.x / 2, (r.y + r.h + 1) / 2 - r.y / 2};
+}
+
+ImagemCinza *reduzir_metade(const ImagemCinza *img)
+{
+    ImagemCinza *r = criar_imagem_cinza((img->largura + 1) / 2, (img->altura + 1) / 2, img->alfa != NULL);
+    if (!r)
+        return NULL;
+    reduzir_regiao(img, r, &(SDL_Rect){0, 0, r->largura, r->altura});
+    return r;
+}
+
+void destruir_piramide(PiramideMip *p)
+{
+    for (int i = 1; i < p->niveis; i++)
+        destruir_imagem_cinza(p->nivel[i]);
+    p->niveis = 0;
+}
+
+// Reduz até o topo caber num único ladrilho
+bool construir_piramide(PiramideMip *p, ImagemCinza *img)
+{
+    p->niveis = 1;
+    p->nivel[0] = img;
+    while (p->niveis < MAX_NIVEIS_MIP)
+    {
+        const ImagemCinza *topo = p->nivel[p->niveis - 1];
+        if (topo->largura <= LADO_LADRILHO_GPU && topo->altura <= LADO_LADRILHO_GPU)
+            break;
+        ImagemCinza *r = reduzir_metade(topo);
+        if (!r)
+        {
+            destruir_piramide(p);
+            return false;
+        }
+        p->nivel[p->niveis++] = r;
+    }
+    return true;
+}
+
+/* Retângulo que envolve os pixels diferentes entre duas imagens do mesmo
+   tamanho (cinza e alfa). Cada trabalhador acumula a sua caixa; linhas iguais
+   custam um memcmp e, nas diferentes, só as pontas são percorridas. */
+typedef struct
+{
+    _Alignas(64) int x0; // uma linha de cache por trabalhador, também no vetor da pilha
+    int y0, x1, y1;
+} CaixaDiferenca;
+
+typedef struct
+{
+    const ImagemCinza *a;
+    const ImagemCinza *b;
+    CaixaDiferenca caixas[MAX_TRABALHADORES];
+} ContextoDiferenca;
+
+// Amplia [x0, x1) para cobrir os bytes diferentes da linha; false se ela é igual
+static bool colunas_diferentes(const Uint8 *a, const Uint8 *b, int largura, int *x0, int *x1)
+{
+    if (SDL_memcmp(a, b, largura) == 0)
+        return false;
+    int i = 0, j = largura;
+    while (a[i] == b[i])
+        i++;
+    while (a[j - 1] == b[j - 1])
+        j--;
+    *x0 = SDL_min(*x0, i);
+    *x1 = SDL_max(*x1, j);
+    return true;
+}
+
+static void diferenca_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    ContextoDiferenca *ctx = p;
+    CaixaDiferenca *c = &ctx->caixas[trabalhador];
+    int largura = ctx->a->largura;
+    for (int y = y0; y < y1; y++)
+    {
+        bool diferente = colunas_diferentes(linha_cinza(ctx->a, y), linha_cinza(ctx->b, y), largura, &c->x0, &c->x1);
+        if (ctx->a->alfa && ctx->b->alfa)
+            diferente |= colunas_diferentes(linha_alfa(ctx->a, y), linha_alfa(ctx->b, y), largura, &c->x0, &c->x1);
+        if (diferente)
+        {
+            c->y0 = SDL_min(c->y0, y);
+            c->y1 = SDL_max(c->y1, y + 1);
+        }
+    }
+}
+
+bool regiao_alterada(const ImagemCinza *antes, const ImagemCinza *depois, SDL_Rect *r)
+{
+    ContextoDiferenca ctx = {.a = antes, .b = depois};
+    for (int i = 0; i < MAX_TRABALHADORES; i++)
+        ctx.caixas[i] = (CaixaDiferenca){.x0 = antes->largura, .y0 = antes->altura};
+    executar_em_faixas(antes->altura, grao_para_largura(antes->largura), diferenca_faixa, &ctx);
+
+    CaixaDiferenca total = ctx.caixas[0];
+    for (int i = 1; i < MAX_TRABALHADORES; i++)
+    {
+        total.x0 = SDL_min(total.x0, ctx.caixas[i].x0);
+        total.y0 = SDL_min(total.y0, ctx.caixas[i].y0);
+        total.x1 = SDL_max(total.x1, ctx.caixas[i].x1);
+        total.y1 = SDL_max(total.y1, ctx.caixas[i].y1);
+    }
+    *r = (SDL_Rect){total.x0, total.y0, SDL_max(0, total.x1 - total.x0), SDL_max(0, total.y1 - total.y0)};
+    return r->w > 0 && r->h > 0;
+}
+
+/* Troca a base por outra do mesmo tamanho (ou a mesma, alterada) e refaz nos
+   níveis já alocados só o que depende da região alterada (NULL = tudo). */
+void atualizar_piramide(PiramideMip *p, ImagemCinza *base, const SDL_Rect *regiao)
+{
+    p->nivel[0] = base;
+    SDL_Rect r = regiao ? *regiao : (SDL_Rect){0, 0, base->largura, base->altura};
+    for (int i = 1; i < p->niveis && r.w > 0 && r.h > 0; i++)
+    {
+        r = regiao_reduzida(r);
+        reduzir_regiao(p->nivel[i - 1], p->nivel[i], &r);
+    }
+}
+
+typedef struct
+{
+    SDL_Texture *textura; // criada no primeiro uso da entrada e reaproveitada depois
+    bool ocupado;
+    int imagem; // índice da pirâmide de origem
+    int nivel;
+    int coluna;
+    int linha;
+    SDL_Rect sujo;     // parte do ladrilho a reenviar, em pixels do ladrilho; w = 0: em dia
+    Uint64 ultimo_uso; // quadro em que foi desenhado por último
+} LadrilhoGpu;
+
+/* Estado da janela principal: duas pirâmides (original e equalizada) com um cache
+   comum de ladrilhos. zoom é em pixels da janela por pixel da imagem e origem é o
+   ponto da imagem que cai no canto superior esquerdo da janela. */
+typedef struct
+{
+    SDL_Renderer *renderer;
+    const PiramideMip *piramides[2];
+    SDL_PixelFormat formato; // NV12 para imagens opacas, RGBA32 com alfa ou sem YUV
+    LadrilhoGpu ladrilhos[MAX_LADRILHOS_GPU];
+    Uint64 quadro;
+    int envios; // ladrilhos enviados no quadro atual
+    double zoom;
+    double origem_x;
+    double origem_y;
+    int largura_janela;
+    int altura_janela;
+} Visualizador;
+
+/* Plano de crominância neutra dos ladrilhos NV12: com Cb = Cr = 128 e faixa
+   completa (JPEG), R = G = B = Y, então o cinza sobe como está, com 1,5 byte por
+   pixel em vez de 4. */
+static Uint8 uv_neutro[LADO_LADRILHO_GPU / 2 * LADO_LADRILHO_GPU];
+
+static SDL_Texture *criar_textura_ladrilho(SDL_Renderer *renderer, SDL_PixelFormat formato)
+{
+    SDL_PropertiesID props = SDL_CreateProperties();
+    if (!props)
+        return NULL;
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_FORMAT_NUMBER, formato);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_ACCESS_NUMBER, SDL_TEXTUREACCESS_STREAMING);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_WIDTH_NUMBER, LADO_LADRILHO_GPU);
+    SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_HEIGHT_NUMBER, LADO_LADRILHO_GPU);
+    if (formato == SDL_PIXELFORMAT_NV12)
+        SDL_SetNumberProperty(props, SDL_PROP_TEXTURE_CREATE_COLORSPACE_NUMBER, SDL_COLORSPACE_JPEG);
+    SDL_Texture *tex = SDL_CreateTextureWithProperties(renderer, props);
+    SDL_DestroyProperties(props);
+    if (!tex)
+        return NULL;
+    // Sem interpolação entre ladrilhos vizinhos, as emendas não aparecem
+    SDL_SetTextureScaleMode(tex, SDL_SCALEMODE_NEAREST);
+    if (formato == SDL_PIXELFORMAT_RGBA32)
+        SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    return tex;
+}
+
+void iniciar_visualizador(Visualizador *v, SDL_Renderer *renderer, const PiramideMip *original,
+                          const PiramideMip *equalizada)
+{
+    SDL_zerop(v);
+    v->renderer = renderer;
+    v->piramides[0] = original;
+    v->piramides[1] = equalizada;
+    v->formato = original->nivel[0]->alfa ? SDL_PIXELFORMAT_RGBA32 : SDL_PIXELFORMAT_NV12;
+    v->zoom = 1.0;
+    SDL_memset(uv_neutro, 128, sizeof(uv_neutro));
+    SDL_GetCurrentRenderOutputSize(renderer, &v->largura_janela, &v->altura_janela);
+}
+
+// Destrói as texturas do cache, p.ex. quando o dispositivo reinicia ou no fim
+void liberar_ladrilhos(Visualizador *v)
+{
+    for (int i = 0; i < MAX_LADRILHOS_GPU; i++)
+    {
+        SDL_DestroyTexture(v->ladrilhos[i].textura);
+        SDL_zero(v->ladrilhos[i]);
+    }
+}
+
+/* Marca para reenvio a parte dos ladrilhos de uma imagem que depende de uma
+   região alterada do nível 0 (NULL = a imagem toda), em todos os níveis. Nada
+   sobe agora: cada ladrilho é atualizado quando for desenhado de novo. */
+void marcar_ladrilhos_sujos(Visualizador *v, int imagem, const SDL_Rect *regiao)
+{
+    const PiramideMip *p = v->piramides[imagem];
+    SDL_Rect r[MAX_NIVEIS_MIP];
+    r[0] = regiao ? *regiao : (SDL_Rect){0, 0, p->nivel[0]->largura, p->nivel[0]->altura};
+    for (int i = 1; i < p->niveis; i++)
+        r[i] = regiao_reduzida(r[i - 1]);
+
+    for (int i = 0; i < MAX_LADRILHOS_GPU; i++)
+    {
+        LadrilhoGpu *l = &v->ladrilhos[i];
+        if (!l->ocupado || l->imagem != imagem)
+            continue;
+        SDL_Rect area = {l->coluna * LADO_LADRILHO_GPU, l->linha * LADO_LADRILHO_GPU, LADO_LADRILHO_GPU, LADO_LADRILHO_GPU};
+        SDL_Rect alterado;
+        if (!SDL_GetRectIntersection(&r[l->nivel], &area, &alterado))
+            continue;
+        alterado.x -= area.x;
+        alterado.y -= area.y;
+        if (l->sujo.w > 0)
+            SDL_GetRectUnion(&l->sujo, &alterado, &l->sujo);
+        else
+            l->sujo = alterado;
+    }
+}
+
+/* Sobe a parte suja de um ladrilho direto do plano de 8 bits do nível: no NV12
+   o plano vai como luma, sem conversão; no RGBA32 cinza e alfa são intercalados
+   na memória da própria textura travada. */
+static bool enviar_ladrilho(Visualizador *v, LadrilhoGpu *l)
+{
+    const ImagemCinza *img = v->piramides[l->imagem]->nivel[l->nivel];
+    int x0 = l->coluna * LADO_LADRILHO_GPU + l->sujo.x, y0 = l->linha * LADO_LADRILHO_GPU + l->sujo.y;
+    v->envios++;
+    if (v->formato == SDL_PIXELFORMAT_NV12)
+    {
+        if (!SDL_UpdateNVTexture(l->textura, &l->sujo, linha_cinza(img, y0) + x0, img->passo, uv_neutro,
+                                 LADO_LADRILHO_GPU))
+            return false;
+    }
+    else
+    {
+        void *pixels;
+        int pitch;
+        if (!SDL_LockTexture(l->textura, &l->sujo, &pixels, &pitch))
+            return false;
+        for (int y = 0; y < l->sujo.h; y++)
+            cinza_para_rgba_linha(linha_cinza(img, y0 + y) + x0, img->alfa ? linha_alfa(img, y0 + y) + x0 : NULL,
+                                  (Uint8 *)pixels + (size_t)y * pitch, l->sujo.w);
+        SDL_UnlockTexture(l->textura);
+    }
+    l->sujo.w = 0;
+    return true;
+}
+
+static LadrilhoGpu *buscar_ladrilho(Visualizador *v, int imagem, int nivel, int coluna, int linha)
+{
+    for (int i = 0; i < MAX_LADRILHOS_GPU; i++)
+    {
+        LadrilhoGpu *l = &v->ladrilhos[i];
+        if (l->ocupado && l->imagem == imagem && l->nivel == nivel && l->coluna == coluna && l->linha == linha)
+        {
+            l->ultimo_uso = v->quadro;
+            return l;
+        }
+    }
+    return NULL;
+}
+
+/* Põe um ladrilho na entrada livre ou na usada há mais tempo, reaproveitando a
+   textura dela, e o envia inteiro. Devolve NULL quando o limite de envios do
+   quadro acabou ou quando todas as entradas estão na tela neste quadro. */
+static LadrilhoGpu *carregar_ladrilho(Visualizador *v, int imagem, int nivel, int coluna, int linha)
+{
+    if (v->envios >= ENVIOS_POR_QUADRO)
+        return NULL;
+    LadrilhoGpu *livre = &v->ladrilhos[0];
+    for (int i = 1; i < MAX_LADRILHOS_GPU && livre->ocupado; i++)
+        if (!v->ladrilhos[i].ocupado || v->ladrilhos[i].ultimo_uso < livre->ultimo_uso)
+            livre = &v->ladrilhos[i];
+    if (livre->ocupado && livre->ultimo_uso == v->quadro)
+        return NULL;
+
+    if (!livre->textura)
+    {
+        livre->textura = criar_textura_ladrilho(v->renderer, v->formato);
+        // Renderer sem YUV: todos os ladrilhos passam a ser RGBA32
+        if (!livre->textura && v->formato == SDL_PIXELFORMAT_NV12)
+        {
+            liberar_ladrilhos(v);
+            v->formato = SDL_PIXELFORMAT_RGBA32;
+            livre = &v->ladrilhos[0];
+            livre->textura = criar_textura_ladrilho(v->renderer, v->formato);
+        }
+        if (!livre->textura)
+            return NULL;
+    }
+
+    const ImagemCinza *img = v->piramides[imagem]->nivel[nivel];
+    int x0 = coluna * LADO_LADRILHO_GPU, y0 = linha * LADO_LADRILHO_GPU;
+    livre->ocupado = true;
+    livre->imagem = imagem;
+    livre->nivel = nivel;
+    livre->coluna = coluna;
+    livre->linha = linha;
+    livre->sujo = (SDL_Rect){0, 0, SDL_min(LADO_LADRILHO_GPU, img->largura - x0), SDL_min(LADO_LADRILHO_GPU, img->altura - y0)};
+    livre->ultimo_uso = v->quadro;
+    if (!enviar_ladrilho(v, livre))
+    {
+        livre->ocupado = false;
+        return NULL;
+    }
+    return livre;
+}
+
+// Nível mais reduzido que ainda tem pelo menos um pixel por pixel da janela
+static int nivel_para_zoom(const Visualizador *v, int imagem)
+{
+    int nivel = 0;
+    while (nivel + 1 < v->piramides[imagem]->niveis && v->zoom * (double)(1 << (nivel + 1)) <= 1.0)
+        nivel++;
+    return nivel;
+}
+
+static double zoom_para_caber(const Visualizador *v)
+{
+    const ImagemCinza *img = v->piramides[0]->nivel[0];
+    return SDL_min((double)v->largura_janela / img->largura, (double)v->altura_janela / img->altura);
+}
+
+// Centraliza o eixo em que a imagem cabe na janela e, no outro, não deixa ela sair da tela
+void limitar_visualizador(Visualizador *v)
+{
+    const ImagemCinza *img = v->piramides[0]->nivel[0];
+    v->zoom = SDL_clamp(v->zoom, SDL_min(zoom_para_caber(v), 1.0), ZOOM_MAXIMO);
+    double visivel_x = v->largura_janela / v->zoom, visivel_y = v->altura_janela / v->zoom;
+    v->origem_x = visivel_x >= img->largura ? (img->largura - visivel_x) / 2
+                                            : SDL_clamp(v->origem_x, 0.0, img->largura - visivel_x);
+    v->origem_y = visivel_y >= img->altura ? (img->altura - visivel_y) / 2
+                                           : SDL_clamp(v->origem_y, 0.0, img->altura - visivel_y);
+}
+
+// Muda o zoom mantendo parado o ponto da imagem sob (x, y) da janela
+void zoom_em_torno(Visualizador *v, double fator, double x, double y)
+{
+    double ix = v->origem_x + x / v->zoom, iy = v->origem_y + y / v->zoom;
+    v->zoom = SDL_clamp(v->zoom * fator, SDL_min(zoom_para_caber(v), 1.0), ZOOM_MAXIMO);
+    v->origem_x = ix - x / v->zoom;
+    v->origem_y = iy - y / v->zoom;
+    limitar_visualizador(v);
+}
+
+// Imagem inteira na janela, sem ampliar imagens menores que ela
+void ajustar_visualizador(Visualizador *v)
+{
+    v->zoom = SDL_min(zoom_para_caber(v), 1.0);
+    limitar_visualizador(v);
+}
+
+/* Desenha a parte visível da imagem. Um ladrilho que ainda não subiu é coberto
+   pelo pedaço de um nível mais reduzido que já está no cache, e um ladrilho sujo
+   aparece com o conteúdo antigo. Devolve false se algo ficou para depois por
+   causa do limite de envios, para que o quadro seguinte continue o trabalho. */
+bool desenhar_visualizador(Visualizador *v, int imagem)
+{
+    const PiramideMip *p = v->piramides[imagem];
+    int nivel = nivel_para_zoom(v, imagem);
+    const ImagemCinza *img = p->nivel[nivel];
+    double escala = v->zoom * (double)(1 << nivel); // pixels da janela por pixel do nível
+    double ox = v->origem_x / (double)(1 << nivel), oy = v->origem_y / (double)(1 << nivel);
+    int colunas = (img->largura + LADO_LADRILHO_GPU - 1) / LADO_LADRILHO_GPU;
+    int linhas = (img->altura + LADO_LADRILHO_GPU - 1) / LADO_LADRILHO_GPU;
+    int c0 = SDL_max(0, (int)SDL_floor(ox / LADO_LADRILHO_GPU));
+    int l0 = SDL_max(0, (int)SDL_floor(oy / LADO_LADRILHO_GPU));
+    int c1 = SDL_min(colunas - 1, (int)SDL_floor((ox + v->largura_janela / escala) / LADO_LADRILHO_GPU));
+    int l1 = SDL_min(linhas - 1, (int)SDL_floor((oy + v->altura_janela / escala) / LADO_LADRILHO_GPU));
+
+    v->quadro++;
+    v->envios = 0;
+    bool completo = true;
+    for (int l = l0; l <= l1; l++)
+    {
+        for (int c = c0; c <= c1; c++)
+        {
+            // Bordas calculadas a partir dos cantos, para ladrilhos vizinhos se encostarem
+            int x0 = c * LADO_LADRILHO_GPU, y0 = l * LADO_LADRILHO_GPU;
+            int x1 = SDL_min(x0 + LADO_LADRILHO_GPU, img->largura), y1 = SDL_min(y0 + LADO_LADRILHO_GPU, img->altura);
+            float dx0 = (float)((x0 - ox) * escala), dy0 = (float)((y0 - oy) * escala);
+            SDL_FRect destino = {dx0, dy0, (float)((x1 - ox) * escala) - dx0, (float)((y1 - oy) * escala) - dy0};
+
+            LadrilhoGpu *t = buscar_ladrilho(v, imagem, nivel, c, l);
+            if (t && t->sujo.w > 0 && (v->envios >= ENVIOS_POR_QUADRO || !enviar_ladrilho(v, t)))
+                completo = false;
+            if (!t)
+                t = carregar_ladrilho(v, imagem, nivel, c, l);
+            if (t)
+            {
+                SDL_FRect origem = {0, 0, (float)(x1 - x0), (float)(y1 - y0)};
+                SDL_RenderTexture(v->renderer, t->textura, &origem, &destino);
+                continue;
+            }
+            if (v->envios >= ENVIOS_POR_QUADRO)
+                completo = false;
+            for (int acima = nivel + 1; acima < p->niveis; acima++)
+            {
+                int d = acima - nivel; // o nível de cima é 2^d vezes menor
+                int ca = (x0 >> d) / LADO_LADRILHO_GPU, la = (y0 >> d) / LADO_LADRILHO_GPU;
+                t = buscar_ladrilho(v, imagem, acima, ca, la);
+                if (!t)
+                    continue;
+                float f = 1.0f / (float)(1 << d);
+                SDL_FRect origem = {x0 * f - ca * LADO_LADRILHO_GPU, y0 * f - la * LADO_LADRILHO_GPU,
+                                    (x1 - x0) * f, (y1 - y0) * f};
+                SDL_RenderTexture(v->renderer, t->textura, &origem, &destino);
+                break;
+            }
+        }
+    }
+    return completo;
+}
+
+/* ----------- Histograma desenhado dentro de uma área dedicada ----------- */
+void render_histograma(SDL_Renderer *renderer, const Sint64 *hist, Sint64 max_contagem, SDL_FRect area)
+{
+    const int margem_x = 10;
+    const int margem_y = 10;
+
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderFillRect(renderer, &area);
+
+    float iw = area.w - 2 * margem_x;
+    float ih = area.h - 2 * margem_y;
+    if (iw <= 0 || ih <= 0 || max_contagem <= 0)
+        return;
+
+    int largura_barras = (int)floor(iw / NIVEIS);
+    if (largura_barras < 1)
+        largura_barras = 1;
+
+    SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255);
+    SDL_FRect inner = {area.x + margem_x, area.y + margem_y, iw, ih};
+    SDL_RenderRect(renderer, &inner);
+
+    // Todas as barras vão ao renderer numa única chamada
+    SDL_FRect barras[NIVEIS];
+    int num_barras = 0;
+    for (int i = 0; i < NIVEIS; i++)
+    {
+        float proporcao = (float)((double)hist[i] / (double)max_contagem);
+        int altura_barra = (int)(ih * proporcao);
+        float bx = inner.x + (float)i * largura_barras;
+        float bw = (float)largura_barras;
+
+        if (bx + bw > inner.x + inner.w)
+            bw = (inner.x + inner.w) - bx;
+        if (bw <= 0)
+            break;
+
+        barras[num_barras++] = (SDL_FRect){
+            bx,
+            inner.y + inner.h - altura_barra,
+            bw,
+            (float)altura_barra};
+    }
+    SDL_SetRenderDrawColor(renderer, 100, 100, 255, 255);
+    SDL_RenderFillRects(renderer, barras, num_barras);
+}
+
+/* Histograma pré-desenhado numa textura alvo. Só é refeito quando os dados, o
+   tamanho da área ou o conteúdo da GPU (SDL_EVENT_RENDER_TARGETS_RESET) mudam;
+   nos outros quadros é uma única cópia de textura. */
+typedef struct
+{
+    SDL_Texture *textura;
+    const Sint64 *hist;
+    Sint64 max_contagem;
+    int largura;
+    int altura;
+    bool valido;
+} CacheHistograma;
+
+// Para quando o conteúdo de hist muda sem mudar o ponteiro
+void invalidar_cache_histograma(CacheHistograma *cache)
+{
+    cache->valido = false;
+}
+
+void destruir_cache_histograma(CacheHistograma *cache)
+{
+    SDL_DestroyTexture(cache->textura);
+    SDL_zerop(cache);
+}
+
+void render_histograma_cache(SDL_Renderer *renderer, CacheHistograma *cache, const Sint64 *hist, Sint64 max_contagem, SDL_FRect area)
+{
+    int w = (int)area.w, h = (int)area.h;
+    if (w <= 0 || h <= 0)
+        return;
+
+    if (!cache->textura || cache->largura != w || cache->altura != h)
+    {
+        SDL_DestroyTexture(cache->textura);
+        cache->textura = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, w, h);
+        cache->largura = w;
+        cache->altura = h;
+        cache->valido = false;
+    }
+    // Sem suporte a textura alvo: desenha direto, como antes
+    if (!cache->textura)
+    {
+        render_histograma(renderer, hist, max_contagem, area);
+        return;
+    }
+
+    if (!cache->valido || cache->hist != hist || cache->max_contagem != max_contagem)
+    {
+        SDL_Texture *alvo_anterior = SDL_GetRenderTarget(renderer);
+        SDL_SetRenderTarget(renderer, cache->textura);
+        render_histograma(renderer, hist, max_contagem, (SDL_FRect){0, 0, (float)w, (float)h});
+        SDL_SetRenderTarget(renderer, alvo_anterior);
+        cache->hist = hist;
+        cache->max_contagem = max_contagem;
+        cache->valido = true;
+    }
+    SDL_FRect dst = {area.x, area.y, (float)w, (float)h};
+    SDL_RenderTexture(renderer, cache->textura, NULL, &dst);
+}
+
+/* Cache de textos já rasterizados, por renderer. A chave é (texto, fonte, cor);
+   quando lota, sai a entrada usada há mais tempo. */
+#define MAX_TEXTOS_CACHE 16
+
+typedef struct
+{
+    char *texto;
+    TTF_Font *fonte;
+    SDL_Color cor;
+    SDL_Texture *textura;
+    Uint64 ultimo_uso;
+} EntradaTexto;
+
+typedef struct
+{
+    SDL_Renderer *renderer;
+    EntradaTexto entradas[MAX_TEXTOS_CACHE];
+    Uint64 relogio;
+} CacheTexto;
+
+static void liberar_entrada_texto(EntradaTexto *e)
+{
+    SDL_DestroyTexture(e->textura);
+    SDL_free(e->texto);
+    SDL_zerop(e);
+}
+
+// Descarta todas as texturas, p.ex. quando a fonte é fechada ou o dispositivo reinicia
+void limpar_cache_texto(CacheTexto *cache)
+{
+    for (int i = 0; i < MAX_TEXTOS_CACHE; i++)
+        liberar_entrada_texto(&cache->entradas[i]);
+}
+
+static SDL_Texture *textura_de_texto(CacheTexto *cache, const char *texto, TTF_Font *fonte, SDL_Color cor)
+{
+    EntradaTexto *livre = &cache->entradas[0];
+    for (int i = 0; i < MAX_TEXTOS_CACHE; i++)
+    {
+        EntradaTexto *e = &cache->entradas[i];
+        if (e->texto && e->fonte == fonte && SDL_memcmp(&e->cor, &cor, sizeof(cor)) == 0 &&
+            SDL_strcmp(e->texto, texto) == 0)
+        {
+            e->ultimo_uso = ++cache->relogio;
+            return e->textura;
+        }
+        if (livre->texto && (!e->texto || e->ultimo_uso < livre->ultimo_uso))
+            livre = e;
+    }
+
+    SDL_Surface *surfText = TTF_RenderText_Blended(fonte, texto, 0, cor);
+    if (!surfText)
+    {
+        fprintf(stderr, "Erro ao criar a superfície de texto: %s\n", SDL_GetError());
+        return NULL;
+    }
+    SDL_Texture *texText = SDL_CreateTextureFromSurface(cache->renderer, surfText);
+    SDL_DestroySurface(surfText);
+    if (!texText)
+        return NULL;
+
+    liberar_entrada_texto(livre);
+    livre->texto = SDL_strdup(texto);
+    if (!livre->texto)
+    {
+        SDL_DestroyTexture(texText);
+        return NULL;
+    }
+    livre->fonte = fonte;
+    livre->cor = cor;
+    livre->textura = texText;
+    livre->ultimo_uso = ++cache->relogio;
+    return texText;
+}
+
+void render_texto(CacheTexto *cache, const char *texto, float x, float y, TTF_Font *fonte, SDL_Color cor)
+{
+    SDL_Texture *texText = textura_de_texto(cache, texto, fonte, cor);
+    if (!texText)
+        return;
+    SDL_FRect dst = {x, y, (float)texText->w, (float)texText->h};
+    SDL_RenderTexture(cache->renderer, texText, NULL, &dst);
+}
+
+/* ----------- Modo streaming (imagens maiores que a memória) -----------
+   Equalização global em duas passadas sobre o arquivo, em faixas de linhas: a
+   primeira só acumula o histograma, a segunda relê cada faixa, aplica a LUT e
+   grava a saída. A memória usada é a de uma faixa, qualquer que seja a altura da
+   imagem. Entradas sem compressão, que permitem ler qualquer faixa direto do
+   arquivo: PGM/PPM binários (P5/P6, 8 bits) e BMP de 24/32 bits. Saída em PGM. */
+
+typedef struct
+{
+    SDL_IOStream *io;
+    int largura;
+    int altura;
+    Sint64 inicio_dados; // deslocamento da primeira linha gravada no arquivo
+    int bytes_linha;     // no arquivo, com o alinhamento de 4 bytes do BMP
+    bool de_baixo_para_cima;
+    bool cinza; // P5: os bytes já são a luma
+    int maximo; // maxval do PNM; acima de 255 as amostras têm 2 bytes
+    LayoutPixel lay;
+} LeitorFaixas;
+
+static bool ler_bytes(SDL_IOStream *io, void *buf, size_t n)
+{
+    Uint8 *p = buf;
+    while (n > 0)
+    {
+        size_t lidos = SDL_ReadIO(io, p, n);
+        if (lidos == 0)
+        {
+            if (SDL_GetIOStatus(io) == SDL_IO_STATUS_EOF)
+                SDL_SetError("Fim de arquivo inesperado");
+            return false;
+        }
+        p += lidos;
+        n -= lidos;
+    }
+    return true;
+}
+
+// Próximo número do cabeçalho PNM, pulando espaços e comentários (#...)
+static bool ler_numero_pnm(SDL_IOStream *io, int *valor)
+{
+    Uint8 c;
+    do
+    {
+        if (!SDL_ReadU8(io, &c))
+            return false;
+        if (c == '#')
+            while (c != '\n')
+                if (!SDL_ReadU8(io, &c))
+                    return false;
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+    Sint64 v = 0;
+    if (c < '0' || c > '9')
+        return SDL_SetError("Cabeçalho PNM inválido");
+    while (c >= '0' && c <= '9')
+    {
+        v = v * 10 + (c - '0');
+        if (v > SDL_MAX_SINT32)
+            return SDL_SetError("Cabeçalho PNM inválido");
+        if (!SDL_ReadU8(io, &c))
+            return false;
+    }
+    // O único espaço depois de maxval já foi consumido; o dado começa aqui
+    *valor = (int)v;
+    return true;
+}
+
+static bool abrir_pnm(LeitorFaixas *l, char tipo)
+{
+    int maximo;
+    if (!ler_numero_pnm(l->io, &l->largura) || !ler_numero_pnm(l->io, &l->altura) || !ler_numero_pnm(l->io, &maximo))
+        return false;
+    l->cinza = tipo == '5';
+    if (maximo != 255 && (!l->cinza || maximo < 256 || maximo > 65535))
+        return SDL_SetError("PNM com maxval %d não suportado (8 bits, ou PGM de 9 a 16 bits)", maximo);
+    l->maximo = maximo;
+    l->lay = (LayoutPixel){3, 0, 1, 2, -1};
+    l->bytes_linha = (int)((Sint64)l->largura * (l->cinza ? 1 : 3) * (maximo > 255 ? 2 : 1));
+    l->inicio_dados = SDL_TellIO(l->io);
+    return true;
+}
+
+static bool abrir_bmp(LeitorFaixas *l)
+{
+    Uint32 deslocamento, tam_cabecalho, compressao;
+    Sint32 largura, altura;
+    Uint16 planos, bpp;
+    if (SDL_SeekIO(l->io, 10, SDL_IO_SEEK_SET) < 0 || !SDL_ReadU32LE(l->io, &deslocamento) ||
+        !SDL_ReadU32LE(l->io, &tam_cabecalho) || !SDL_ReadS32LE(l->io, &largura) || !SDL_ReadS32LE(l->io, &altura) ||
+        !SDL_ReadU16LE(l->io, &planos) || !SDL_ReadU16LE(l->io, &bpp) || !SDL_ReadU32LE(l->io, &compressao))
+        return false;
+    if (tam_cabecalho < 40 || compressao != 0 || (bpp != 24 && bpp != 32))
+        return SDL_SetError("BMP não suportado: só 24/32 bits sem compressão");
+
+    l->largura = largura;
+    l->de_baixo_para_cima = altura > 0;
+    l->altura = altura > 0 ? altura : -altura;
+    l->lay = bpp == 24 ? (LayoutPixel){3, 2, 1, 0, -1} : (LayoutPixel){4, 2, 1, 0, -1};
+    l->bytes_linha = (int)(((Sint64)largura * (bpp / 8) + 3) & ~3);
+    l->inicio_dados = deslocamento;
+    return true;
+}
+
+bool abrir_leitor_faixas(const char *caminho, LeitorFaixas *l)
+{
+    SDL_zerop(l);
+    l->io = SDL_IOFromFile(caminho, "rb");
+    if (!l->io)
+        return false;
+
+    Uint8 magica[2];
+    bool ok = ler_bytes(l->io, magica, 2);
+    if (ok && magica[0] == 'P' && (magica[1] == '5' || magica[1] == '6'))
+        ok = abrir_pnm(l, (char)magica[1]);
+    else if (ok && magica[0] == 'B' && magica[1] == 'M')
+        ok = abrir_bmp(l);
+    else if (ok)
+        ok = SDL_SetError("Formato sem suporte a streaming (use PGM/PPM binário ou BMP sem compressão)");
+
+    if (ok && (l->largura <= 0 || l->altura <= 0 || l->largura > SDL_MAX_SINT32 / 4))
+        ok = SDL_SetError("Dimensões inválidas: %dx%d", l->largura, l->altura);
+    if (ok && l->maximo > 255)
+        ok = SDL_SetError("O modo streaming só aceita 8 bits por amostra");
+    if (!ok)
+    {
+        SDL_CloseIO(l->io);
+        l->io = NULL;
+    }
+    return ok;
+}
+
+typedef struct
+{
+    const LeitorFaixas *l;
+    const Uint8 *bruto;
+    ImagemCinza *faixa;
+} ContextoStream;
+
+static void stream_conversao_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoStream *ctx = p;
+    const LeitorFaixas *l = ctx->l;
+    for (int y = y0; y < y1; y++)
+    {
+        // BMP de baixo para cima: a faixa foi lida inteira e está invertida no buffer
+        int i = l->de_baixo_para_cima ? ctx->faixa->altura - 1 - y : y;
+        const Uint8 *src = ctx->bruto + (size_t)i * l->bytes_linha;
+        if (l->cinza)
+            SDL_memcpy(linha_cinza(ctx->faixa, y), src, l->largura);
+        else
+            kernel_luma(src, linha_cinza(ctx->faixa, y), l->largura, &l->lay);
+    }
+}
+
+// Lê as linhas [y0, y0 + faixa->altura) e converte para cinza em faixa
+static bool ler_faixa(const LeitorFaixas *l, int y0, Uint8 *bruto, ImagemCinza *faixa)
+{
+    int n = faixa->altura;
+    Sint64 primeira = l->de_baixo_para_cima ? l->altura - y0 - n : y0;
+    if (SDL_SeekIO(l->io, l->inicio_dados + primeira * l->bytes_linha, SDL_IO_SEEK_SET) < 0 ||
+        !ler_bytes(l->io, bruto, (size_t)n * l->bytes_linha))
+        return false;
+
+    ContextoStream ctx = {l, bruto, faixa};
+    executar_em_faixas(n, grao_para_largura(l->largura), stream_conversao_faixa, &ctx);
+    return true;
+}
+
+int executar_stream(const char *entrada, const char *saida, int linhas_faixa)
+{
+    if (!SDL_Init(0))
+    {
+        fprintf(stderr, "Erro ao inicializar o SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    LeitorFaixas l;
+    if (!abrir_leitor_faixas(entrada, &l))
+    {
+        fprintf(stderr, "Erro ao abrir '%s': %s\n", entrada, SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+    // Padrão: faixas de ~64 MiB do arquivo
+    if (linhas_faixa <= 0)
+        linhas_faixa = SDL_max(1, (64 * 1024 * 1024) / l.bytes_linha);
+    linhas_faixa = SDL_min(linhas_faixa, l.altura);
+
+    iniciar_pool(threads_configuradas);
+    Uint8 *bruto = SDL_malloc((size_t)linhas_faixa * l.bytes_linha);
+    ImagemCinza *buffer = criar_imagem_cinza(l.largura, linhas_faixa, false);
+    SDL_IOStream *out = NULL;
+    bool ok = bruto && buffer;
+    printf("Streaming: %dx%d em faixas de %d linhas\n", l.largura, l.altura, linhas_faixa);
+    Uint64 inicio = SDL_GetTicks();
+
+    // Passada 1: histograma
+    Sint64 hist[NIVEIS] = {0};
+    for (int y = 0; ok && y < l.altura; y += linhas_faixa)
+    {
+        ImagemCinza faixa = *buffer;
+        faixa.altura = SDL_min(linhas_faixa, l.altura - y);
+        Sint64 h[NIVEIS];
+        ok = ler_faixa(&l, y, bruto, &faixa);
+        if (ok)
+        {
+            calcular_histograma(&faixa, h);
+            for (int i = 0; i < NIVEIS; i++)
+                hist[i] += h[i];
+        }
+    }
+
+    // Passada 2: LUT e gravação
+    Uint8 lut[NIVEIS];
+    gerar_lut_equalizacao(hist, (Sint64)l.largura * l.altura, lut);
+    if (ok)
+    {
+        out = SDL_IOFromFile(saida, "wb");
+        ok = out && SDL_IOprintf(out, "P5\n%d %d\n255\n", l.largura, l.altura) > 0;
+    }
+    for (int y = 0; ok && y < l.altura; y += linhas_faixa)
+    {
+        ImagemCinza faixa = *buffer;
+        faixa.altura = SDL_min(linhas_faixa, l.altura - y);
+        ok = ler_faixa(&l, y, bruto, &faixa);
+        if (ok)
+        {
+            ContextoLut ctx = {&faixa, &faixa, lut};
+            executar_em_faixas(faixa.altura, grao_para_largura(faixa.largura), lut_faixa, &ctx);
+        }
+        for (int i = 0; ok && i < faixa.altura; i++)
+            ok = SDL_WriteIO(out, linha_cinza(&faixa, i), faixa.largura) == (size_t)faixa.largura;
+    }
+    if (out && !SDL_CloseIO(out))
+        ok = false;
+
+    if (ok)
+        printf("'%s' equalizada em '%s' em %.2f s\n", entrada, saida, (SDL_GetTicks() - inicio) / 1000.0);
+    else
+        fprintf(stderr, "Erro no streaming: %s\n", SDL_GetError());
+
+    destruir_imagem_cinza(buffer);
+    SDL_free(bruto);
+    SDL_CloseIO(l.io);
+    encerrar_pool();
+    SDL_Quit();
+    return ok ? 0 : 1;
+}
+
+/* ----------- PGM/PPM mapeados -----------
+   Intermediários sem compressão não passam por decodificador: o arquivo é
+   mapeado e os pixels são usados no lugar. Um P5 de 8 bits vira o próprio plano
+   de cinza, sem cópia; um P6 vira uma SDL_Surface RGB24 sobre o mapeamento e
+   segue pela conversão normal; um P5 de 16 bits é copiado para uma ImagemCinza16.
+   A gravação em PGM escreve num arquivo mapeado criado já no tamanho final. */
+
+static bool tem_extensao(const char *caminho, const char *ext)
+{
+    const char *ponto = SDL_strrchr(caminho, '.');
+    return ponto && SDL_strcasecmp(ponto + 1, ext) == 0;
+}
+
+bool eh_pnm(const char *caminho)
+{
+    return tem_extensao(caminho, "pgm") || tem_extensao(caminho, "ppm") || tem_extensao(caminho, "pnm");
+}
+
+static void SDLCALL liberar_mapeamento_surface(void *userdata, void *valor)
+{
+    (void)userdata;
+    desmapear_arquivo(valor);
+}
+
+// Lê o cabeçalho com o mesmo código do modo streaming, sobre a memória mapeada
+static bool cabecalho_pnm_mapeado(const ArquivoMapeado *m, LeitorFaixas *l, size_t *inicio)
+{
+    bool ok = m->tamanho >= 2 && m->base[0] == 'P' && (m->base[1] == '5' || m->base[1] == '6');
+    SDL_zerop(l);
+    if (!ok)
+        return SDL_SetError("Não é PGM/PPM binário");
+    l->io = SDL_IOFromConstMem(m->base + 2, m->tamanho - 2);
+    ok = l->io && abrir_pnm(l, (char)m->base[1]);
+    SDL_CloseIO(l->io);
+    l->io = NULL;
+    *inicio = (size_t)l->inicio_dados + 2;
+    if (ok && (l->largura <= 0 || l->altura <= 0 || l->largura > SDL_MAX_SINT32 / 4 ||
+               (m->tamanho - *inicio) / (size_t)l->bytes_linha < (size_t)l->altura))
+        ok = SDL_SetError("PGM/PPM truncado ou com dimensões inválidas");
+    return ok;
+}
+
+/* Mapeia um PGM/PPM binário de 8 bits: P5 sai em *cinza, P6 em *surface; o outro
+   fica NULL. Devolve false se o arquivo não pode ser usado assim (o chamador
+   pode então tentar o IMG_Load). PGM de 16 bits é com carregar_pgm16. */
+bool mapear_pnm(const char *caminho, ImagemCinza **cinza, SDL_Surface **surface)
+{
+    *cinza = NULL;
+    *surface = NULL;
+    ArquivoMapeado *m = mapear_arquivo(caminho, false, 0);
+    if (!m)
+        return false;
+
+    LeitorFaixas l;
+    size_t inicio;
+    bool ok = cabecalho_pnm_mapeado(m, &l, &inicio);
+    if (ok && l.maximo > 255)
+        ok = SDL_SetError("PGM de 16 bits");
+
+    if (ok && l.cinza)
+    {
+        *cinza = SDL_calloc(1, sizeof(ImagemCinza));
+        if ((ok = *cinza != NULL))
+        {
+            (*cinza)->largura = l.largura;
+            (*cinza)->altura = l.altura;
+            (*cinza)->passo = l.bytes_linha;
+            (*cinza)->dados = m->base + inicio;
+            (*cinza)->mapeamento = m;
+        }
+    }
+    else if (ok)
+    {
+        *surface = SDL_CreateSurfaceFrom(l.largura, l.altura, SDL_PIXELFORMAT_RGB24, m->base + inicio, l.bytes_linha);
+        ok = *surface && SDL_SetPointerPropertyWithCleanup(SDL_GetSurfaceProperties(*surface), "pdi.mapeamento", m,
+                                                            liberar_mapeamento_surface, NULL);
+        if (!ok && *surface)
+        {
+            // Em caso de falha a SDL já chamou a limpeza, que desmapeou o arquivo
+            SDL_DestroySurface(*surface);
+            *surface = NULL;
+            return false;
+        }
+    }
+    if (!ok)
+        desmapear_arquivo(m);
+    return ok;
+}
+
+typedef struct
+{
+    const Uint8 *src; // amostras big-endian do arquivo
+    size_t bytes_linha;
+    ImagemCinza16 *dst;
+} ContextoPgm16;
+
+static void pgm16_faixa(void *p, int y0, int y1, int trabalhador)
+{
+    (void)trabalhador;
+    ContextoPgm16 *ctx = p;
+    for (int y = y0; y < y1; y++)
+    {
+        const Uint8 *src = ctx->src + (size_t)y * ctx->bytes_linha;
+        Uint16 *dst = linha_cinza16(ctx->dst, y);
+        for (int x = 0; x < ctx->dst->largura; x++)
+            dst[x] = (Uint16)(src[2 * x] << 8 | src[2 * x + 1]);
+    }
+}
+
+/* PGM de 9 a 16 bits. O arquivo é mapeado, mas as amostras são copiadas: vêm
+   big-endian e, com um cabeçalho de tamanho ímpar, desalinhadas. Devolve NULL se
+   o arquivo não é um PGM de 16 bits válido. */
+ImagemCinza16 *carregar_pgm16(const char *caminho)
+{
+    ArquivoMapeado *m = mapear_arquivo(caminho, false, 0);
+    if (!m)
+        return NULL;
+    LeitorFaixas l;
+    size_t inicio;
+    ImagemCinza16 *img = NULL;
+    if (cabecalho_pnm_mapeado(m, &l, &inicio) && l.maximo > 255 &&
+        (img = criar_imagem_cinza16(l.largura, l.altura, l.maximo)))
+    {
+        ContextoPgm16 ctx = {m->base + inicio, (size_t)l.bytes_linha, img};
+        executar_em_faixas(img->altura, grao_para_largura(img->largura * 2), pgm16_faixa, &ctx);
+    }
+    desmapear_arquivo(m);
+    return img;
+}
+
+// Grava em 16 bits big-endian com o mesmo maxval da imagem
+bool salvar_pgm16(const ImagemCinza16 *img, const char *caminho)
+{
+    char cabecalho[64];
+    int n = SDL_snprintf(cabecalho, sizeof(cabecalho), "P5\n%d %d\n%d\n", img->largura, img->altura, img->maximo);
+    size_t bytes_linha = (size_t)img->largura * 2;
+    ArquivoMapeado *m = mapear_arquivo(caminho, true, n + bytes_linha * img->altura);
+    if (!m)
+        return false;
+    SDL_memcpy(m->base, cabecalho, n);
+    for (int y = 0; y < img->altura; y++)
+    {
+        const Uint16 *src = linha_cinza16(img, y);
+        Uint8 *dst = m->base + n + (size_t)y * bytes_linha;
+        for (int x = 0; x < img->largura; x++)
+        {
+            dst[2 * x] = (Uint8)(src[x] >> 8);
+            dst[2 * x + 1] = (Uint8)src[x];
+        }
+    }
+    bool ok = sincronizar_arquivo(m);
+    desmapear_arquivo(m);
+    return ok;
+}
+
+// Cria o PGM já no tamanho final e devolve o plano de cinza dentro do arquivo mapeado
+ImagemCinza *criar_pgm_mapeado(const char *caminho, int largura, int altura)
+{
+    char cabecalho[64];
+    int n = SDL_snprintf(cabecalho, sizeof(cabecalho), "P5\n%d %d\n255\n", largura, altura);
+    ImagemCinza *img = SDL_calloc(1, sizeof(ImagemCinza));
+    ArquivoMapeado *m = img ? mapear_arquivo(caminho, true, n + (size_t)largura * altura) : NULL;
+    if (!m)
+    {
+        SDL_free(img);
+        return NULL;
+    }
+    SDL_memcpy(m->base, cabecalho, n);
+    img->largura = largura;
+    img->altura = altura;
+    img->passo = largura;
+    img->dados = m->base + n;
+    img->mapeamento = m;
+    return img;
+}
+
+// O PGM não tem alfa: só o plano de cinza é gravado
+bool salvar_pgm_mapeado(const ImagemCinza *img, const char *caminho)
+{
+    ImagemCinza *dst = criar_pgm_mapeado(caminho, img->largura, img->altura);
+    if (!dst)
+        return false;
+    for (int y = 0; y < img->altura; y++)
+        SDL_memcpy(linha_cinza(dst, y), linha_cinza(img, y), img->largura);
+    bool ok = sincronizar_arquivo(dst->mapeamento);
+    destruir_imagem_cinza(dst);
+    return ok;
+}
+
+/* ----------- Modo lote (sem janelas) -----------
+   Pipeline em três etapas ligadas por filas limitadas: decodificação (IMG_Load, ou
+   mapeamento para PGM/PPM), processamento (cinza + histograma + equalização) e
+   codificação (PNG, ou PGM mapeado). Cada etapa
+   tem seus próprios trabalhadores; quando uma fila enche, a etapa anterior espera,
+   então no máximo trabalhadores + capacidade das filas imagens ficam na memória. */
+
+typedef struct
+{
+    int decodificadores;
+    int processadores;
+    int codificadores;
+    int capacidade_fila;
+    const char *extensao; // formato de saída: "png" ou "pgm"
+    bool cor;             // --cor: equaliza só a luma e grava PNG colorido
+} OpcoesLote;
+
+#define MAX_FILA_LOTE 1024 // cada lugar da fila pode segurar uma imagem decodificada
+
+// Fila bloqueante de ponteiros; fecha quando o último produtor avisa que terminou
+typedef struct
+{
+    void **itens;
+    int capacidade;
+    int inicio;
+    int tamanho;
+    int produtores;
+    SDL_Mutex *mutex;
+    SDL_Condition *nao_cheia;
+    SDL_Condition *nao_vazia;
+} FilaLimitada;
+
+static bool fila_iniciar(FilaLimitada *f, int capacidade, int produtores)
+{
+    SDL_zerop(f);
+    f->itens = SDL_calloc(capacidade, sizeof(void *));
+    f->capacidade = capacidade;
+    f->produtores = produtores;
+    f->mutex = SDL_CreateMutex();
+    f->nao_cheia = SDL_CreateCondition();
+    f->nao_vazia = SDL_CreateCondition();
+    return f->itens && f->mutex && f->nao_cheia && f->nao_vazia;
+}
+
+static void fila_liberar(FilaLimitada *f)
+{
+    SDL_DestroyCondition(f->nao_vazia);
+    SDL_DestroyCondition(f->nao_cheia);
+    SDL_DestroyMutex(f->mutex);
+    SDL_free(f->itens);
+}
+
+static void fila_inserir(FilaLimitada *f, void *item)
+{
+    SDL_LockMutex(f->mutex);
+    while (f->tamanho == f->capacidade)
+        SDL_WaitCondition(f->nao_cheia, f->mutex);
+    f->itens[(f->inicio + f->tamanho) % f->capacidade] = item;
+    f->tamanho++;
+    SDL_SignalCondition(f->nao_vazia);
+    SDL_UnlockMutex(f->mutex);
+}
+
+// Devolve NULL quando a fila está vazia e todos os produtores terminaram
+static void *fila_retirar(FilaLimitada *f)
+{
+    SDL_LockMutex(f->mutex);
+    while (f->tamanho == 0 && f->produtores > 0)
+        SDL_WaitCondition(f->nao_vazia, f->mutex);
+    void *item = NULL;
+    if (f->tamanho > 0)
+    {
+        item = f->itens[f->inicio];
+        f->inicio = (f->inicio + 1) % f->capacidade;
+        f->tamanho--;
+        SDL_SignalCondition(f->nao_cheia);
+    }
+    SDL_UnlockMutex(f->mutex);
+    return item;
+}
+
+static void fila_produtor_terminou(FilaLimitada *f)
+{
+    SDL_LockMutex(f->mutex);
+    if (--f->produtores == 0)
+        SDL_BroadcastCondition(f->nao_vazia);
+    SDL_UnlockMutex(f->mutex);
+}
+
+typedef struct
+{
+    char *entrada;
+    char *saida;
+    SDL_Surface *imagem;
+    ImagemCinza *cinza; // PGM mapeado: já chega em cinza da decodificação
+    ImagemCinza *resultado; // com --cor, a luma equalizada (e o alfa) de resultado_cor
+    SDL_Surface *resultado_cor; // --cor: RGBA32 com a crominância original
+    ImagemCinza16 *cinza16; // PGM de 16 bits: equalizado e gravado em 16 bits
+    ImagemCinza16 *resultado16;
+} ItemLote;
+
+typedef struct
+{
+    ItemLote *itens;
+    int num_itens;
+    SDL_AtomicInt proximo;
+    FilaLimitada decodificadas;
+    FilaLimitada processadas;
+    SDL_AtomicInt processados;
+    SDL_AtomicInt falhas;
+    bool cor;
+} Lote;
+
+static void item_falhou(Lote *lote, ItemLote *item)
+{
+    SDL_DestroySurface(item->imagem);
+    item->imagem = NULL;
+    destruir_imagem_cinza(item->cinza);
+    item->cinza = NULL;
+    destruir_imagem_cinza(item->resultado);
+    item->resultado = NULL;
+    SDL_DestroySurface(item->resultado_cor);
+    item->resultado_cor = NULL;
+    destruir_imagem_cinza16(item->cinza16);
+    item->cinza16 = NULL;
+    destruir_imagem_cinza16(item->resultado16);
+    item->resultado16 = NULL;
+    SDL_AddAtomicInt(&lote->falhas, 1);
+}
+
+static int SDLCALL etapa_decodificacao(void *p)
+{
+    Lote *lote = p;
+    for (;;)
+    {
+        int i = SDL_AddAtomicInt(&lote->proximo, 1);
+        if (i >= lote->num_itens)
+            break;
+        ItemLote *item = &lote->itens[i];
+        if (!(eh_pnm(item->entrada) && ((item->cinza16 = carregar_pgm16(item->entrada)) ||
+                      mapear_pnm(item->entrada, &item->cinza, &item->imagem))))
+            item->imagem = IMG_Load(item->entrada);
+        if (!item->imagem && !item->cinza && !item->cinza16)
+        {
+            fprintf(stderr, "%s: erro ao carregar: %s\n", item->entrada, SDL_GetError());
+            item_falhou(lote, item);
+            continue;
+        }
+        fila_inserir(&lote->decodificadas, item);
+    }
+    fila_produtor_terminou(&lote->decodificadas);
+    return 0;
+}
+
+static int SDLCALL etapa_processamento(void *p)
+{
+    Lote *lote = p;
+    ItemLote *item;
+    while ((item = fila_retirar(&lote->decodificadas)) != NULL)
+    {
+        if (item->cinza16)
+        {
+            item->resultado16 = equalizar_imagem16(item->cinza16);
+            destruir_imagem_cinza16(item->cinza16);
+            item->cinza16 = NULL;
+            if (!item->resultado16)
+                item_falhou(lote, item);
+            else
+                fila_inserir(&lote->processadas, item);
+            continue;
+        }
+        ImagemCinza *cinza = item->cinza;
+        item->cinza = NULL;
+        bool ja_era_cinza = true;
+        Sint64 hist[NIVEIS]; // fica na pilha: a lista de itens só guarda caminhos e ponteiros
+        if (cinza)
+            calcular_histograma(cinza, hist);
+        else
+            cinza = converte_para_cinza_com_histograma(item->imagem, hist, lote->cor ? &ja_era_cinza : NULL);
+        if (cinza)
+            item->resultado = equalizar_imagem(cinza, hist);
+        // --cor: a luma equalizada volta para as cores originais; imagens cinza seguem em cinza
+        if (item->resultado && !ja_era_cinza &&
+            !(item->resultado_cor = voltar_para_cor(item->imagem, cinza, item->resultado)))
+            fprintf(stderr, "%s: erro ao voltar para cor: %s\n", item->entrada, SDL_GetError());
+        SDL_DestroySurface(item->imagem);
+        item->imagem = NULL;
+        destruir_imagem_cinza(cinza);
+        if (!item->resultado || (!ja_era_cinza && !item->resultado_cor))
+        {
+            item_falhou(lote, item);
+            continue;
+        }
+        fila_inserir(&lote->processadas, item);
+    }
+    fila_produtor_terminou(&lote->processadas);
+    return 0;
+}
+
+static int SDLCALL etapa_codificacao(void *p)
+{
+    Lote *lote = p;
+    ItemLote *item;
+    while ((item = fila_retirar(&lote->processadas)) != NULL)
+    {
+        bool pgm = tem_extensao(item->saida, "pgm");
+        bool ok;
+        if (item->resultado16)
+            ok = pgm ? salvar_pgm16(item->resultado16, item->saida)
+                     : salvar_png_cinza16(item->resultado16, item->saida, &opcoes_png, NULL);
+        else if (item->resultado_cor)
+            ok = salvar_png_cor(item->resultado_cor, item->resultado->alfa != NULL, item->saida, &opcoes_png, NULL);
+        else
+            ok = pgm ? salvar_pgm_mapeado(item->resultado, item->saida) : salvar_imagem_cinza(item->resultado, item->saida);
+        if (ok)
+        {
+            SDL_AddAtomicInt(&lote->processados, 1);
+            destruir_imagem_cinza(item->resultado);
+            item->resultado = NULL;
+            SDL_DestroySurface(item->resultado_cor);
+            item->resultado_cor = NULL;
+            destruir_imagem_cinza16(item->resultado16);
+            item->resultado16 = NULL;
+        }
+        else
+        {
+            fprintf(stderr, "%s: erro ao salvar %s: %s\n", item->saida, pgm ? "PGM" : "PNG", SDL_GetError());
+            item_falhou(lote, item);
+        }
+    }
+    return 0;
 }
 
-// Converte superfície para escala de cinza
-SDL_Surface *converte_para_cinza(SDL_Surface *orig)
+// Troca a extensão do nome pela de saída e monta o caminho dentro de dir_saida
+static char *caminho_saida_lote(const char *dir_saida, const char *nome, const char *extensao)
 {
-    if (!orig)
+    const char *ponto = SDL_strrchr(nome, '.');
+    int tam_base = ponto ? (int)(ponto - nome) : (int)SDL_strlen(nome);
+    char *caminho = NULL;
+    if (SDL_asprintf(&caminho, "%s/%.*s.%s", dir_saida, tam_base, nome, extensao) < 0)
         return NULL;
+    return caminho;
+}
 
-    SDL_Surface *cinza = SDL_CreateSurface(orig->w, orig->h, orig->format);
-    if (!cinza)
+// Nomes de saída iguais para o sistema de arquivos (sem distinção de caixa no Windows e no macOS)
+static int comparar_saidas(const void *a, const void *b)
+{
+    const ItemLote *x = *(const ItemLote *const *)a, *y = *(const ItemLote *const *)b;
+#if defined(_WIN32) || defined(__APPLE__)
+    int c = SDL_strcasecmp(x->saida, y->saida);
+#else
+    int c = SDL_strcmp(x->saida, y->saida);
+#endif
+    // Empate pela posição na lista, para que o primeiro arquivo listado fique com a saída
+    return c ? c : (x < y ? -1 : x > y);
+}
+
+/* Como a extensão é trocada, foto.jpg e foto.png gravariam o mesmo arquivo, e
+   dois codificadores escreveriam nele ao mesmo tempo. Só o primeiro de cada
+   grupo fica na lista; os outros são avisados e devolvidos como falhas. */
+static int remover_saidas_repetidas(ItemLote *itens, int n)
+{
+    ItemLote **ordem = SDL_malloc((n > 0 ? n : 1) * sizeof(ItemLote *));
+    if (!ordem)
+        return -1;
+    for (int i = 0; i < n; i++)
+        ordem[i] = &itens[i];
+    SDL_qsort(ordem, n, sizeof(ItemLote *), comparar_saidas);
+    int repetidos = 0;
+    ItemLote *primeiro = n > 0 ? ordem[0] : NULL;
+    for (int i = 1; i < n; i++)
     {
-        fprintf(stderr, "Erro ao criar surface cinza: %s\n", SDL_GetError());
-        return NULL;
+#if defined(_WIN32) || defined(__APPLE__)
+        bool igual = SDL_strcasecmp(primeiro->saida, ordem[i]->saida) == 0;
+#else
+        bool igual = SDL_strcmp(primeiro->saida, ordem[i]->saida) == 0;
+#endif
+        if (!igual)
+        {
+            primeiro = ordem[i];
+            continue;
+        }
+        fprintf(stderr, "'%s' não foi processado: '%s' já grava em '%s'\n", ordem[i]->entrada, primeiro->entrada,
+                ordem[i]->saida);
+        SDL_free(ordem[i]->entrada);
+        SDL_free(ordem[i]->saida);
+        ordem[i]->entrada = ordem[i]->saida = NULL;
+        repetidos++;
     }
+    SDL_free(ordem);
 
-    if (SDL_MUSTLOCK(orig))
+    int total = 0;
+    for (int i = 0; i < n; i++)
+        if (itens[i].entrada)
+            itens[total++] = itens[i];
+    return repetidos;
+}
+
+// Monta a lista de itens com os arquivos regulares de dir_entrada
+static int listar_itens_lote(const char *dir_entrada, const char *dir_saida, const char *extensao, ItemLote **itens,
+                             int *repetidos)
+{
+    int n = 0;
+    char **nomes = SDL_GlobDirectory(dir_entrada, NULL, 0, &n);
+    if (!nomes)
+        return -1;
+
+    *itens = SDL_calloc(n > 0 ? n : 1, sizeof(ItemLote));
+    if (!*itens)
     {
-        if (!SDL_LockSurface(orig))
+        SDL_free(nomes);
+        return -1;
+    }
+
+    int total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        char *entrada = NULL;
+        if (SDL_asprintf(&entrada, "%s/%s", dir_entrada, nomes[i]) < 0)
+            continue;
+        SDL_PathInfo info;
+        char *saida = NULL;
+        if (!SDL_GetPathInfo(entrada, &info) || info.type != SDL_PATHTYPE_FILE ||
+            !(saida = caminho_saida_lote(dir_saida, nomes[i], extensao)))
         {
-            fprintf(stderr, "Erro ao realizar lock na surface original: %s\n", SDL_GetError());
-            SDL_DestroySurface(cinza);
-            return NULL;
+            SDL_free(entrada);
+            continue;
+        }
+        (*itens)[total].entrada = entrada;
+        (*itens)[total].saida = saida;
+        total++;
+    }
+    SDL_free(nomes);
+    *repetidos = remover_saidas_repetidas(*itens, total);
+    if (*repetidos < 0)
+    {
+        for (int i = 0; i < total; i++)
+        {
+            SDL_free((*itens)[i].entrada);
+            SDL_free((*itens)[i].saida);
+        }
+        SDL_free(*itens);
+        return -1;
+    }
+    return total - *repetidos;
+}
+
+// Threads que não sobem avisam a fila de saída no lugar delas, para não travar o consumidor
+static int iniciar_etapa(SDL_ThreadFunction fn, const char *nome, Lote *lote, int n,
+                         SDL_Thread **threads, FilaLimitada *saida)
+{
+    int iniciadas = 0;
+    for (int i = 0; i < n; i++)
+    {
+        threads[i] = SDL_CreateThread(fn, nome, lote);
+        if (threads[i])
+            iniciadas++;
+        else if (saida)
+            fila_produtor_terminou(saida);
+    }
+    if (iniciadas < n)
+        fprintf(stderr, "Erro ao criar threads de %s: %s\n", nome, SDL_GetError());
+    return iniciadas;
+}
+
+// Converte e equaliza todos os arquivos de dir_entrada, gravando PNGs em dir_saida
+int executar_lote(const char *dir_entrada, const char *dir_saida, const OpcoesLote *op)
+{
+    if (!SDL_Init(0))
+    {
+        fprintf(stderr, "Erro ao inicializar o SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    if (!SDL_CreateDirectory(dir_saida))
+    {
+        fprintf(stderr, "Erro ao criar diretório '%s': %s\n", dir_saida, SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    Lote lote;
+    SDL_zero(lote);
+    lote.cor = op->cor;
+    int repetidos = 0;
+    lote.num_itens = listar_itens_lote(dir_entrada, dir_saida, op->extensao, &lote.itens, &repetidos);
+    if (lote.num_itens < 0)
+    {
+        fprintf(stderr, "Erro ao listar '%s': %s\n", dir_entrada, SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    SDL_Thread *decod[MAX_TRABALHADORES] = {0}, *proc[MAX_TRABALHADORES] = {0}, *cod[MAX_TRABALHADORES] = {0};
+    int falha_inicio = 0;
+    if (!fila_iniciar(&lote.decodificadas, op->capacidade_fila, op->decodificadores) ||
+        !fila_iniciar(&lote.processadas, op->capacidade_fila, op->processadores))
+    {
+        fprintf(stderr, "Erro ao criar filas do lote: %s\n", SDL_GetError());
+        falha_inicio = 1;
+    }
+
+    iniciar_pool(threads_configuradas);
+    printf("Lote: %d arquivos, %d decodificadores, %d processadores, %d codificadores, filas de %d\n",
+           lote.num_itens, op->decodificadores, op->processadores, op->codificadores, op->capacidade_fila);
+    Uint64 inicio = SDL_GetTicks();
+    SDL_SetAtomicInt(&lote.falhas, repetidos);
+
+    if (!falha_inicio)
+    {
+        // De trás para frente: uma etapa só começa se a seguinte tem quem consuma
+        int n_cod = iniciar_etapa(etapa_codificacao, "codificacao", &lote, op->codificadores, cod, NULL);
+        int n_proc = n_cod ? iniciar_etapa(etapa_processamento, "processamento", &lote, op->processadores,
+                                           proc, &lote.processadas)
+                           : 0;
+        int n_decod = n_proc ? iniciar_etapa(etapa_decodificacao, "decodificacao", &lote, op->decodificadores,
+                                             decod, &lote.decodificadas)
+                             : 0;
+        falha_inicio = !n_cod || !n_proc || !n_decod;
+
+        for (int i = 0; i < op->decodificadores; i++)
+            SDL_WaitThread(decod[i], NULL);
+        for (int i = 0; i < op->processadores; i++)
+            SDL_WaitThread(proc[i], NULL);
+        for (int i = 0; i < op->codificadores; i++)
+            SDL_WaitThread(cod[i], NULL);
+    }
+
+    Uint64 ms = SDL_GetTicks() - inicio;
+    int processados = SDL_GetAtomicInt(&lote.processados);
+    int falhas = SDL_GetAtomicInt(&lote.falhas);
+    printf("%d imagens equalizadas, %d falhas, em %.2f s\n", processados, falhas, ms / 1000.0);
+
+    for (int i = 0; i < lote.num_itens; i++)
+    {
+        SDL_free(lote.itens[i].entrada);
+        SDL_free(lote.itens[i].saida);
+    }
+    SDL_free(lote.itens);
+    fila_liberar(&lote.processadas);
+    fila_liberar(&lote.decodificadas);
+    encerrar_pool();
+    SDL_Quit();
+    return (falhas || falha_inicio) ? 1 : 0;
+}
+
+/* --------- mosaicos ----------
+   Equaliza um mosaico guardado como uma grade de arquivos, um por ladrilho, com
+   nomes "<linha>_<coluna>.<ext>" (a partir de 0; zeros à esquerda são aceitos).
+   Um único histograma de 64 bits cobre todos os ladrilhos, então a mesma LUT vale
+   para o mosaico inteiro e não aparecem emendas entre ladrilhos vizinhos. Os
+   ladrilhos ficam na memória como uma ImagemLadrilhada; decodificação e gravação
+   rodam em threads próprias, um ladrilho por vez, e o histograma e a LUT usam o
+   pool dentro de cada ladrilho. */
+typedef struct
+{
+    ImagemLadrilhada *img;
+    int num_ladrilhos;
+    char **entradas; // caminho de cada ladrilho, na ordem da grade; NULL = não encontrado
+    char **saidas;
+    const char *extensao;
+    SDL_AtomicInt proximo;
+    SDL_AtomicInt falhas;
+} Mosaico;
+
+static int SDLCALL mosaico_decodificacao(void *p)
+{
+    Mosaico *m = p;
+    for (int i; (i = SDL_AddAtomicInt(&m->proximo, 1)) < m->num_ladrilhos;)
+    {
+        if (!m->entradas[i])
+            continue;
+        ImagemCinza *cinza = NULL;
+        SDL_Surface *surface = NULL;
+        if (!(eh_pnm(m->entradas[i]) && mapear_pnm(m->entradas[i], &cinza, &surface)))
+            surface = IMG_Load(m->entradas[i]);
+        if (surface)
+            cinza = converte_para_cinza(surface);
+        SDL_DestroySurface(surface);
+        if (!cinza)
+        {
+            fprintf(stderr, "%s: erro ao carregar: %s\n", m->entradas[i], SDL_GetError());
+            SDL_AddAtomicInt(&m->falhas, 1);
+        }
+        m->img->ladrilhos[i] = cinza;
+    }
+    return 0;
+}
+
+static int SDLCALL mosaico_codificacao(void *p)
+{
+    Mosaico *m = p;
+    bool pgm = SDL_strcmp(m->extensao, "pgm") == 0;
+    for (int i; (i = SDL_AddAtomicInt(&m->proximo, 1)) < m->num_ladrilhos;)
+    {
+        const ImagemCinza *t = m->img->ladrilhos[i];
+        if (!(pgm ? salvar_pgm_mapeado(t, m->saidas[i]) : salvar_imagem_cinza(t, m->saidas[i])))
+        {
+            fprintf(stderr, "%s: erro ao salvar: %s\n", m->saidas[i], SDL_GetError());
+            SDL_AddAtomicInt(&m->falhas, 1);
+        }
+    }
+    return 0;
+}
+
+// Roda fn em n threads, contando a atual, e espera todas; se alguma não sobe, as outras fazem a parte dela
+static void mosaico_em_threads(SDL_ThreadFunction fn, const char *nome, Mosaico *m, int n)
+{
+    SDL_Thread *threads[MAX_TRABALHADORES] = {0};
+    SDL_SetAtomicInt(&m->proximo, 0);
+    for (int i = 1; i < n; i++)
+        threads[i] = SDL_CreateThread(fn, nome, m);
+    fn(m);
+    for (int i = 1; i < n; i++)
+        SDL_WaitThread(threads[i], NULL);
+}
+
+// Acha a grade pelos nomes de dir_entrada e monta os caminhos de entrada e saída
+/* Lê "<linha>_<coluna>.<ext>". Nomes com algo entre a coluna e o ponto (0_1_velho.png,
+   0_1-copia.png) não são ladrilhos; índices enormes são recusados antes de virar l + 1. */
+static bool nome_de_ladrilho(const char *nome, int *l, int *c)
+{
+    int fim = 0;
+    return nome[0] >= '0' && nome[0] <= '9' && SDL_sscanf(nome, "%d_%d%n", l, c, &fim) == 2 && fim > 0 &&
+           nome[fim] == '.' && *l >= 0 && *c >= 0 && *l < SDL_MAX_SINT32 / 2 && *c < SDL_MAX_SINT32 / 2;
+}
+
+static bool listar_ladrilhos(const char *dir_entrada, const char *dir_saida, Mosaico *m)
+{
+    int n = 0;
+    char **nomes = SDL_GlobDirectory(dir_entrada, NULL, 0, &n);
+    if (!nomes)
+        return false;
+
+    int colunas = 0, linhas = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int l, c;
+        if (nome_de_ladrilho(nomes[i], &l, &c))
+        {
+            linhas = SDL_max(linhas, l + 1);
+            colunas = SDL_max(colunas, c + 1);
+        }
+    }
+    bool ok = colunas > 0 || SDL_SetError("Nenhum ladrilho <linha>_<coluna>.<ext> em '%s'", dir_entrada);
+    if (ok && (Sint64)colunas * linhas > SDL_MAX_SINT32 / 2)
+        ok = SDL_SetError("Grade de %dx%d ladrilhos grande demais", colunas, linhas);
+    if (ok)
+    {
+        m->img = criar_imagem_ladrilhada(colunas, linhas);
+        m->entradas = SDL_calloc(2 * (size_t)colunas * linhas, sizeof(char *));
+        ok = m->img && m->entradas;
+        if (ok)
+        {
+            m->num_ladrilhos = colunas * linhas;
+            m->saidas = m->entradas + m->num_ladrilhos;
+        }
+    }
+
+    for (int i = 0; ok && i < n; i++)
+    {
+        int l, c;
+        if (!nome_de_ladrilho(nomes[i], &l, &c))
+            continue;
+        int k = l * colunas + c;
+        if (m->entradas[k])
+        {
+            ok = SDL_SetError("Dois arquivos para o ladrilho da linha %d, coluna %d", l, c);
+            break;
         }
+        if (SDL_asprintf(&m->entradas[k], "%s/%s", dir_entrada, nomes[i]) < 0 ||
+            !(m->saidas[k] = caminho_saida_lote(dir_saida, nomes[i], m->extensao)))
+            ok = false;
+    }
+    SDL_free(nomes);
+    return ok;
+}
+
+void calcular_histograma_ladrilhada(const ImagemLadrilhada *img, Sint64 hist[NIVEIS])
+{
+    SDL_memset(hist, 0, sizeof(Sint64) * NIVEIS);
+    for (size_t i = 0; i < (size_t)img->colunas * img->linhas; i++)
+    {
+        Sint64 h[NIVEIS];
+        calcular_histograma(img->ladrilhos[i], h);
+        for (int v = 0; v < NIVEIS; v++)
+            hist[v] += h[v];
+    }
+}
+
+// Aplica a LUT no lugar, ladrilho por ladrilho
+void aplicar_lut_ladrilhada(ImagemLadrilhada *img, const Uint8 lut[NIVEIS])
+{
+    for (size_t i = 0; i < (size_t)img->colunas * img->linhas; i++)
+    {
+        ImagemCinza *t = img->ladrilhos[i];
+        ContextoLut ctx = {t, t, lut};
+        executar_em_faixas(t->altura, grao_para_largura(t->largura), lut_faixa, &ctx);
+    }
+}
+
+int executar_mosaico(const char *dir_entrada, const char *dir_saida, const OpcoesLote *op)
+{
+    if (!SDL_Init(0))
+    {
+        fprintf(stderr, "Erro ao inicializar o SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    Mosaico m;
+    SDL_zero(m);
+    m.extensao = op->extensao;
+    bool ok = SDL_CreateDirectory(dir_saida) && listar_ladrilhos(dir_entrada, dir_saida, &m);
+    if (!ok)
+        fprintf(stderr, "Erro ao preparar o mosaico: %s\n", SDL_GetError());
+
+    iniciar_pool(threads_configuradas);
+    Uint64 inicio = SDL_GetTicks();
+    if (ok)
+    {
+        printf("Mosaico: grade de %dx%d ladrilhos\n", m.img->colunas, m.img->linhas);
+        mosaico_em_threads(mosaico_decodificacao, "decodificacao", &m, op->decodificadores);
+        ok = !SDL_GetAtomicInt(&m.falhas);
+        if (ok && !(ok = validar_imagem_ladrilhada(m.img)))
+            fprintf(stderr, "Mosaico inválido: %s\n", SDL_GetError());
+    }
+    if (ok)
+    {
+        Sint64 pixels = (Sint64)m.img->largura * m.img->altura;
+        printf("%dx%d pixels (%.2f gigapixels), ladrilhos de %dx%d\n", m.img->largura, m.img->altura,
+               pixels / 1e9, m.img->largura_ladrilho, m.img->altura_ladrilho);
+
+        Sint64 hist[NIVEIS];
+        Uint8 lut[NIVEIS];
+        calcular_histograma_ladrilhada(m.img, hist);
+        gerar_lut_equalizacao(hist, pixels, lut);
+        aplicar_lut_ladrilhada(m.img, lut);
+        mosaico_em_threads(mosaico_codificacao, "codificacao", &m, op->codificadores);
+        ok = !SDL_GetAtomicInt(&m.falhas);
     }
-    if (SDL_MUSTLOCK(cinza))
+    if (ok)
+        printf("Mosaico equalizado em %.2f s\n", (SDL_GetTicks() - inicio) / 1000.0);
+
+    for (int i = 0; i < 2 * m.num_ladrilhos; i++)
+        SDL_free(m.entradas[i]);
+    SDL_free(m.entradas);
+    destruir_imagem_ladrilhada(m.img);
+    encerrar_pool();
+    SDL_Quit();
+    return ok ? 0 : 1;
+}
+
+/* --------- benchmark ----------
+   Mede cada etapa do processamento em imagens sintéticas de vários tamanhos e
+   formatos de pixel (e, opcionalmente, nas imagens de um diretório). Cada etapa
+   roda `aquecimento` vezes sem medir e depois `repeticoes` vezes; o resumo vai
+   para a saída padrão e os números completos para um JSON. Não abre janelas. */
+typedef struct
+{
+    const char *nome;
+    int largura;
+    int altura;
+} TamanhoBench;
+
+static const TamanhoBench tamanhos_bench[] = {
+    {"vga", 640, 480},       {"hd", 1280, 720},        {"fullhd", 1920, 1080},
+    {"4k", 3840, 2160},      {"24mp", 6000, 4000},     {"100mp", 12240, 8160},
+};
+
+static const SDL_PixelFormat formatos_bench[] = {
+    SDL_PIXELFORMAT_RGBA32, SDL_PIXELFORMAT_XRGB8888, SDL_PIXELFORMAT_RGB24, SDL_PIXELFORMAT_INDEX8};
+
+typedef struct
+{
+    int repeticoes;
+    int aquecimento;
+    const char *tamanhos; // lista separada por vírgulas; NULL = todos
+    const char *dir_imagens;
+    const char *json;
+} OpcoesBench;
+
+typedef struct
+{
+    SDL_Surface *surface;
+    ImagemCinza *cinza;
+    ImagemCinza16 *cinza16;
+    Sint64 hist[NIVEIS];
+    Uint8 lut[NIVEIS];
+    Sint64 *hist16;
+    Uint16 *lut16;
+    const char *arquivo_png;
+    bool ok;
+} ContextoBench;
+
+typedef enum
+{
+    ENTRADA_SURFACE, // roda sobre a surface de cada formato
+    ENTRADA_CINZA,
+    ENTRADA_CINZA16
+} EntradaBench;
+
+typedef struct
+{
+    const char *etapa;
+    EntradaBench entrada;
+    double bytes_pixel; // lidos + escritos por pixel; 0 = não faz sentido (geração da LUT)
+    void (*fn)(ContextoBench *c);
+} EtapaBench;
+
+static void bench_conversao(ContextoBench *c)
+{
+    bool cinza;
+    Sint64 hist[NIVEIS];
+    ImagemCinza *img = converte_para_cinza_com_histograma(c->surface, hist, &cinza);
+    c->ok = img != NULL;
+    destruir_imagem_cinza(img);
+}
+
+static void bench_cor(ContextoBench *c)
+{
+    bool transparente;
+    SDL_Surface *cor = equalizar_cor(c->surface, &transparente);
+    c->ok = cor != NULL;
+    SDL_DestroySurface(cor);
+}
+
+static void bench_histograma(ContextoBench *c)
+{
+    calcular_histograma(c->cinza, c->hist);
+}
+
+static void bench_gerar_lut(ContextoBench *c)
+{
+    gerar_lut_equalizacao(c->hist, (Sint64)c->cinza->largura * c->cinza->altura, c->lut);
+}
+
+static void bench_aplicar_lut(ContextoBench *c)
+{
+    ImagemCinza *img = aplicar_lut(c->cinza, c->lut);
+    c->ok = img != NULL;
+    destruir_imagem_cinza(img);
+}
+
+static void bench_clahe(ContextoBench *c)
+{
+    ParametrosClahe p = {8, 8, 2.0};
+    ImagemCinza *img = equalizar_clahe(c->cinza, &p);
+    c->ok = img != NULL;
+    destruir_imagem_cinza(img);
+}
+
+static void bench_local(ContextoBench *c)
+{
+    ImagemCinza *img = equalizar_local(c->cinza, 50);
+    c->ok = img != NULL;
+    destruir_imagem_cinza(img);
+}
+
+static void bench_piramide(ContextoBench *c)
+{
+    PiramideMip p;
+    c->ok = construir_piramide(&p, c->cinza);
+    if (c->ok)
+        destruir_piramide(&p);
+}
+
+static void bench_png(ContextoBench *c)
+{
+    c->ok = salvar_png_cinza(c->cinza, c->arquivo_png, &opcoes_png, NULL);
+}
+
+static void bench_histograma16(ContextoBench *c)
+{
+    c->ok = calcular_histograma16(c->cinza16, c->hist16);
+}
+
+static void bench_gerar_lut16(ContextoBench *c)
+{
+    gerar_lut_equalizacao16(c->hist16, (Sint64)c->cinza16->largura * c->cinza16->altura, c->cinza16->maximo,
+                            c->lut16);
+}
+
+static void bench_aplicar_lut16(ContextoBench *c)
+{
+    ImagemCinza16 *img = aplicar_lut16(c->cinza16, c->lut16);
+    c->ok = img != NULL;
+    destruir_imagem_cinza16(img);
+}
+
+static void bench_png16(ContextoBench *c)
+{
+    c->ok = salvar_png_cinza16(c->cinza16, c->arquivo_png, &opcoes_png, NULL);
+}
+
+static const EtapaBench etapas_bench[] = {
+    {"conversao", ENTRADA_SURFACE, 0, bench_conversao}, // bytes dependem do formato
+    {"cor", ENTRADA_SURFACE, 0, bench_cor},             // idem, mais luma, LUT e volta para RGBA
+    {"histograma", ENTRADA_CINZA, 1, bench_histograma},
+    {"gerar_lut", ENTRADA_CINZA, 0, bench_gerar_lut},
+    {"aplicar_lut", ENTRADA_CINZA, 2, bench_aplicar_lut},
+    {"clahe", ENTRADA_CINZA, 2, bench_clahe},
+    {"local", ENTRADA_CINZA, 2, bench_local},
+    {"piramide", ENTRADA_CINZA, 5.0 / 3, bench_piramide}, // cada nível é lido uma vez: 4/3 lidos, 1/3 escritos
+    {"png", ENTRADA_CINZA, 1, bench_png},
+    {"histograma", ENTRADA_CINZA16, 2, bench_histograma16},
+    {"gerar_lut", ENTRADA_CINZA16, 0, bench_gerar_lut16},
+    {"aplicar_lut", ENTRADA_CINZA16, 4, bench_aplicar_lut16},
+    {"png", ENTRADA_CINZA16, 2, bench_png16},
+};
+
+// Pseudo-aleatório reprodutível, para que toda execução meça a mesma imagem
+static Uint32 xorshift32(Uint32 *estado)
+{
+    Uint32 x = *estado;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *estado = x;
+}
+
+// Gradientes com ruído: histograma espalhado e linhas que não se repetem
+static SDL_Surface *surface_sintetica(int largura, int altura, SDL_PixelFormat formato)
+{
+    SDL_Surface *s = SDL_CreateSurface(largura, altura, formato);
+    if (!s)
+        return NULL;
+    Uint32 semente = 0x9E3779B9u;
+    if (formato == SDL_PIXELFORMAT_INDEX8)
     {
-        if (!SDL_LockSurface(cinza))
+        SDL_Palette *pal = SDL_CreateSurfacePalette(s);
+        if (!pal)
         {
-            fprintf(stderr, "Erro ao realizar lock na surface cinza: %s\n", SDL_GetError());
-            if (SDL_MUSTLOCK(orig))
-                SDL_UnlockSurface(orig);
-            SDL_DestroySurface(cinza);
+            SDL_DestroySurface(s);
             return NULL;
         }
+        SDL_Color cores[256];
+        for (int i = 0; i < 256; i++)
+        {
+            Uint32 r = xorshift32(&semente);
+            cores[i] = (SDL_Color){(Uint8)r, (Uint8)(r >> 8), (Uint8)(r >> 16), 255};
+        }
+        SDL_SetPaletteColors(pal, cores, 0, 256);
+    }
+    const SDL_PixelFormatDetails *det = SDL_GetPixelFormatDetails(formato);
+    int bpp = det->bytes_per_pixel;
+    for (int y = 0; y < altura; y++)
+    {
+        Uint8 *linha = (Uint8 *)s->pixels + (size_t)y * s->pitch;
+        for (int x = 0; x < largura; x++)
+        {
+            Uint32 ruido = xorshift32(&semente) & 0x0F0F0F;
+            Uint32 base = (Uint32)(x * 255 / largura) | (Uint32)(y * 255 / altura) << 8 |
+                          (Uint32)((x + y) * 255 / (largura + altura)) << 16;
+            Uint32 v = base ^ ruido;
+            Uint8 *p = linha + (size_t)x * bpp;
+            if (bpp == 1)
+                *p = (Uint8)(v ^ (v >> 8) ^ (v >> 16));
+            else if (bpp == 3)
+            {
+                p[0] = (Uint8)v;
+                p[1] = (Uint8)(v >> 8);
+                p[2] = (Uint8)(v >> 16);
+            }
+            else
+            {
+                Uint32 pixel = SDL_MapRGBA(det, NULL, (Uint8)v, (Uint8)(v >> 8), (Uint8)(v >> 16), 255);
+                SDL_memcpy(p, &pixel, 4);
+            }
+        }
     }
+    return s;
+}
 
-    for (int y = 0; y < orig->h; y++)
+// "SDL_PIXELFORMAT_RGB24" -> "RGB24"
+static const char *nome_formato_curto(SDL_PixelFormat formato)
+{
+    const char *nome = SDL_GetPixelFormatName(formato);
+    const char *prefixo = "SDL_PIXELFORMAT_";
+    return SDL_strncmp(nome, prefixo, SDL_strlen(prefixo)) == 0 ? nome + SDL_strlen(prefixo) : nome;
+}
+
+static int comparar_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Escreve s entre aspas, escapando aspas, barras invertidas e caracteres de controle
+static void escrever_string_json(SDL_IOStream *json, const char *s)
+{
+    SDL_WriteU8(json, '"');
+    for (; *s; s++)
+    {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\')
+            SDL_IOprintf(json, "\\%c", ch);
+        else if (ch < 0x20)
+            SDL_IOprintf(json, "\\u%04x", ch);
+        else
+            SDL_WriteU8(json, ch);
+    }
+    SDL_WriteU8(json, '"');
+}
+
+/* Mede uma etapa e acrescenta uma entrada ao JSON. bytes_pixel = 0 só mostra o tempo.
+   Devolve false se a etapa falhou. */
+static bool medir_etapa(const EtapaBench *e, ContextoBench *c, const char *imagem, const char *formato,
+                        int largura, int altura, double bytes_pixel, const OpcoesBench *op, SDL_IOStream *json,
+                        bool *primeiro)
+{
+    double *tempos = SDL_malloc(sizeof(double) * op->repeticoes);
+    if (!tempos)
+        return false;
+    c->ok = true;
+    for (int i = 0; i < op->aquecimento && c->ok; i++)
+        e->fn(c);
+    const double freq = (double)SDL_GetPerformanceFrequency();
+    for (int i = 0; i < op->repeticoes && c->ok; i++)
+    {
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        e->fn(c);
+        tempos[i] = (double)(SDL_GetPerformanceCounter() - t0) * 1000.0 / freq;
+    }
+    if (!c->ok)
+    {
+        fprintf(stderr, "%s/%s/%s: %s\n", e->etapa, imagem, formato, SDL_GetError());
+        SDL_free(tempos);
+        return false;
+    }
+
+    SDL_qsort(tempos, op->repeticoes, sizeof(double), comparar_double);
+    double soma = 0;
+    for (int i = 0; i < op->repeticoes; i++)
+        soma += tempos[i];
+    double mediana = op->repeticoes % 2 ? tempos[op->repeticoes / 2]
+                                        : (tempos[op->repeticoes / 2 - 1] + tempos[op->repeticoes / 2]) / 2;
+    double media = soma / op->repeticoes;
+    double megapixels = (double)largura * altura / 1e6;
+    double mp_s = mediana > 0 ? megapixels / (mediana / 1000.0) : 0;
+    double gb_s = mp_s * bytes_pixel / 1000.0;
+
+    printf("%-12s %-10s %-10s %6dx%-6d %10.3f ms", e->etapa, imagem, formato, largura, altura, mediana);
+    if (bytes_pixel > 0)
+        printf(" %9.1f MP/s %7.2f GB/s", mp_s, gb_s);
+    printf("\n");
+
+    // O nome da imagem vem do diretório e pode ter aspas ou barras
+    SDL_IOprintf(json, "%s\n    {\"etapa\": \"%s\", \"imagem\": ", *primeiro ? "" : ",", e->etapa);
+    escrever_string_json(json, imagem);
+    SDL_IOprintf(json,
+                 ", \"formato\": \"%s\", \"largura\": %d, \"altura\": %d, \"min_ms\": %.4f, \"mediana_ms\": %.4f, "
+                 "\"media_ms\": %.4f, \"max_ms\": %.4f",
+                 formato, largura, altura, tempos[0], mediana, media, tempos[op->repeticoes - 1]);
+    if (bytes_pixel > 0)
+        SDL_IOprintf(json, ", \"mp_s\": %.2f, \"gb_s\": %.3f", mp_s, gb_s);
+    SDL_IOprintf(json, "}");
+    *primeiro = false;
+    SDL_free(tempos);
+    return true;
+}
+
+// Roda as etapas de uma entrada sobre c->cinza ou c->cinza16 (já preenchida)
+static bool medir_etapas_cinza(ContextoBench *c, EntradaBench entrada, const char *imagem, const char *formato,
+                               const OpcoesBench *op, SDL_IOStream *json, bool *primeiro)
+{
+    int largura = entrada == ENTRADA_CINZA16 ? c->cinza16->largura : c->cinza->largura;
+    int altura = entrada == ENTRADA_CINZA16 ? c->cinza16->altura : c->cinza->altura;
+    bool ok = true;
+    for (int e = 0; e < (int)SDL_arraysize(etapas_bench); e++)
+        if (etapas_bench[e].entrada == entrada)
+            ok &= medir_etapa(&etapas_bench[e], c, imagem, formato, largura, altura, etapas_bench[e].bytes_pixel, op,
+                              json, primeiro);
+    return ok;
+}
+
+// Mesmos gradientes com ruído, em 0..maximo
+static ImagemCinza16 *imagem16_sintetica(int largura, int altura, int maximo)
+{
+    ImagemCinza16 *img = criar_imagem_cinza16(largura, altura, maximo);
+    if (!img)
+        return NULL;
+    Uint32 semente = 0x9E3779B9u;
+    for (int y = 0; y < altura; y++)
+    {
+        Uint16 *linha = linha_cinza16(img, y);
+        for (int x = 0; x < largura; x++)
+        {
+            Uint32 base = (Uint32)(((Sint64)x * 3 + y) * maximo / ((Sint64)largura * 3 + altura));
+            linha[x] = (Uint16)SDL_min(base + (xorshift32(&semente) & 63), (Uint32)maximo);
+        }
+    }
+    return img;
+}
+
+// Tamanho pedido em op->tamanhos (ou todos, sem a opção)
+static bool tamanho_escolhido(const OpcoesBench *op, const char *nome)
+{
+    if (!op->tamanhos)
+        return true;
+    size_t n = SDL_strlen(nome);
+    for (const char *p = op->tamanhos; *p;)
+    {
+        const char *fim = SDL_strchr(p, ',');
+        size_t len = fim ? (size_t)(fim - p) : SDL_strlen(p);
+        if (len == n && SDL_strncmp(p, nome, n) == 0)
+            return true;
+        p += len + (fim ? 1 : 0);
+    }
+    return false;
+}
+
+static bool bench_sinteticas(const OpcoesBench *op, ContextoBench *c, SDL_IOStream *json, bool *primeiro)
+{
+    bool ok = true;
+    for (int t = 0; t < (int)SDL_arraysize(tamanhos_bench); t++)
     {
-        for (int x = 0; x < orig->w; x++)
+        const TamanhoBench *tam = &tamanhos_bench[t];
+        if (!tamanho_escolhido(op, tam->nome))
+            continue;
+        for (int f = 0; f < (int)SDL_arraysize(formatos_bench); f++)
         {
-            Uint8 r, g, b, a;
-            if (!SDL_ReadSurfacePixel(orig, x, y, &r, &g, &b, &a))
-            {
-                fprintf(stderr, "Erro ao ler pixel (%d,%d): %s\n", x, y, SDL_GetError());
-            }
-
-            Uint8 valor;
-            if (eh_cinza(r, g, b))
+            c->surface = surface_sintetica(tam->largura, tam->altura, formatos_bench[f]);
+            if (!c->surface)
             {
-                valor = r;
+                fprintf(stderr, "Erro ao criar imagem %s: %s\n", tam->nome, SDL_GetError());
+                destruir_imagem_cinza(c->cinza);
+                c->cinza = NULL;
+                return false;
             }
-            else
-            {
-                double y_val = 0.2125 * r + 0.7154 * g + 0.0721 * b;
-                if (y_val < 0)
-                    y_val = 0;
-                if (y_val > 255)
-                    y_val = 255;
-                valor = (Uint8)(y_val + 0.5);
-            }
-
-            const SDL_PixelFormatDetails *fmt = SDL_GetPixelFormatDetails(cinza->format);
-            int bpp = SDL_BYTESPERPIXEL(cinza->format);
-            Uint32 pixel_cinza = SDL_MapRGBA(fmt, NULL, valor, valor, valor, a);
-            Uint8 *p = (Uint8 *)cinza->pixels + y * cinza->pitch + x * bpp;
+            double bytes = SDL_BYTESPERPIXEL(formatos_bench[f]) + 1;
+            ok &= medir_etapa(&etapas_bench[0], c, tam->nome, nome_formato_curto(formatos_bench[f]), tam->largura,
+                              tam->altura, bytes, op, json, primeiro);
+            ok &= medir_etapa(&etapas_bench[1], c, tam->nome, nome_formato_curto(formatos_bench[f]), tam->largura,
+                              tam->altura, bytes + 12, op, json, primeiro);
+            // A imagem em cinza das demais etapas sai da primeira surface
+            if (f == 0)
+                c->cinza = converte_para_cinza(c->surface);
+            SDL_DestroySurface(c->surface);
+            c->surface = NULL;
+        }
+        if (!c->cinza)
+        {
+            fprintf(stderr, "Erro ao converter imagem %s: %s\n", tam->nome, SDL_GetError());
+            return false;
+        }
+        ok &= medir_etapas_cinza(c, ENTRADA_CINZA, tam->nome, "cinza", op, json, primeiro);
+        destruir_imagem_cinza(c->cinza);
+        c->cinza = NULL;
 
-            switch (bpp)
+        // 12 bits (tabela de contagem no L1) e 16 bits cheios
+        static const int maximos[] = {4095, 65535};
+        for (int m = 0; m < (int)SDL_arraysize(maximos); m++)
+        {
+            c->cinza16 = imagem16_sintetica(tam->largura, tam->altura, maximos[m]);
+            if (!c->cinza16)
             {
-            case 1:
-                *p = (Uint8)pixel_cinza;
-                break;
-            case 2:
-                *(Uint16 *)p = (Uint16)pixel_cinza;
-                break;
-            case 3:
-                if (SDL_BYTEORDER == SDL_BIG_ENDIAN)
-                {
-                    p[0] = (pixel_cinza >> 16) & 0xFF;
-                    p[1] = (pixel_cinza >> 8) & 0xFF;
-                    p[2] = pixel_cinza & 0xFF;
-                }
-                else
-                {
-                    p[0] = pixel_cinza & 0xFF;
-                    p[1] = (pixel_cinza >> 8) & 0xFF;
-                    p[2] = (pixel_cinza >> 16) & 0xFF;
-                }
-                break;
-            case 4:
-                *(Uint32 *)p = pixel_cinza;
-                break;
-            default:
-                break;
+                fprintf(stderr, "Erro ao criar imagem %s de 16 bits: %s\n", tam->nome, SDL_GetError());
+                return false;
             }
+            ok &= medir_etapas_cinza(c, ENTRADA_CINZA16, tam->nome, m == 0 ? "cinza12" : "cinza16", op, json,
+                                     primeiro);
+            destruir_imagem_cinza16(c->cinza16);
+            c->cinza16 = NULL;
         }
     }
-
-    if (SDL_MUSTLOCK(cinza))
-        SDL_UnlockSurface(cinza);
-    if (SDL_MUSTLOCK(orig))
-        SDL_UnlockSurface(orig);
-    return cinza;
+    return ok;
 }
 
-void calcular_histograma(SDL_Surface *img, int hist[NIVEIS])
+// Imagens reais: todas as etapas sobre cada arquivo de dir, no formato em que foi carregado
+static bool bench_diretorio(const OpcoesBench *op, ContextoBench *c, SDL_IOStream *json, bool *primeiro)
 {
-    for (int i = 0; i < NIVEIS; i++)
-        hist[i] = 0;
-    for (int y = 0; y < img->h; y++)
+    int n = 0;
+    char **nomes = SDL_GlobDirectory(op->dir_imagens, NULL, 0, &n);
+    if (!nomes)
     {
-        for (int x = 0; x < img->w; x++)
+        fprintf(stderr, "Erro ao listar '%s': %s\n", op->dir_imagens, SDL_GetError());
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < n; i++)
+    {
+        char *caminho = NULL;
+        SDL_PathInfo info;
+        if (SDL_asprintf(&caminho, "%s/%s", op->dir_imagens, nomes[i]) < 0)
+            continue;
+        if (!SDL_GetPathInfo(caminho, &info) || info.type != SDL_PATHTYPE_FILE)
         {
-            Uint8 r, g, b, a;
-            SDL_ReadSurfacePixel(img, x, y, &r, &g, &b, &a);
-            hist[r]++;
+            SDL_free(caminho);
+            continue;
+        }
+        // PGM já é a imagem em cinza; não há conversão a medir
+        if (eh_pnm(caminho) && (c->cinza16 = carregar_pgm16(caminho)))
+        {
+            ok &= medir_etapas_cinza(c, ENTRADA_CINZA16, nomes[i], "cinza16", op, json, primeiro);
+            destruir_imagem_cinza16(c->cinza16);
+            c->cinza16 = NULL;
+            SDL_free(caminho);
+            continue;
+        }
+        if (!(eh_pnm(caminho) && mapear_pnm(caminho, &c->cinza, &c->surface)))
+            c->surface = IMG_Load(caminho);
+        if (!c->surface && !c->cinza)
+        {
+            fprintf(stderr, "%s: erro ao carregar: %s\n", caminho, SDL_GetError());
+            SDL_free(caminho);
+            ok = false;
+            continue;
+        }
+        if (c->surface)
+        {
+            SDL_PixelFormat formato = c->surface->format;
+            ok &= medir_etapa(&etapas_bench[0], c, nomes[i], nome_formato_curto(formato), c->surface->w,
+                              c->surface->h, SDL_BYTESPERPIXEL(formato) + 1, op, json, primeiro);
+            ok &= medir_etapa(&etapas_bench[1], c, nomes[i], nome_formato_curto(formato), c->surface->w,
+                              c->surface->h, SDL_BYTESPERPIXEL(formato) + 13, op, json, primeiro);
+            c->cinza = converte_para_cinza(c->surface);
+            SDL_DestroySurface(c->surface);
+            c->surface = NULL;
         }
+        if (c->cinza)
+            ok &= medir_etapas_cinza(c, ENTRADA_CINZA, nomes[i], "cinza", op, json, primeiro);
+        else
+            ok = false;
+        destruir_imagem_cinza(c->cinza);
+        c->cinza = NULL;
+        SDL_free(caminho);
     }
+    SDL_free(nomes);
+    return ok;
 }
 
-// --------- gera LUT de equalização pela CDF ----------
-void gerar_lut_equalizacao(const int hist[NIVEIS], int total_pixels, int lut[NIVEIS])
+/* Caminho do PNG gravado pela etapa "png": ao lado do JSON, com o número do processo
+   e um contador, para não apagar um arquivo do usuário nem colidir com outro bench */
+static char *png_temporario_bench(const char *json)
 {
-    int cdf[NIVEIS];
-    int soma = 0;
-    for (int i = 0; i < NIVEIS; i++)
+#ifdef _WIN32
+    unsigned long processo = GetCurrentProcessId();
+#else
+    unsigned long processo = (unsigned long)getpid();
+#endif
+    for (int i = 0;; i++)
     {
-        soma += hist[i];
-        cdf[i] = soma;
+        char *caminho = NULL;
+        if (SDL_asprintf(&caminho, "%s.tmp%lu-%d.png", json, processo, i) < 0)
+            return NULL;
+        if (!SDL_GetPathInfo(caminho, NULL))
+            return caminho;
+        SDL_free(caminho);
     }
-    int cdf_min = 0;
-    for (int i = 0; i < NIVEIS; i++)
+}
+
+int executar_bench(const OpcoesBench *op)
+{
+    if (!SDL_Init(0))
     {
-        if (cdf[i] > 0)
-        {
-            cdf_min = cdf[i];
-            break;
-        }
+        fprintf(stderr, "Erro ao inicializar o SDL: %s\n", SDL_GetError());
+        return 1;
     }
-    if (total_pixels <= cdf_min)
+    SDL_IOStream *json = SDL_IOFromFile(op->json, "w");
+    if (!json)
     {
-        for (int i = 0; i < NIVEIS; i++)
-            lut[i] = i;
-        return;
+        fprintf(stderr, "Erro ao criar '%s': %s\n", op->json, SDL_GetError());
+        SDL_Quit();
+        return 1;
     }
-    for (int i = 0; i < NIVEIS; i++)
+    iniciar_pool(threads_configuradas);
+
+    const char *nome_luma = "?", *nome_lut = "?";
+    for (int i = 0; i < NUM_KERNELS_LUMA; i++)
+        if (kernels_luma[i].fn == kernel_luma)
+            nome_luma = kernels_luma[i].nome;
+    for (int i = 0; i < NUM_KERNELS_LUT; i++)
+        if (kernels_lut[i].fn == kernel_lut)
+            nome_lut = kernels_lut[i].nome;
+    SDL_IOprintf(json,
+                 "{\n  \"kernel_luma\": \"%s\",\n  \"kernel_lut\": \"%s\",\n  \"trabalhadores\": %d,\n"
+                 "  \"nucleos\": %d,\n  \"repeticoes\": %d,\n  \"aquecimento\": %d,\n  \"png_nivel\": %d,\n"
+                 "  \"png_filtro\": \"%s\",\n  \"resultados\": [",
+                 nome_luma, nome_lut, num_trabalhadores(), SDL_GetNumLogicalCPUCores(), op->repeticoes,
+                 op->aquecimento, opcoes_png.nivel, nomes_filtro_png[opcoes_png.filtro]);
+
+    ContextoBench c;
+    SDL_zero(c);
+    c.hist16 = SDL_malloc(sizeof(Sint64) * NIVEIS16);
+    c.lut16 = SDL_malloc(sizeof(Uint16) * NIVEIS16);
+    char *arquivo_png = png_temporario_bench(op->json);
+    c.arquivo_png = arquivo_png;
+    if (!c.hist16 || !c.lut16 || !arquivo_png)
     {
-        double v = (double)(cdf[i] - cdf_min) / (double)(total_pixels - cdf_min);
-        if (v < 0.0)
-            v = 0.0;
-        if (v > 1.0)
-            v = 1.0;
-        lut[i] = (int)lrint(v * 255.0);
+        SDL_free(arquivo_png);
+        SDL_free(c.hist16);
+        SDL_free(c.lut16);
+        SDL_CloseIO(json);
+        encerrar_pool();
+        SDL_Quit();
+        return 1;
     }
+    bool primeiro = true;
+    printf("%-12s %-10s %-10s %13s %13s\n", "etapa", "imagem", "formato", "tamanho", "mediana");
+    bool ok = bench_sinteticas(op, &c, json, &primeiro);
+    if (op->dir_imagens)
+        ok &= bench_diretorio(op, &c, json, &primeiro);
+    SDL_RemovePath(arquivo_png);
+    SDL_free(arquivo_png);
+    SDL_free(c.hist16);
+    SDL_free(c.lut16);
+
+    SDL_IOprintf(json, "\n  ]\n}\n");
+    if (!SDL_CloseIO(json))
+        ok = false;
+    printf("Resultados em '%s'\n", op->json);
+    encerrar_pool();
+    SDL_Quit();
+    return ok ? 0 : 1;
 }
 
-// --------- aplica LUT e retorna nova surface ----------
-SDL_Surface *aplicar_lut(SDL_Surface *src, const int lut[NIVEIS])
+// Inteiro decimal em [minimo, maximo]; recusa texto vazio, sobras ("4x") e estouro
+static bool ler_inteiro(const char *texto, int minimo, int maximo, int *valor)
 {
-    if (!src)
-        return NULL;
-    SDL_Surface *dst = SDL_CreateSurface(src->w, src->h, src->format);
-    if (!dst)
-    {
-        fprintf(stderr, "Erro ao criar surface equalizada: %s\n", SDL_GetError());
-        return NULL;
-    }
+    char *fim;
+    Sint64 v = SDL_strtoll(texto, &fim, 10);
+    if (!*texto || *fim || v < minimo || v > maximo)
+        return false;
+    *valor = (int)v;
+    return true;
+}
+
+// Lê "--reps N --aquecimento N --tamanhos a,b --imagens dir --json arquivo" a partir de argv[inicio]
+static bool ler_opcoes_bench(int argc, char *argv[], int inicio, OpcoesBench *op)
+{
+    op->repeticoes = 5;
+    op->aquecimento = 1;
+    op->tamanhos = NULL;
+    op->dir_imagens = NULL;
+    op->json = "bench.json";
 
-    if (SDL_MUSTLOCK(src))
+    for (int i = inicio; i < argc; i += 2)
     {
-        if (!SDL_LockSurface(src))
+        if (i + 1 >= argc)
         {
-            fprintf(stderr, "Erro ao lock na src: %s\n", SDL_GetError());
-            SDL_DestroySurface(dst);
-            return NULL;
+            fprintf(stderr, "Falta o valor de %s\n", argv[i]);
+            return false;
         }
-    }
-    if (SDL_MUSTLOCK(dst))
-    {
-        if (!SDL_LockSurface(dst))
+        if (SDL_strcmp(argv[i], "--tamanhos") == 0)
+            op->tamanhos = argv[i + 1];
+        else if (SDL_strcmp(argv[i], "--imagens") == 0)
+            op->dir_imagens = argv[i + 1];
+        else if (SDL_strcmp(argv[i], "--json") == 0)
+            op->json = argv[i + 1];
+        else if (SDL_strcmp(argv[i], "--reps") == 0 || SDL_strcmp(argv[i], "--aquecimento") == 0)
         {
-            fprintf(stderr, "Erro ao lock na dst: %s\n", SDL_GetError());
-            if (SDL_MUSTLOCK(src))
-                SDL_UnlockSurface(src);
-            SDL_DestroySurface(dst);
-            return NULL;
+            bool reps = argv[i][2] == 'r';
+            if (!ler_inteiro(argv[i + 1], reps ? 1 : 0, 1000, reps ? &op->repeticoes : &op->aquecimento))
+            {
+                fprintf(stderr, "Valor inválido para %s: %s (%d a 1000)\n", argv[i], argv[i + 1], reps ? 1 : 0);
+                return false;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Opção de benchmark inválida: %s\n", argv[i]);
+            return false;
         }
     }
+    return true;
+}
 
-    const SDL_PixelFormatDetails *fmt = SDL_GetPixelFormatDetails(dst->format);
-    int bpp = SDL_BYTESPERPIXEL(dst->format);
+// Lê "--decod N --proc N --cod N --fila N --ext png|pgm --cor" a partir de argv[inicio]
+static bool ler_opcoes_lote(int argc, char *argv[], int inicio, OpcoesLote *op)
+{
+    int nucleos = SDL_GetNumLogicalCPUCores();
+    op->decodificadores = nucleos / 2 > 0 ? nucleos / 2 : 1;
+    op->processadores = 1; // os kernels já usam o pool de threads
+    op->codificadores = nucleos / 2 > 0 ? nucleos / 2 : 1;
+    op->capacidade_fila = 4;
+    op->extensao = "png";
+    op->cor = false;
 
-    for (int y = 0; y < src->h; y++)
+    for (int i = inicio; i < argc; i += 2)
     {
-        for (int x = 0; x < src->w; x++)
+        if (SDL_strcmp(argv[i], "--cor") == 0)
         {
-            Uint8 r, g, b, a;
-            SDL_ReadSurfacePixel(src, x, y, &r, &g, &b, &a);
-            Uint8 val = (Uint8)lut[r];
-
-            Uint32 pixel_eq = SDL_MapRGBA(fmt, NULL, val, val, val, a);
-            Uint8 *p = (Uint8 *)dst->pixels + y * dst->pitch + x * bpp;
-
-            switch (bpp)
+            op->cor = true;
+            i--; // sem valor
+            continue;
+        }
+        if (SDL_strcmp(argv[i], "--ext") == 0 && i + 1 < argc)
+        {
+            if (SDL_strcmp(argv[i + 1], "png") != 0 && SDL_strcmp(argv[i + 1], "pgm") != 0)
             {
-            case 1:
-                *p = (Uint8)pixel_eq;
-                break;
-            case 2:
-                *(Uint16 *)p = (Uint16)pixel_eq;
-                break;
-            case 3:
-                if (SDL_BYTEORDER == SDL_BIG_ENDIAN)
-                {
-                    p[0] = (pixel_eq >> 16) & 0xFF;
-                    p[1] = (pixel_eq >> 8) & 0xFF;
-                    p[2] = pixel_eq & 0xFF;
-                }
-                else
-                {
-                    p[0] = pixel_eq & 0xFF;
-                    p[1] = (pixel_eq >> 8) & 0xFF;
-                    p[2] = (pixel_eq >> 16) & 0xFF;
-                }
-                break;
-            case 4:
-                *(Uint32 *)p = pixel_eq;
-                break;
-            default:
-                break;
+                fprintf(stderr, "Formato de saída inválido: %s (png ou pgm)\n", argv[i + 1]);
+                return false;
             }
+            op->extensao = argv[i + 1];
+            continue;
+        }
+        int *campo = NULL, maximo = MAX_TRABALHADORES;
+        if (SDL_strcmp(argv[i], "--decod") == 0)
+            campo = &op->decodificadores;
+        else if (SDL_strcmp(argv[i], "--proc") == 0)
+            campo = &op->processadores;
+        else if (SDL_strcmp(argv[i], "--cod") == 0)
+            campo = &op->codificadores;
+        else if (SDL_strcmp(argv[i], "--fila") == 0)
+            campo = &op->capacidade_fila, maximo = MAX_FILA_LOTE;
+        if (!campo || i + 1 >= argc)
+        {
+            fprintf(stderr, "Opção de lote inválida: %s\n", argv[i]);
+            return false;
+        }
+        if (!ler_inteiro(argv[i + 1], 1, maximo, campo))
+        {
+            fprintf(stderr, "Valor inválido para %s: %s (1 a %d)\n", argv[i], argv[i + 1], maximo);
+            return false;
         }
     }
-
-    if (SDL_MUSTLOCK(dst))
-        SDL_UnlockSurface(dst);
-    if (SDL_MUSTLOCK(src))
-        SDL_UnlockSurface(src);
-    return dst;
+    if (op->cor && SDL_strcmp(op->extensao, "png") != 0)
+    {
+        fprintf(stderr, "--cor só grava PNG\n");
+        return false;
+    }
+    return true;
 }
 
-/* ----------- Histograma desenhado dentro de uma área dedicada ----------- */
-void render_histograma(SDL_Renderer *renderer, int *hist, int max_contagem, SDL_FRect area)
+// Índice de nome em nomes_filtro_png, ou -1
+static int filtro_png_por_nome(const char *nome)
 {
-    const int margem_x = 10;
-    const int margem_y = 10;
-
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    SDL_RenderFillRect(renderer, &area);
-
-    float iw = area.w - 2 * margem_x;
-    float ih = area.h - 2 * margem_y;
-    if (iw <= 0 || ih <= 0 || max_contagem <= 0)
-        return;
-
-    int largura_barras = (int)floor(iw / NIVEIS);
-    if (largura_barras < 1)
-        largura_barras = 1;
-
-    SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255);
-    SDL_FRect inner = {area.x + margem_x, area.y + margem_y, iw, ih};
-    SDL_RenderRect(renderer, &inner);
-
-    SDL_SetRenderDrawColor(renderer, 100, 100, 255, 255);
-    for (int i = 0; i < NIVEIS; i++)
-    {
-        float proporcao = (float)hist[i] / (float)max_contagem;
-        int altura_barra = (int)(ih * proporcao);
-        float bx = inner.x + (float)i * largura_barras;
-        float bw = (float)largura_barras;
-
-        if (bx + bw > inner.x + inner.w)
-            bw = (inner.x + inner.w) - bx;
-        if (bw <= 0)
-            break;
-
-        SDL_FRect barra = {
-            bx,
-            inner.y + inner.h - altura_barra,
-            bw,
-            (float)altura_barra};
-        SDL_RenderFillRect(renderer, &barra);
-    }
+    for (int i = 0; i < (int)SDL_arraysize(nomes_filtro_png); i++)
+        if (SDL_strcmp(nome, nomes_filtro_png[i]) == 0)
+            return i;
+    return -1;
 }
 
-void render_texto(SDL_Renderer *renderer, const char *texto, float x, float y, TTF_Font *fonte, SDL_Color cor)
+/* Tira de argv, em qualquer posição, as opções que valem para todos os modos
+   ("--threads N", "--grao N", "--png-nivel N", "--png-filtro nome") e devolve o
+   novo argc; -1 indica valor inválido */
+static int ler_opcoes_globais(int argc, char *argv[])
 {
-    SDL_Surface *surfText = TTF_RenderText_Blended(fonte, texto, 0, cor);
-    if (surfText)
-    {
-        SDL_Texture *texText = SDL_CreateTextureFromSurface(renderer, surfText);
-        SDL_FRect dst = {x, y, (float)surfText->w, (float)surfText->h};
-        SDL_RenderTexture(renderer, texText, NULL, &dst);
-        SDL_DestroyTexture(texText);
-        SDL_DestroySurface(surfText);
-    }
-    else
+    int n = 1;
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "Erro ao criar a superfície de texto: %s\n", SDL_GetError());
+        int *campo = NULL, minimo = 1, maximo = MAX_TRABALHADORES;
+        bool filtro = SDL_strcmp(argv[i], "--png-filtro") == 0;
+        if (SDL_strcmp(argv[i], "--threads") == 0)
+            campo = &threads_configuradas;
+        else if (SDL_strcmp(argv[i], "--grao") == 0)
+            campo = &grao_configurado, maximo = SDL_MAX_SINT32;
+        else if (SDL_strcmp(argv[i], "--png-nivel") == 0)
+            campo = &opcoes_png.nivel, minimo = 0, maximo = 9;
+        if (!campo && !filtro)
+        {
+            argv[n++] = argv[i];
+            continue;
+        }
+        bool valido = i + 1 < argc;
+        if (valido && filtro)
+        {
+            int f = filtro_png_por_nome(argv[i + 1]);
+            valido = f >= 0;
+            if (valido)
+                opcoes_png.filtro = (FiltroPng)f;
+        }
+        else if (valido)
+            valido = ler_inteiro(argv[i + 1], minimo, maximo, campo);
+        if (!valido)
+        {
+            fprintf(stderr, "Valor inválido para %s\n", argv[i]);
+            return -1;
+        }
+        i++;
     }
+    argv[n] = NULL;
+    return n;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    OpcoesLote op_lote;
+    OpcoesBench op_bench;
+    int linhas_faixa = 0; // --faixa; 0 = ~64 MiB de arquivo por faixa
+    argc = ler_opcoes_globais(argc, argv);
+    if (argc < 0)
+        return 1;
+    bool modo_bench = argc >= 2 && SDL_strcmp(argv[1], "--bench") == 0;
+    bool modo_lote = argc >= 4 && (SDL_strcmp(argv[1], "--batch") == 0 || SDL_strcmp(argv[1], "--mosaico") == 0);
+    bool modo_stream = (argc == 4 || (argc == 6 && SDL_strcmp(argv[4], "--faixa") == 0)) &&
+                       SDL_strcmp(argv[1], "--stream") == 0;
+    if ((argc != 2 && !modo_lote && !modo_stream && !modo_bench) ||
+        (modo_lote && !ler_opcoes_lote(argc, argv, 4, &op_lote)) ||
+        (modo_bench && !ler_opcoes_bench(argc, argv, 2, &op_bench)) ||
+        (modo_stream && argc == 6 && !ler_inteiro(argv[5], 1, SDL_MAX_SINT32, &linhas_faixa)))
     {
         fprintf(stderr, "Uso: %s caminho_da_imagem.ext\n", argv[0]);
+        fprintf(stderr, "     %s --batch dir_entrada dir_saida [--decod N] [--proc N] [--cod N] [--fila N] [--ext png|pgm] [--cor]\n", argv[0]);
+        fprintf(stderr, "     %s --mosaico dir_ladrilhos dir_saida [--decod N] [--cod N] [--ext png|pgm]\n", argv[0]);
+        fprintf(stderr, "     %s --stream entrada.(pgm|ppm|bmp) saida.pgm [--faixa linhas]\n", argv[0]);
+        fprintf(stderr, "     %s --bench [--tamanhos vga,hd,fullhd,4k,24mp,100mp] [--reps N] [--aquecimento N]\n", argv[0]);
+        fprintf(stderr, "            [--imagens dir] [--json arquivo]\n");
+        fprintf(stderr, "     %s --verificar-kernels\n", argv[0]);
+        fprintf(stderr, "Opções válidas em qualquer modo: [--threads N] [--grao linhas]\n");
+        fprintf(stderr, "     [--png-nivel 0-9] [--png-filtro nenhum|sub|cima|media|paeth|adaptativo]\n");
         return 1;
     }
 
+    iniciar_kernels();
+    if (modo_lote && SDL_strcmp(argv[1], "--mosaico") == 0)
+    {
+        if (op_lote.cor)
+        {
+            fprintf(stderr, "--cor não vale para mosaicos\n");
+            return 1;
+        }
+        return executar_mosaico(argv[2], argv[3], &op_lote);
+    }
+    if (modo_lote)
+        return executar_lote(argv[2], argv[3], &op_lote);
+    if (modo_bench)
+        return executar_bench(&op_bench);
+    if (modo_stream)
+        return executar_stream(argv[2], argv[3], linhas_faixa);
+    if (SDL_strcmp(argv[1], "--verificar-kernels") == 0)
+    {
+        // Com o pool ativo a equalização local também é verificada dividida entre threads
+        iniciar_pool(threads_configuradas);
+        bool ok = verificar_kernels();
+        encerrar_pool();
+        return ok ? 0 : 1;
+    }
+
     if (!SDL_Init(SDL_INIT_VIDEO))
     {
         fprintf(stderr, "Erro ao inicializar o SDL: %s\n", SDL_GetError());
@@ -349,50 +6187,70 @@ int main(int argc, char *argv[])
         SDL_Quit();
         return 1;
     }
+    iniciar_pool(threads_configuradas);
 
-    SDL_Surface *imagem = IMG_Load(argv[1]);
-    if (!imagem)
+    /* PGM/PPM binários são mapeados direto do arquivo; o resto passa pelo SDL_image.
+       Um PGM de 16 bits é equalizado em 16 bits e só a exibição usa img_cinza. */
+    ImagemCinza16 *img16 = eh_pnm(argv[1]) ? carregar_pgm16(argv[1]) : NULL;
+    ImagemCinza *img_cinza = NULL;
+    SDL_Surface *imagem = NULL;
+    if (img16)
+        img_cinza = reduzir_para_8bits(img16);
+    else if (!(eh_pnm(argv[1]) && mapear_pnm(argv[1], &img_cinza, &imagem)))
+        imagem = IMG_Load(argv[1]);
+    if (!imagem && !img_cinza)
     {
         printf("Erro ao carregar a imagem: %s\n", SDL_GetError());
+        destruir_imagem_cinza16(img16);
+        encerrar_pool();
         TTF_Quit();
         SDL_Quit();
         return 1;
     }
 
     printf("Imagem carregada com sucesso!\n");
-    printf("Dimensões: %dx%d pixels, Formato de pixel: %s\n", imagem->w, imagem->h, SDL_GetPixelFormatName(imagem->format));
-
-    // Verifica se a imagem já é cinza
-    int todos_cinza = 1;
-    for (int y = 0; y < imagem->h && todos_cinza; y++)
+    Sint64 hist_orig[NIVEIS];
+    bool todos_cinza = false;
+    if (img_cinza)
     {
-        for (int x = 0; x < imagem->w; x++)
-        {
-            Uint8 r, g, b, a;
-            SDL_ReadSurfacePixel(imagem, x, y, &r, &g, &b, &a);
-            if (!eh_cinza(r, g, b))
-            {
-                todos_cinza = 0;
-                break;
-            }
-        }
+        if (img16)
+            printf("Dimensões: %dx%d pixels, PGM de 16 bits (maxval %d)\n", img16->largura, img16->altura, img16->maximo);
+        else
+            printf("Dimensões: %dx%d pixels, PGM mapeado\n", img_cinza->largura, img_cinza->altura);
+        calcular_histograma(img_cinza, hist_orig);
+        todos_cinza = true;
     }
+    else
+    {
+        printf("Dimensões: %dx%d pixels, Formato de pixel: %s\n", imagem->w, imagem->h, SDL_GetPixelFormatName(imagem->format));
 
-    SDL_Surface *img_cinza = todos_cinza ? SDL_DuplicateSurface(imagem) : converte_para_cinza(imagem);
+        // Detecção de cinza, conversão e histograma saem da mesma passada
+        img_cinza = converte_para_cinza_com_histograma(imagem, hist_orig, &todos_cinza);
+        SDL_DestroySurface(imagem);
+    }
     if (!img_cinza)
     {
         fprintf(stderr, "Falha ao obter imagem em cinza.\n");
-        SDL_DestroySurface(imagem);
+        encerrar_pool();
         TTF_Quit();
         SDL_Quit();
         return 1;
     }
+    if (todos_cinza)
+        printf("A imagem já está em escala de cinza.\n");
 
     /* --------------------- Janela principal -------------------- */
-    int larguraP = img_cinza->w;
-    int alturaP = img_cinza->h;
+    // Do tamanho da imagem, mas sem passar da área útil da tela; o resto é zoom e arraste
+    int larguraP = img_cinza->largura;
+    int alturaP = img_cinza->altura;
+    SDL_Rect area_tela;
+    if (SDL_GetDisplayUsableBounds(SDL_GetPrimaryDisplay(), &area_tela))
+    {
+        larguraP = SDL_min(larguraP, area_tela.w * 9 / 10);
+        alturaP = SDL_min(alturaP, area_tela.h * 9 / 10);
+    }
 
-    SDL_Window *win_main = SDL_CreateWindow("Janela Principal", larguraP, alturaP, 0);
+    SDL_Window *win_main = SDL_CreateWindow("Janela Principal", larguraP, alturaP, SDL_WINDOW_RESIZABLE);
     if (!win_main)
     {
         fprintf(stderr, "Erro janela principal\n");
@@ -405,10 +6263,13 @@ int main(int argc, char *argv[])
         goto FIM_ERRO2;
     }
 
-    SDL_Texture *tex_original = SDL_CreateTextureFromSurface(rend_main, img_cinza);
-    if (!tex_original)
+    // Com vsync, o arraste e o zoom andam no ritmo da tela sem girar a CPU à toa
+    SDL_SetRenderVSync(rend_main, 1);
+
+    PiramideMip pir_original;
+    if (!construir_piramide(&pir_original, img_cinza))
     {
-        fprintf(stderr, "Erro textura original\n");
+        fprintf(stderr, "Erro pirâmide original\n");
         goto FIM_ERRO3;
     }
 
@@ -437,57 +6298,239 @@ int main(int argc, char *argv[])
     SDL_Color cor = {200, 200, 200, 255};
 
     /* --------------------- Histogramas e equalização -------------------- */
-    int hist_orig[NIVEIS], hist_eq[NIVEIS];
-    calcular_histograma(img_cinza, hist_orig);
-    int max_orig = 0;
+    Sint64 hist_eq[NIVEIS];
+    Sint64 max_orig = 0;
     for (int i = 0; i < NIVEIS; i++)
         if (hist_orig[i] > max_orig)
             max_orig = hist_orig[i];
 
-    int lut[NIVEIS];
-    gerar_lut_equalizacao(hist_orig, img_cinza->w * img_cinza->h, lut);
-    SDL_Surface *img_eq = aplicar_lut(img_cinza, lut);
+    ImagemCinza16 *img_eq16 = img16 ? equalizar_imagem16(img16) : NULL;
+    ImagemCinza *img_eq = img16 ? (img_eq16 ? reduzir_para_8bits(img_eq16) : NULL) : equalizar_imagem(img_cinza, hist_orig);
     if (!img_eq)
     {
         fprintf(stderr, "Erro ao equalizar.\n");
         goto FIM_ERRO7;
     }
     calcular_histograma(img_eq, hist_eq);
-    int max_eq = 0;
+    Sint64 max_eq = 0;
     for (int i = 0; i < NIVEIS; i++)
         if (hist_eq[i] > max_eq)
             max_eq = hist_eq[i];
 
-    SDL_Texture *tex_equalizada = SDL_CreateTextureFromSurface(rend_main, img_eq);
-    if (!tex_equalizada)
+    PiramideMip pir_equalizada = {0};
+    if (!construir_piramide(&pir_equalizada, img_eq))
     {
-        fprintf(stderr, "Erro textura equalizada\n");
+        fprintf(stderr, "Erro pirâmide equalizada\n");
         goto FIM_ERRO8;
     }
 
+    // Índices das pirâmides no visualizador: 0 = original, 1 = equalizada
+    Visualizador vis;
+    iniciar_visualizador(&vis, rend_main, &pir_original, &pir_equalizada);
+    ajustar_visualizador(&vis);
+    bool arrastando = false;
+
     bool usando_equalizada = false;
+    CacheHistograma cache_hist_orig = {0}, cache_hist_eq = {0};
+    CacheTexto cache_texto = {.renderer = rend_sec};
+    ModoEqualizacao modo_eq = EQ_GLOBAL;
+    ParametrosClahe clahe = {8, 8, 2.0};
+    int raio_local = 50;
+
+    GravadorPng gravador;
+    if (!iniciar_gravador(&gravador))
+        fprintf(stderr, "Sem thread de gravação, o S vai salvar na hora: %s\n", SDL_GetError());
+    int ultima_porcentagem = -1;
 
     bool quit = false;
     SDL_Event event;
 
     // IDs das janelas para checar de onde veio o clique
+    SDL_WindowID id_main = SDL_GetWindowID(win_main);
     SDL_WindowID id_sec = SDL_GetWindowID(win_sec);
 
+    // Cada janela só é redesenhada quando algo que ela mostra muda
+    bool sujo_main = true, sujo_sec = true;
+
     while (!quit)
 {
-    while (SDL_PollEvent(&event))
+    // Com as duas janelas em dia, dorme até o próximo evento; senão só esvazia a fila
+    // Com um PNG em gravação, acorda a cada 100 ms para atualizar o progresso
+    int espera = (sujo_main || sujo_sec) ? 0 : ultima_porcentagem >= 0 || gravador_ocupado(&gravador) ? 100 : -1;
+    bool tem_evento = SDL_WaitEventTimeout(&event, espera);
+    for (; tem_evento; tem_evento = SDL_PollEvent(&event))
     {
         if (event.type == SDL_EVENT_QUIT)
             quit = true;
 
+        if (gravador.thread && event.type == gravador.evento)
+            relatar_gravacao(&event);
+
+        // Conteúdo perdido, janela reexibida ou redimensionada
+        if (event.type == SDL_EVENT_WINDOW_EXPOSED || event.type == SDL_EVENT_WINDOW_SHOWN ||
+            event.type == SDL_EVENT_WINDOW_RESTORED || event.type == SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED)
+        {
+            if (event.window.windowID == id_main)
+                sujo_main = true;
+            else if (event.window.windowID == id_sec)
+                sujo_sec = true;
+        }
+        if (event.type == SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED && event.window.windowID == id_main)
+        {
+            SDL_GetCurrentRenderOutputSize(rend_main, &vis.largura_janela, &vis.altura_janela);
+            limitar_visualizador(&vis);
+        }
+
+        /* Na janela principal, a roda dá zoom em torno do cursor e o botão esquerdo
+           arrasta a imagem. As coordenadas passam para pixels do renderer. */
+        if ((event.type == SDL_EVENT_MOUSE_WHEEL && event.wheel.windowID == id_main) ||
+            (event.type == SDL_EVENT_MOUSE_MOTION && event.motion.windowID == id_main) ||
+            ((event.type == SDL_EVENT_MOUSE_BUTTON_DOWN || event.type == SDL_EVENT_MOUSE_BUTTON_UP) &&
+             event.button.windowID == id_main))
+        {
+            SDL_ConvertEventToRenderCoordinates(rend_main, &event);
+            if (event.type == SDL_EVENT_MOUSE_WHEEL && event.wheel.y != 0)
+            {
+                zoom_em_torno(&vis, SDL_pow(1.25, event.wheel.y), event.wheel.mouse_x, event.wheel.mouse_y);
+                sujo_main = true;
+            }
+            else if ((event.type == SDL_EVENT_MOUSE_BUTTON_DOWN || event.type == SDL_EVENT_MOUSE_BUTTON_UP) &&
+                     event.button.button == SDL_BUTTON_LEFT)
+                arrastando = event.type == SDL_EVENT_MOUSE_BUTTON_DOWN;
+            else if (event.type == SDL_EVENT_MOUSE_MOTION && arrastando)
+            {
+                vis.origem_x -= event.motion.xrel / vis.zoom;
+                vis.origem_y -= event.motion.yrel / vis.zoom;
+                limitar_visualizador(&vis);
+                sujo_main = true;
+            }
+        }
+
+        // O driver pode descartar o conteúdo das texturas alvo; o cache é refeito no próximo quadro
+        if (event.type == SDL_EVENT_RENDER_TARGETS_RESET || event.type == SDL_EVENT_RENDER_DEVICE_RESET)
+        {
+            destruir_cache_histograma(&cache_hist_orig);
+            destruir_cache_histograma(&cache_hist_eq);
+            limpar_cache_texto(&cache_texto);
+            if (event.type == SDL_EVENT_RENDER_DEVICE_RESET)
+                liberar_ladrilhos(&vis);
+            sujo_main = sujo_sec = true;
+        }
+
         // Salvar imagem ao pressionar 'S'
         if (event.type == SDL_EVENT_KEY_DOWN) {
     if (event.key.key == SDLK_S) {
-        SDL_Surface *to_save = usando_equalizada ? img_eq : img_cinza;
-        if (IMG_SavePNG(to_save, "output_image.png") == 1)
-            printf("Imagem salva como 'output_image.png'\n");
-        else
+        const ImagemCinza *to_save = usando_equalizada ? img_eq : img_cinza;
+        // Com PGM de 16 bits, original e equalização global são gravadas em 16 bits
+        const ImagemCinza16 *to_save16 = usando_equalizada ? img_eq16 : img16;
+        bool substituido = false;
+        if (!gravador.thread)
+        {
+            // Sem a thread gravadora, grava aqui mesmo
+            if (to_save16 ? salvar_png_cinza16(to_save16, "output_image.png", &opcoes_png, NULL)
+                          : salvar_imagem_cinza(to_save, "output_image.png"))
+                printf("Imagem salva como 'output_image.png'\n");
+            else
+                fprintf(stderr, "Erro ao salvar PNG: %s\n", SDL_GetError());
+        }
+        else if (!pedir_gravacao(&gravador, to_save, to_save16, "output_image.png", &opcoes_png, &substituido))
             fprintf(stderr, "Erro ao salvar PNG: %s\n", SDL_GetError());
+        else if (substituido)
+            printf("Pedido de salvamento anterior substituído pelo atual\n");
+    }
+
+    // + e - dão zoom no centro da janela, 0 cabe a imagem inteira e 1 mostra em 100%
+    if (event.key.key == SDLK_EQUALS || event.key.key == SDLK_PLUS || event.key.key == SDLK_KP_PLUS ||
+        event.key.key == SDLK_MINUS || event.key.key == SDLK_KP_MINUS)
+    {
+        bool aproximar = event.key.key != SDLK_MINUS && event.key.key != SDLK_KP_MINUS;
+        zoom_em_torno(&vis, aproximar ? 1.25 : 0.8, vis.largura_janela / 2.0, vis.altura_janela / 2.0);
+        sujo_main = true;
+    }
+    else if (event.key.key == SDLK_0)
+    {
+        ajustar_visualizador(&vis);
+        sujo_main = true;
+    }
+    else if (event.key.key == SDLK_1)
+    {
+        zoom_em_torno(&vis, 1.0 / vis.zoom, vis.largura_janela / 2.0, vis.altura_janela / 2.0);
+        sujo_main = true;
+    }
+
+    /* C liga/desliga o CLAHE e L a equalização local. No CLAHE as setas ajustam o
+       limite (cima/baixo) e a grade (lados); na local, as setas para os lados mudam o raio */
+    bool refazer = false;
+    if (event.key.key == SDLK_C || event.key.key == SDLK_L)
+    {
+        ModoEqualizacao m = event.key.key == SDLK_C ? EQ_CLAHE : EQ_LOCAL;
+        modo_eq = modo_eq == m ? EQ_GLOBAL : m;
+        refazer = true;
+    }
+    else if (modo_eq == EQ_CLAHE && (event.key.key == SDLK_UP || event.key.key == SDLK_DOWN))
+    {
+        clahe.limite_corte += event.key.key == SDLK_UP ? 0.5 : -0.5;
+        if (clahe.limite_corte < 1.0)
+            clahe.limite_corte = 1.0;
+        refazer = true;
+    }
+    else if (modo_eq == EQ_CLAHE && (event.key.key == SDLK_LEFT || event.key.key == SDLK_RIGHT))
+    {
+        int g = clahe.grade_x + (event.key.key == SDLK_RIGHT ? 1 : -1);
+        clahe.grade_x = clahe.grade_y = SDL_clamp(g, 1, MAX_GRADE_CLAHE);
+        refazer = true;
+    }
+    else if (modo_eq == EQ_LOCAL && (event.key.key == SDLK_LEFT || event.key.key == SDLK_RIGHT))
+    {
+        raio_local = SDL_clamp(raio_local + (event.key.key == SDLK_RIGHT ? 5 : -5), 5, MAX_RAIO_LOCAL);
+        refazer = true;
+    }
+
+    if (refazer)
+    {
+        Uint64 inicio = SDL_GetTicks();
+        // CLAHE e local trabalham sobre a versão de 8 bits; a global usa os 16 bits quando há
+        ImagemCinza16 *nova16 = img16 && modo_eq == EQ_GLOBAL ? equalizar_imagem16(img16) : NULL;
+        ImagemCinza *nova = modo_eq == EQ_CLAHE  ? equalizar_clahe(img_cinza, &clahe)
+                            : modo_eq == EQ_LOCAL ? equalizar_local(img_cinza, raio_local)
+                            : img16               ? (nova16 ? reduzir_para_8bits(nova16) : NULL)
+                                                  : equalizar_imagem(img_cinza, hist_orig);
+        if (nova)
+        {
+            /* A pirâmide e as texturas são reaproveitadas: só a região que mudou é
+               recalculada nos níveis e reenviada quando os ladrilhos forem desenhados */
+            SDL_Rect alterada;
+            bool mudou = regiao_alterada(img_eq, nova, &alterada);
+            destruir_imagem_cinza(img_eq);
+            destruir_imagem_cinza16(img_eq16);
+            img_eq = nova;
+            img_eq16 = nova16;
+            atualizar_piramide(&pir_equalizada, img_eq, &alterada);
+            if (mudou)
+                marcar_ladrilhos_sujos(&vis, 1, &alterada);
+            calcular_histograma(img_eq, hist_eq);
+            max_eq = 0;
+            for (int i = 0; i < NIVEIS; i++)
+                if (hist_eq[i] > max_eq)
+                    max_eq = hist_eq[i];
+            invalidar_cache_histograma(&cache_hist_eq);
+            usando_equalizada = true;
+            sujo_main = sujo_sec = true;
+            Uint64 ms = SDL_GetTicks() - inicio;
+            if (modo_eq == EQ_CLAHE)
+                printf("CLAHE %dx%d, limite %.1f: %llu ms\n", clahe.grade_x, clahe.grade_y, clahe.limite_corte,
+                       (unsigned long long)ms);
+            else if (modo_eq == EQ_LOCAL)
+                printf("Equalização local, raio %d: %llu ms\n", raio_local, (unsigned long long)ms);
+            else
+                printf("Equalização global\n");
+        }
+        else
+        {
+            fprintf(stderr, "Erro ao refazer a equalização: %s\n", SDL_GetError());
+            destruir_imagem_cinza(nova);
+            destruir_imagem_cinza16(nova16);
+        }
     }
 }
 
@@ -518,56 +6561,94 @@ int main(int argc, char *argv[])
                     my >= button.y && my <= (button.y + button.h))
                 {
                     usando_equalizada = !usando_equalizada;
+                    sujo_main = sujo_sec = true;
                 }
             }
         }
     }
 
+    if (quit)
+        break;
+
+    // Progresso da gravação no título da janela principal
+    int porcentagem = porcentagem_gravacao(&gravador);
+    if (porcentagem != ultima_porcentagem)
+    {
+        char titulo_janela[64];
+        if (porcentagem < 0)
+            SDL_strlcpy(titulo_janela, "Janela Principal", sizeof(titulo_janela));
+        else
+            SDL_snprintf(titulo_janela, sizeof(titulo_janela), "Janela Principal - salvando %d%%", porcentagem);
+        SDL_SetWindowTitle(win_main, titulo_janela);
+        ultima_porcentagem = porcentagem;
+    }
+
     // --- Render principal (imagem) ---
-    SDL_SetRenderDrawColor(rend_main, 0, 0, 0, 255);
-    SDL_RenderClear(rend_main);
-    SDL_FRect rect = {0, 0, (float)larguraP, (float)alturaP};
-    SDL_RenderTexture(rend_main, usando_equalizada ? tex_equalizada : tex_original, NULL, &rect);
-    SDL_RenderPresent(rend_main);
+    if (sujo_main)
+    {
+        SDL_SetRenderDrawColor(rend_main, 0, 0, 0, 255);
+        SDL_RenderClear(rend_main);
+        // Ladrilhos que ficaram para depois mantêm a janela suja até todos subirem
+        bool completo = desenhar_visualizador(&vis, usando_equalizada ? 1 : 0);
+        SDL_RenderPresent(rend_main);
+        sujo_main = !completo;
+    }
 
     // --- Render secundária (UI) ---
-    SDL_SetRenderDrawColor(rend_sec, 240, 240, 240, 255);
-    SDL_RenderClear(rend_sec);
-
-    const float padding = 10.0f;
-    const float tituloAltura = 22.0f;
-    const float espacamento = 10.0f;
-    const float botaoAltura = 48.0f;
-
-    SDL_FRect areaHist = {
-        padding,
-        padding + tituloAltura + espacamento,
-        larguraS - 2 * padding,
-        alturaS - (padding + tituloAltura + espacamento) - (espacamento + botaoAltura + padding)};
-    if (areaHist.h < 40)
-        areaHist.h = 40;
-
-    if (usando_equalizada)
-        render_histograma(rend_sec, hist_eq, max_eq, areaHist);
-    else
-        render_histograma(rend_sec, hist_orig, max_orig, areaHist);
+    if (sujo_sec)
+    {
+        SDL_SetRenderDrawColor(rend_sec, 240, 240, 240, 255);
+        SDL_RenderClear(rend_sec);
 
-    render_texto(rend_sec, usando_equalizada ? "Histograma (Equalizada)" : "Histograma (Original)",
-                 padding, padding, fonte, cor);
+        const float padding = 10.0f;
+        const float tituloAltura = 22.0f;
+        const float espacamento = 10.0f;
+        const float botaoAltura = 48.0f;
 
-    SDL_FRect button = {padding, areaHist.y + areaHist.h + espacamento, larguraS - 2 * padding, botaoAltura};
-    SDL_SetRenderDrawColor(rend_sec, 0, 120, 255, 255);
-    SDL_RenderFillRect(rend_sec, &button);
-    render_texto(rend_sec, usando_equalizada ? "Voltar para Original" : "Equalizar",
-                 button.x + 16, button.y + 12, fonte, (SDL_Color){255, 255, 255, 255});
+        SDL_FRect areaHist = {
+            padding,
+            padding + tituloAltura + espacamento,
+            larguraS - 2 * padding,
+            alturaS - (padding + tituloAltura + espacamento) - (espacamento + botaoAltura + padding)};
+        if (areaHist.h < 40)
+            areaHist.h = 40;
 
-    SDL_RenderPresent(rend_sec);
+        if (usando_equalizada)
+            render_histograma_cache(rend_sec, &cache_hist_eq, hist_eq, max_eq, areaHist);
+        else
+            render_histograma_cache(rend_sec, &cache_hist_orig, hist_orig, max_orig, areaHist);
+
+        const char *titulo = "Histograma (Original)";
+        if (usando_equalizada)
+            titulo = modo_eq == EQ_CLAHE ? "Histograma (CLAHE)"
+                     : modo_eq == EQ_LOCAL ? "Histograma (Local)"
+                                           : "Histograma (Equalizada)";
+        render_texto(&cache_texto, titulo, padding, padding, fonte, cor);
 
-    SDL_Delay(16);
+        SDL_FRect button = {padding, areaHist.y + areaHist.h + espacamento, larguraS - 2 * padding, botaoAltura};
+        SDL_SetRenderDrawColor(rend_sec, 0, 120, 255, 255);
+        SDL_RenderFillRect(rend_sec, &button);
+        render_texto(&cache_texto, usando_equalizada ? "Voltar para Original" : "Equalizar",
+                     button.x + 16, button.y + 12, fonte, (SDL_Color){255, 255, 255, 255});
+
+        SDL_RenderPresent(rend_sec);
+        sujo_sec = false;
+    }
 }
 
+    // Os pedidos que ainda estão na fila são gravados antes do de saída
+    if (gravador.thread)
+    {
+        encerrar_gravador(&gravador);
+        SDL_Event ev;
+        while (SDL_PeepEvents(&ev, 1, SDL_GETEVENT, gravador.evento, gravador.evento) == 1)
+            relatar_gravacao(&ev);
+    }
+
     // salva a última imagem mostrada (opcional)
-    if (!IMG_SavePNG(usando_equalizada ? img_eq : img_cinza, "saida.png"))
+    const ImagemCinza16 *saida16 = usando_equalizada ? img_eq16 : img16;
+    if (!(saida16 ? salvar_png_cinza16(saida16, "saida.png", &opcoes_png, NULL)
+                  : salvar_imagem_cinza(usando_equalizada ? img_eq : img_cinza, "saida.png")))
     {
         fprintf(stderr, "Erro ao salvar PNG: %s\n", SDL_GetError());
     }
@@ -576,25 +6657,32 @@ int main(int argc, char *argv[])
         printf("Imagem salva como 'saida.png'\n");
     }
 
+    limpar_cache_texto(&cache_texto);
+    destruir_cache_histograma(&cache_hist_eq);
+    destruir_cache_histograma(&cache_hist_orig);
+    liberar_ladrilhos(&vis);
+
     // limpeza
     FIM_ERRO8:
-        SDL_DestroyTexture(tex_equalizada);
+        destruir_piramide(&pir_equalizada);
     FIM_ERRO7:
-        SDL_DestroySurface(img_eq);
+        destruir_imagem_cinza(img_eq);
+        destruir_imagem_cinza16(img_eq16);
     FIM_ERRO6:
         TTF_CloseFont(fonte);
     FIM_ERRO5:
         SDL_DestroyRenderer(rend_sec);
         SDL_DestroyWindow(win_sec);
     FIM_ERRO4:
-        SDL_DestroyTexture(tex_original);
+        destruir_piramide(&pir_original);
     FIM_ERRO3:
         SDL_DestroyRenderer(rend_main);
     FIM_ERRO2:
         SDL_DestroyWindow(win_main);
     FIM_ERRO1:
-    SDL_DestroySurface(img_cinza);
-    SDL_DestroySurface(imagem);
+    destruir_imagem_cinza(img_cinza);
+    destruir_imagem_cinza16(img16);
+    encerrar_pool();
     TTF_Quit();
     SDL_Quit();
     return 0;